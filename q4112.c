@@ -1,9 +1,21 @@
 #include <assert.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "q4112.h"
+#include "q4112_barrier.h"
+#include "q4112_hash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // COMS 4112 Project 2 Part 2
 // Shuo Wang (sw3135)
@@ -15,18 +27,259 @@ typedef struct {
   uint32_t val;
 } bucket_t;
 
-// bucket representation for global aggregation table
+// group of buckets for the SIMD-tagged (Swiss-style) join table: every
+// bucket has a tag byte (0 for empty, otherwise 0x80 | 7 hash bits) and the
+// 8 tag bytes of a group are compared with the tag of a key at once as one
+// 64-bit word; 7 buckets and their tags fill exactly one cache line, so a
+// probe usually touches a single cache line
+#define SWISS_SLOTS 7
+typedef struct {
+  union {
+    uint8_t tags[8];  // last tag is unused
+    uint64_t word;
+  } tags;
+  bucket_t slots[SWISS_SLOTS];
+} __attribute__((aligned(64))) swiss_group_t;
+
+// high bit of every tag byte that belongs to a bucket
+#define SWISS_HIGH_BITS 0x0080808080808080ull
+
+// fill rate of the SIMD-tagged join table (and the highest one, taken if
+// the table would not fit into the memory budget of the query otherwise)
+#define SWISS_FILL 0.9
+#define SWISS_MAX_FILL 0.95
+
+// bucket representation for direct-mapped aggregation array
+// (indexed by orders.store_id minus its smallest value)
 typedef struct {
-  uint32_t key;
   uint64_t sum;
-  uint32_t count;
-} bucket_aggr_t;
+  uint64_t count;
+} bucket_dense_t;
+
+// largest key range aggregated into private per-thread arrays
+#define DENSE_PRIVATE_GROUPS 16384
+
+// most groups aggregated into private accumulators of every thread when
+// the others go to a shared target (the heavy hitters of orders.store_id)
+#define HOT_KEYS 16
+
+// Heavy hitters: the estimation pass also feeds a sample of orders.store_id
+// and orders.item_id into a Space-Saving sketch per thread (SKETCH_COUNTERS
+// counters; a new key replaces the smallest counter and inherits its count
+// as error). The sample is a run of SKETCH_RUN keys (one cache line) out of
+// every SKETCH_STRIDE * SKETCH_RUN keys. The keys that are certainly at
+// least 1 / HOT_SHARE of the samples of all threads are hot (the HOT_KEYS
+// most frequent of them).
+#define SKETCH_COUNTERS 64
+#define SKETCH_STRIDE 256
+#define SKETCH_RUN 16
+#define SKETCH_MIN_SAMPLES 1024
+#define HOT_SHARE 64
+
+typedef struct {
+  uint32_t keys[SKETCH_COUNTERS];
+  uint32_t counts[SKETCH_COUNTERS];
+  uint32_t errors[SKETCH_COUNTERS];
+  uint32_t min_count;  // no counter is smaller (some may be equal)
+  size_t used;
+  size_t samples;
+} sketch_t;
+
+// hot keys of a column (the unused entries repeat the first key)
+typedef struct {
+  uint32_t keys[HOT_KEYS];
+  size_t num_keys;
+} hot_keys_t;
+
+// accumulator operations of the multi-aggregate target
+enum { ACC_SUM, ACC_MIN, ACC_MAX };
+
+// distinct (operation, argument) pairs of accumulators
+#define GROUP_ACCS 9
+
+// row layout of the multi-aggregate target for a set of aggregates: the
+// key, the count and one 64-bit accumulator per distinct (operation,
+// argument) pair that the aggregates need (AVG shares the sum of SUM on the
+// same argument, COUNT needs none)
+typedef struct {
+  size_t accs;
+  int op[GROUP_ACCS];
+  q4112_agg_arg_t arg[GROUP_ACCS];
+  size_t width;  // 64-bit words per row
+} group_layout_t;
+
+// private group table of a thread: open addressing with linear probing on
+// rows of the layout (key, count, accumulators), count 0 for empty rows
+typedef struct {
+  uint64_t* rows;
+  size_t buckets;
+  int8_t log_buckets;
+  q4112_hash_t hash;
+  size_t groups;
+} group_table_t;
+
+
+// state shared by the threads of one query (kept per query instead of in
+// globals, so that independent queries can run concurrently)
+typedef struct {
+  q4112_barrier_t barrier2;  // build, then matching
+  q4112_barrier_t barrier3;  // matching, then summing up
+  // next chunks of items and orders to take (inputs filled while the query
+  // runs)
+  size_t inner_chunk;
+  size_t outer_chunk;
+} q4112_query_t;
+
+// readiness of the chunks of a table (see header)
+struct q4112_ready {
+  size_t tuples;
+  size_t chunk_tuples;
+  size_t chunks;
+  uint8_t* ready;  // set with release order under the mutex
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+// phase times and join table size of a query run by q4112_run_threads (for
+// the roofline report; the last thread at a barrier takes the time)
+typedef struct {
+  uint64_t start_ns;
+  uint64_t build_end_ns;
+  uint64_t probe_end_ns;
+  uint64_t end_ns;
+  size_t table_bytes;
+} run_times_t;
+
+// memory arena of a query: its scratch memory is allocated from the arena
+// and freed to it with its size, which keeps the bytes in use within the
+// budget of the query and records their peaks (a NULL arena is plain
+// malloc and free without a budget)
+typedef struct {
+  size_t budget;  // (0 for none)
+  size_t used;
+  size_t peak;
+  size_t phase_peak[Q4112_PHASES];
+  q4112_phase_t phase;  // phase that the allocations are counted in
+  pthread_mutex_t mutex;
+} arena_t;
+
+static void arena_init(arena_t* arena, size_t budget) {
+  memset(arena, 0, sizeof(arena_t));
+  arena->budget = budget;
+  pthread_mutex_init(&arena->mutex, NULL);
+}
 
+static void arena_destroy(arena_t* arena) {
+  // every buffer of the query is freed to the arena
+  assert(arena->used == 0);
+  pthread_mutex_destroy(&arena->mutex);
+}
+
+// bytes that can still be allocated
+static size_t arena_available(arena_t* arena) {
+  if (arena == NULL || arena->budget == 0) return SIZE_MAX;
+  pthread_mutex_lock(&arena->mutex);
+  size_t available = arena->used < arena->budget ?
+      arena->budget - arena->used : 0;
+  pthread_mutex_unlock(&arena->mutex);
+  return available;
+}
+
+// count the bytes of an allocation (returns 0 if they exceed the budget)
+static int arena_take(arena_t* arena, size_t bytes) {
+  if (arena == NULL) return 1;
+  pthread_mutex_lock(&arena->mutex);
+  int fits = arena->budget == 0 || arena->used + bytes <= arena->budget;
+  if (fits) {
+    arena->used += bytes;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    if (arena->used > arena->phase_peak[arena->phase]) {
+      arena->phase_peak[arena->phase] = arena->used;
+    }
+  }
+  pthread_mutex_unlock(&arena->mutex);
+  return fits;
+}
+
+static void arena_give(arena_t* arena, size_t bytes) {
+  if (arena == NULL) return;
+  pthread_mutex_lock(&arena->mutex);
+  assert(arena->used >= bytes);
+  arena->used -= bytes;
+  pthread_mutex_unlock(&arena->mutex);
+}
+
+// start counting the allocations in a phase (the bytes already allocated
+// are in use during the phase)
+static void arena_phase(arena_t* arena, q4112_phase_t phase) {
+  if (arena == NULL) return;
+  pthread_mutex_lock(&arena->mutex);
+  arena->phase = phase;
+  if (arena->used > arena->phase_peak[phase]) {
+    arena->phase_peak[phase] = arena->used;
+  }
+  pthread_mutex_unlock(&arena->mutex);
+}
+
+// allocate zeroed or uninitialized memory, or memory aligned to align bytes
+// (not initialized) from the arena (NULL if it exceeds the budget or the
+// allocation fails)
+static void* arena_calloc(arena_t* arena, size_t bytes) {
+  if (!arena_take(arena, bytes)) return NULL;
+  void* ptr = calloc(bytes, 1);
+  if (ptr == NULL) arena_give(arena, bytes);
+  return ptr;
+}
+
+static void* arena_malloc(arena_t* arena, size_t bytes) {
+  if (!arena_take(arena, bytes)) return NULL;
+  void* ptr = malloc(bytes);
+  if (ptr == NULL) arena_give(arena, bytes);
+  return ptr;
+}
+
+static void* arena_memalign(arena_t* arena, size_t align, size_t bytes) {
+  if (!arena_take(arena, bytes)) return NULL;
+  void* ptr = NULL;
+  if (posix_memalign(&ptr, align, bytes) != 0) {
+    arena_give(arena, bytes);
+    return NULL;
+  }
+  return ptr;
+}
+
+// free memory of the arena (bytes as allocated)
+static void arena_free(arena_t* arena, void* ptr, size_t bytes) {
+  if (ptr == NULL) return;
+  free(ptr);
+  arena_give(arena, bytes);
+}
+
+// start the memory report of a query (if not NULL) from its budget
+static void usage_init(q4112_usage_t* usage, size_t budget,
+                       q4112_table_t table) {
+  if (usage == NULL) return;
+  memset(usage, 0, sizeof(q4112_usage_t));
+  usage->budget_bytes = budget;
+  usage->table = table;
+  usage->aggr_passes = 1;
+}
+
+// copy the peaks of the arena of a query to its memory report
+static void usage_peaks(q4112_usage_t* usage, const arena_t* arena) {
+  if (usage == NULL) return;
+  usage->peak_bytes = arena->peak;
+  memcpy(usage->phase_peak_bytes, arena->phase_peak,
+         sizeof(usage->phase_peak_bytes));
+}
 
 // thread info structure for creating threads and transferring useful
 // information
-typedef struct {
+typedef struct q4112_run_info_hj q4112_run_info_hj_t;
+
+struct q4112_run_info_hj {
   pthread_t id;
+  q4112_query_t* query;
   int thread;
   int threads;
   size_t inner_tuples;
@@ -36,17 +289,96 @@ typedef struct {
   const uint32_t* outer_keys;
   const uint32_t* outer_vals;
   const uint32_t* outer_aggr_keys;
+  // predicates of the query (combined with AND)
+  const q4112_predicate_t* predicates;
+  size_t num_predicates;
+  // bit-packed outer columns (used instead of the arrays if not NULL)
+  const q4112_packed_t* packed_keys;
+  const q4112_packed_t* packed_vals;
+  const q4112_packed_t* packed_aggr_keys;
   uint64_t sum;
-  uint32_t count;
+  uint64_t count;
   uint64_t sum_avgs;
-  uint32_t num_groups;
+  uint64_t num_groups;
+  size_t new_groups;
+  int finalize;
   bucket_t* table;  // not const since table is mutable
   int8_t log_buckets;
   size_t buckets;
+  // hash function of the join, aggregation and group tables
+  q4112_hash_t hash;
+  // join table built beforehand (e.g. an attached snapshot): only probed
+  int prebuilt;
+  // threads that split the inner and the outer tuples (0 for all threads,
+  // the others only take part in the partitioned insert and summing up)
+  int build_threads;
+  int probe_threads;
+  // chunks of the inner and outer columns filled while the query runs
+  // (NULL if they are filled)
+  q4112_ready_t* inner_ready;
+  q4112_ready_t* outer_ready;
+  // build side and tuning options of the plan, and its report
+  q4112_side_t side;
+  int fixed_threads;
+  q4112_plan_t* plan;
+  // roofline report and the phase times of the threads (NULL for none)
+  q4112_roofline_t* roofline;
+  run_times_t* times;
+  // memory budget and report of the options, and the arena of the scratch
+  // memory of the query (NULL for plain allocations)
+  size_t memory_budget;
+  q4112_usage_t* usage;
+  arena_t* arena;
+  // SIMD-tagged join table (used instead of table if not NULL) and its
+  // fill rate (0 for SWISS_FILL)
+  q4112_table_t table_layout;
+  swiss_group_t* swiss;
+  size_t swiss_groups;
+  double swiss_fill;
+  // partitioned build: inner tuples scattered to the owner of their slot,
+  // tuples of each thread per owner and the next scatter offset of each
+  // thread per owner (threads x threads each), and the tuples of this
+  // thread that overflowed its range
+  q4112_build_t build;
+  bucket_t* scatter;
+  size_t* owner_counts;
+  size_t spill_beg;
+  size_t spill_end;
+  const q4112_run_info_hj_t* all;  // info of all threads
+  // bitmaps of the inner tuples of each thread that pass the predicates on
+  // items.price (inner_sel_words per thread, NULL if there are none)
+  uint64_t* inner_sel;
+  size_t inner_sel_words;
   bucket_aggr_t* aggr_table;
   size_t aggr_buckets;
   int8_t log_aggr_buckets;
-} q4112_run_info_hj_t;
+  // occupied buckets of aggr_table, a bit per bucket set by the thread that
+  // creates its group (NULL if the table is not summed up by the query)
+  uint64_t* aggr_live;
+  // aggregation in passes over orders (aggr_parts > 1): this pass only
+  // takes the orders whose hash of orders.store_id has the bits of
+  // aggr_part below those that pick their bucket in aggr_table
+  size_t aggr_parts;
+  size_t aggr_part;
+  int8_t log_aggr_parts;
+  // direct-mapped aggregation (used instead of aggr_table if not NULL)
+  bucket_dense_t* dense_table;
+  size_t dense_groups;
+  uint32_t dense_min;
+  int dense_private;  // one array of dense_groups per thread
+  // heavy hitters of orders.store_id with a shared target: aggregated into
+  // accumulators of this thread and added to the target after probing
+  hot_keys_t hot;
+  uint64_t hot_sums[HOT_KEYS];
+  uint64_t hot_counts[HOT_KEYS];
+  // multi-aggregate target (used instead of the others if not NULL): row
+  // layout, private group tables of all threads and the result columns
+  const group_layout_t* group_layout;
+  group_table_t* group_tables;
+  const q4112_agg_t* aggs;
+  size_t num_aggs;
+  q4112_groups_t* groups;
+};
 
 typedef struct {
   pthread_t id;
@@ -54,17 +386,23 @@ typedef struct {
   int threads;
   size_t outer_tuples;
   const uint32_t* outer_aggr_keys;
+  const q4112_packed_t* packed_aggr_keys;
+  q4112_hash_t hash;  // of the partitions
+  // heavy hitter sketches of the aggregation keys and of a sampled column
+  // (NULL if not wanted)
+  sketch_t* aggr_sketch;
+  const uint32_t* sample_keys;
+  sketch_t* sample_sketch;
   int8_t log_partitions;
   size_t partitions;
   uint32_t* bitmaps;
+  uint32_t* bitmaps_local;  // (partitions of this thread, zeroed)
+  q4112_barrier_t* barrier;
   size_t sum_local;
+  uint32_t min_local;
+  uint32_t max_local;
 } q4112_estimation_info_hj_t;
 
-// the barrier to control the threads
-static pthread_barrier_t barrier;
-static pthread_barrier_t barrier2;
-static pthread_barrier_t barrier3;
-
 
 uint32_t trailing_zero_count(uint32_t bitmap) {
   if (bitmap == 0) {
@@ -109,6 +447,219 @@ size_t estimate_original(const uint32_t* keys, size_t size) {
 }
 
 
+// The estimation, build and probe kernels below are specialized at compile
+// time: their layout and target parameters are constants at every call site and
+// the kernels are always inlined, so every instantiation is a loop without
+// branches on them. The build dispatcher and the pipeline plan pick the
+// instantiation once per call. The hash function is a constant of the
+// instantiations for multiplicative hashing (the default) and a parameter of
+// the ones for the other hash functions.
+#define KERNEL static inline __attribute__((always_inline))
+
+// decode a block of packed orders.store_id (the codes of a dictionary are
+// used as group keys directly, shifted by one since 0 means empty bucket)
+static void unpack_aggr_keys(const q4112_packed_t* col, size_t block,
+                             uint32_t* out) {
+  if (col->dict == NULL) {
+    q4112_unpack_block(col, block, out);
+    return;
+  }
+  q4112_unpack_codes(col, block, out);
+  size_t i;
+  for (i = 0; i != Q4112_PACK_BLOCK; ++i) {
+    out[i] += 1;
+  }
+}
+
+// count a key in a Space-Saving sketch
+static void sketch_add(sketch_t* sketch, uint32_t key) {
+  size_t i, min = 0;
+  sketch->samples += 1;
+#ifdef __SSE2__
+  // unused counters (key 0) follow the used ones, so the first match of
+  // a key is its counter if it has one
+  __m128i k = _mm_set1_epi32(key);
+  const __m128i* keys = (const __m128i*) sketch->keys;
+  for (i = 0; i != SKETCH_COUNTERS / 4; ++i) {
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(
+        _mm_cmpeq_epi32(_mm_loadu_si128(&keys[i]), k)));
+    if (mask != 0) {
+      size_t c = 4 * i + __builtin_ctz(mask);
+      if (c < sketch->used) {
+        sketch->counts[c] += 1;
+        return;
+      }
+      break;
+    }
+  }
+#else
+  for (i = 0; i != sketch->used; ++i) {
+    if (sketch->keys[i] == key) {
+      sketch->counts[i] += 1;
+      return;
+    }
+  }
+#endif
+  if (sketch->used != SKETCH_COUNTERS) {
+    i = sketch->used++;
+    sketch->keys[i] = key;
+    sketch->counts[i] = 1;
+    sketch->errors[i] = 0;
+    return;
+  }
+  // replace a counter with the minimum count (when all counters with it
+  // have been incremented since, recompute the minimum)
+  for (;;) {
+#ifdef __SSE2__
+    __m128i m = _mm_set1_epi32(sketch->min_count);
+    const __m128i* counts = (const __m128i*) sketch->counts;
+    int mask = 0;
+    for (i = 0; i != SKETCH_COUNTERS / 4 && mask == 0; ++i) {
+      mask = _mm_movemask_ps(_mm_castsi128_ps(
+          _mm_cmpeq_epi32(_mm_loadu_si128(&counts[i]), m)));
+    }
+    if (mask != 0) {
+      min = 4 * (i - 1) + __builtin_ctz(mask);
+      break;
+    }
+#else
+    for (i = 0; i != SKETCH_COUNTERS; ++i) {
+      if (sketch->counts[i] == sketch->min_count) break;
+    }
+    if (i != SKETCH_COUNTERS) {
+      min = i;
+      break;
+    }
+#endif
+    for (i = 1; i != SKETCH_COUNTERS; ++i) {
+      if (sketch->counts[i] < sketch->counts[min]) min = i;
+    }
+    sketch->min_count = sketch->counts[min];
+  }
+  sketch->keys[min] = key;
+  sketch->errors[min] = sketch->counts[min];
+  sketch->counts[min] += 1;
+}
+
+// count the sample of the keys [beg, end) of a column in a sketch
+static void sketch_sample(sketch_t* sketch, const uint32_t* keys,
+                          size_t beg, size_t end) {
+  size_t i, j;
+  for (i = beg; i < end; i += SKETCH_STRIDE * SKETCH_RUN) {
+    size_t run_end = end - i > SKETCH_RUN ? i + SKETCH_RUN : end;
+    for (j = i; j != run_end; ++j) {
+      sketch_add(sketch, keys[j]);
+    }
+  }
+}
+
+// counter of a merged sketch (with the smallest counts of the full
+// sketches that have the key)
+typedef struct {
+  uint32_t key;
+  size_t count;
+  size_t error;
+  size_t present_min;
+} sketch_counter_t;
+
+static int compare_counter_keys(const void* a, const void* b) {
+  uint32_t x = ((const sketch_counter_t*) a)->key;
+  uint32_t y = ((const sketch_counter_t*) b)->key;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_counter_counts(const void* a, const void* b) {
+  size_t x = ((const sketch_counter_t*) a)->count;
+  size_t y = ((const sketch_counter_t*) b)->count;
+  return x > y ? -1 : x < y;
+}
+
+// hot keys of the sketches of all threads: counters of the same key are
+// added up (a key missing from a full sketch may have had up to the
+// smallest count of that sketch, which is added to its error)
+// (counters has room for the counters of all sketches)
+static void sketch_hot_keys(const sketch_t* sketches, size_t threads,
+                            sketch_counter_t* counters, hot_keys_t* hot) {
+  size_t t, i, n = 0, samples = 0, missing_error = 0;
+  for (t = 0; t != threads; ++t) {
+    const sketch_t* sketch = &sketches[t];
+    samples += sketch->samples;
+    uint32_t min = 0;
+    if (sketch->used == SKETCH_COUNTERS) {
+      min = sketch->counts[0];
+      for (i = 1; i != SKETCH_COUNTERS; ++i) {
+        if (sketch->counts[i] < min) min = sketch->counts[i];
+      }
+      missing_error += min;
+    }
+    for (i = 0; i != sketch->used; ++i) {
+      counters[n].key = sketch->keys[i];
+      counters[n].count = sketch->counts[i];
+      counters[n].error = sketch->errors[i];
+      counters[n].present_min = min;
+      n += 1;
+    }
+  }
+  hot->num_keys = 0;
+  if (samples >= SKETCH_MIN_SAMPLES) {
+    qsort(counters, n, sizeof(sketch_counter_t), compare_counter_keys);
+    size_t merged = 0;
+    for (i = 0; i != n; ++i) {
+      if (merged != 0 && counters[merged - 1].key == counters[i].key) {
+        counters[merged - 1].count += counters[i].count;
+        counters[merged - 1].error += counters[i].error;
+        counters[merged - 1].present_min += counters[i].present_min;
+      } else {
+        counters[merged++] = counters[i];
+      }
+    }
+    qsort(counters, merged, sizeof(sketch_counter_t), compare_counter_counts);
+    for (i = 0; i != merged && hot->num_keys != HOT_KEYS; ++i) {
+      size_t error = counters[i].error + missing_error -
+                     counters[i].present_min;
+      if (counters[i].count < error ||
+          (counters[i].count - error) * HOT_SHARE < samples) break;
+      hot->keys[hot->num_keys++] = counters[i].key;
+    }
+  }
+  if (hot->num_keys == 0) hot->keys[0] = 0;
+  for (i = hot->num_keys; i != HOT_KEYS; ++i) {
+    hot->keys[i] = hot->keys[0];
+  }
+}
+
+// add keys to the partition bitmaps and the smallest and largest key
+KERNEL void estimate_keys(const uint32_t* keys, size_t beg, size_t end,
+                          uint32_t* bitmaps, int8_t log_partitions,
+                          size_t partitions, uint32_t* min, uint32_t* max,
+                          const q4112_hash_t hash) {
+  uint32_t min_local = *min, max_local = *max;
+  size_t i;
+  for (i = beg; i != end; ++i) {
+    if (keys[i] < min_local) min_local = keys[i];
+    if (keys[i] > max_local) max_local = keys[i];
+    uint32_t h = q4112_hash(hash, keys[i]);
+    size_t p = h & (partitions - 1);  // use some hash bits to partition
+    h >>= log_partitions;  // use remaining hash bits for the bitmap
+    bitmaps[p] |= h & -h;  // update bitmap of partition
+  }
+  *min = min_local;
+  *max = max_local;
+}
+
+static void estimate_range(const uint32_t* keys, size_t beg, size_t end,
+                           uint32_t* bitmaps, int8_t log_partitions,
+                           size_t partitions, uint32_t* min, uint32_t* max,
+                           q4112_hash_t hash) {
+  if (hash == Q4112_HASH_MULTIPLY) {
+    estimate_keys(keys, beg, end, bitmaps, log_partitions, partitions,
+                  min, max, Q4112_HASH_MULTIPLY);
+  } else {
+    estimate_keys(keys, beg, end, bitmaps, log_partitions, partitions,
+                  min, max, hash);
+  }
+}
+
 void* estimate_thread(void* arg) {
   q4112_estimation_info_hj_t* info = (q4112_estimation_info_hj_t*) arg;
   assert(pthread_equal(pthread_self(), info->id));
@@ -122,23 +673,63 @@ void* estimate_thread(void* arg) {
   uint32_t* bitmaps = info->bitmaps;
 
   const uint32_t* outer_aggr_keys = info->outer_aggr_keys;
+  const q4112_packed_t* packed_aggr_keys = info->packed_aggr_keys;
+  q4112_hash_t hash = info->hash;
 
   // phase 1: generate local bitmaps
 
-  uint32_t* bitmaps_local = calloc(partitions, 4);
-
-  // set thread boundaries for outer table
-  size_t aggr_keys_beg = (outer_tuples / threads) * (thread + 0);
-  size_t aggr_keys_end = (outer_tuples / threads) * (thread + 1);
-  // fix boundary for last thread
-  if (thread + 1 == threads) aggr_keys_end = outer_tuples;
+  uint32_t* bitmaps_local = info->bitmaps_local;
+  // smallest and largest key (to detect dense key domains)
+  uint32_t min_local = ~0u, max_local = 0;
 
   size_t i;
-  for (i = aggr_keys_beg; i != aggr_keys_end; ++i) {
-    uint32_t h = (uint32_t) (outer_aggr_keys[i] * 0x9e3779b1);
-    size_t p = h & (partitions - 1);  // use some hash bits to partition
-    h >>= log_partitions;  // use remaining hash bits for the bitmap
-    bitmaps_local[p] |= h & -h;  // update bitmap of partition
+  if (packed_aggr_keys != NULL) {
+    // set thread boundaries in blocks of the packed column
+    size_t blocks = (outer_tuples + Q4112_PACK_BLOCK - 1) / Q4112_PACK_BLOCK;
+    size_t blocks_beg = (blocks / threads) * (thread + 0);
+    size_t blocks_end = (blocks / threads) * (thread + 1);
+    if (thread + 1 == threads) blocks_end = blocks;
+
+    uint32_t aggr_keys[Q4112_PACK_BLOCK];
+    size_t b;
+    for (b = blocks_beg; b != blocks_end; ++b) {
+      unpack_aggr_keys(packed_aggr_keys, b, aggr_keys);
+      size_t block_tuples = outer_tuples - b * Q4112_PACK_BLOCK;
+      if (block_tuples > Q4112_PACK_BLOCK) block_tuples = Q4112_PACK_BLOCK;
+      estimate_range(aggr_keys, 0, block_tuples, bitmaps_local,
+                     log_partitions, partitions, &min_local, &max_local, hash);
+      // (the first run of every block)
+      if (info->aggr_sketch != NULL &&
+          b % (SKETCH_STRIDE * SKETCH_RUN / Q4112_PACK_BLOCK) == 0) {
+        sketch_sample(info->aggr_sketch, aggr_keys, 0, block_tuples);
+      }
+    }
+    if (info->sample_sketch != NULL) {
+      size_t sample_end = blocks_end * Q4112_PACK_BLOCK;
+      if (sample_end > outer_tuples) sample_end = outer_tuples;
+      sketch_sample(info->sample_sketch, info->sample_keys,
+                    blocks_beg * Q4112_PACK_BLOCK, sample_end);
+    }
+  } else {
+    // set thread boundaries for outer table
+    size_t aggr_keys_beg = (outer_tuples / threads) * (thread + 0);
+    size_t aggr_keys_end = (outer_tuples / threads) * (thread + 1);
+    // fix boundary for last thread
+    if (thread + 1 == threads) aggr_keys_end = outer_tuples;
+
+    estimate_range(outer_aggr_keys, aggr_keys_beg, aggr_keys_end,
+                   bitmaps_local, log_partitions, partitions,
+                   &min_local, &max_local, hash);
+
+    // sample the heavy hitter sketches
+    if (info->aggr_sketch != NULL) {
+      sketch_sample(info->aggr_sketch, outer_aggr_keys,
+                    aggr_keys_beg, aggr_keys_end);
+    }
+    if (info->sample_sketch != NULL) {
+      sketch_sample(info->sample_sketch, info->sample_keys,
+                    aggr_keys_beg, aggr_keys_end);
+    }
   }
 
   // phase 2: merge local bitmaps to global bitmaps
@@ -148,7 +739,7 @@ void* estimate_thread(void* arg) {
     }
   }
 
-  pthread_barrier_wait(&barrier);
+  q4112_barrier_wait(info->barrier);
 
   // phase 3: calculate estimation
 
@@ -163,310 +754,3840 @@ void* estimate_thread(void* arg) {
     sum_local += ((size_t) 1) << trailing_zero_count(~bitmaps[i]);
   }
   info->sum_local = sum_local;
-  free(bitmaps_local);
+  info->min_local = min_local;
+  info->max_local = max_local;
   pthread_exit(NULL);
 }
 
 
-size_t estimate(const uint32_t* outer_aggr_keys, size_t outer_tuples, int threads) {
+// estimate the distinct keys of a column (plain or bit-packed) and find its
+// smallest and largest key, and the hot keys of the column and of a
+// sampled column of the same tuples if hot_keys and hot_sample are not NULL
+// (returns SIZE_MAX if the scratch memory does not fit into the arena)
+static size_t estimate_columns(const uint32_t* outer_aggr_keys,
+                               const q4112_packed_t* packed_aggr_keys,
+                               size_t outer_tuples, int threads,
+                               q4112_hash_t hash, arena_t* arena,
+                               uint32_t* min_key, uint32_t* max_key,
+                               hot_keys_t* hot_keys,
+                               const uint32_t* sample_keys,
+                               hot_keys_t* hot_sample) {
   const int8_t log_partitions = 12;
   size_t t, partitions = 1 << log_partitions;
-  uint32_t* bitmaps = calloc(partitions, 4);
 
-  // allocate threads info
+  // allocate the global and the local bitmaps, threads info and sketches
+  size_t bitmaps_bytes = (threads + 1) * partitions * 4;
+  size_t info_bytes = threads * sizeof(q4112_estimation_info_hj_t);
+  size_t sketches_bytes = hot_keys != NULL ?
+      2 * threads * sizeof(sketch_t) : 0;
+  size_t counters_bytes = hot_keys != NULL ?
+      threads * SKETCH_COUNTERS * sizeof(sketch_counter_t) + 1 : 0;
+  uint32_t* bitmaps = (uint32_t*) arena_calloc(arena, bitmaps_bytes);
   q4112_estimation_info_hj_t* info = (q4112_estimation_info_hj_t*)
-      malloc(threads * sizeof(q4112_estimation_info_hj_t));
-  assert(info != NULL);
+      arena_malloc(arena, info_bytes);
+  sketch_t* sketches = NULL;
+  sketch_counter_t* counters = NULL;
+  if (hot_keys != NULL) {
+    sketches = (sketch_t*) arena_calloc(arena, sketches_bytes);
+    counters = (sketch_counter_t*) arena_malloc(arena, counters_bytes);
+  }
+  if (bitmaps == NULL || info == NULL ||
+      (hot_keys != NULL && (sketches == NULL || counters == NULL))) {
+    assert(arena != NULL);
+    arena_free(arena, bitmaps, bitmaps_bytes);
+    arena_free(arena, info, info_bytes);
+    arena_free(arena, sketches, sketches_bytes);
+    arena_free(arena, counters, counters_bytes);
+    return SIZE_MAX;
+  }
+  q4112_barrier_t barrier;
+  q4112_barrier_init(&barrier, threads);
 
   for (t = 0; t != threads; ++t) {
     info[t].thread = t;
     info[t].threads = threads;
     info[t].outer_aggr_keys = outer_aggr_keys;
+    info[t].packed_aggr_keys = packed_aggr_keys;
+    info[t].hash = hash;
     info[t].outer_tuples = outer_tuples;
     info[t].partitions = partitions;
     info[t].log_partitions = log_partitions;
     info[t].bitmaps = bitmaps;
+    info[t].bitmaps_local = &bitmaps[(t + 1) * partitions];
+    info[t].barrier = &barrier;
+    info[t].aggr_sketch = sketches != NULL ? &sketches[t] : NULL;
+    info[t].sample_keys = sample_keys;
+    info[t].sample_sketch = sketches != NULL && sample_keys != NULL ?
+        &sketches[threads + t] : NULL;
     pthread_create(&info[t].id, NULL, estimate_thread, &info[t]);
   }
 
   size_t sum = 0;
+  *min_key = ~0u;
+  *max_key = 0;
   for (t = 0; t != threads; ++t) {
     pthread_join(info[t].id, NULL);
     sum += info[t].sum_local;
+    if (info[t].min_local < *min_key) *min_key = info[t].min_local;
+    if (info[t].max_local > *max_key) *max_key = info[t].max_local;
   }
-  free(bitmaps);
+  if (sketches != NULL) {
+    sketch_hot_keys(sketches, threads, counters, hot_keys);
+    if (hot_sample != NULL) {
+      sketch_hot_keys(&sketches[threads], threads, counters, hot_sample);
+    }
+  }
+  arena_free(arena, sketches, sketches_bytes);
+  arena_free(arena, counters, counters_bytes);
+  arena_free(arena, bitmaps, bitmaps_bytes);
+  arena_free(arena, info, info_bytes);
   return sum / 0.77351;
 }
 
+size_t estimate(const uint32_t* outer_aggr_keys, size_t outer_tuples, int threads) {
+  uint32_t min_key, max_key;
+  return estimate_columns(outer_aggr_keys, NULL, outer_tuples, threads,
+                          Q4112_HASH_MULTIPLY, NULL, &min_key, &max_key,
+                          NULL, NULL, NULL);
+}
 
-// build hash table and probe to get result (each thread has it own boundaries)
-void* q4112_run_thread(void* arg) {
-  q4112_run_info_hj_t* info = (q4112_run_info_hj_t*) arg;
-  assert(pthread_equal(pthread_self(), info->id));
 
-  // copy info from thread info
-  size_t thread  = info->thread;
-  size_t threads = info->threads;
-  size_t inner_tuples = info->inner_tuples;
-  size_t outer_tuples = info->outer_tuples;
-  int8_t log_buckets = info->log_buckets;
-  size_t buckets = info->buckets;
-  int8_t log_aggr_buckets = info->log_aggr_buckets;
-  size_t aggr_buckets = info->aggr_buckets;
+// add joined tuples (count tuples with the sum val) to their group in the
+// global aggregation table (returns 1 if they created the group, whose
+// bucket is then marked in the occupancy bitmap live unless it is NULL)
+static inline int aggregate(bucket_aggr_t* aggr_table, size_t aggr_buckets,
+                            int8_t log_aggr_buckets, uint64_t* live,
+                            q4112_hash_t hash, uint32_t aggr_key,
+                            uint64_t val, uint64_t count) {
+  int created = 0;
+  size_t aggr_h = q4112_hash(hash, aggr_key);
+  aggr_h >>= 32 - log_aggr_buckets;
 
-  const uint32_t* inner_keys = info->inner_keys;
-  const uint32_t* inner_vals = info->inner_vals;
-  const uint32_t* outer_keys = info->outer_keys;
-  const uint32_t* outer_vals = info->outer_vals;
-  const uint32_t* outer_aggr_keys = info->outer_aggr_keys;
-  bucket_t* table = info->table;
-  bucket_aggr_t* aggr_table = info->aggr_table;
+  int occupation_successful = 0;
+  while (!occupation_successful) {
+    // if already occupied
+    if (aggr_table[aggr_h].key == aggr_key) {
+      occupation_successful = 1;
+    } else { // if not occupied, try to occupy
+      if (__sync_bool_compare_and_swap(&(aggr_table[aggr_h].key), 0, aggr_key)) {
+        occupation_successful = 1;
+        created = 1;
+      } else if (aggr_table[aggr_h].key == aggr_key) { // if failed to occupy, check if occpuied by the same group
+        occupation_successful = 1;
+      }
+    }
+    if (!occupation_successful) {
+      aggr_h = (aggr_h + 1) & (aggr_buckets - 1);
+    }
+  }
 
-  // set thread boundaries for inner table
-  size_t inner_beg = (inner_tuples / threads) * (thread + 0);
-  size_t inner_end = (inner_tuples / threads) * (thread + 1);
-  // fix boundary for last thread
-  if (thread + 1 == threads) inner_end = inner_tuples;
+  if (created && live != NULL) {
+    __sync_fetch_and_or(&live[aggr_h / 64], (uint64_t) 1 << (aggr_h % 64));
+  }
+  __sync_fetch_and_add(&aggr_table[aggr_h].sum, val);
+  __sync_fetch_and_add(&aggr_table[aggr_h].count, count);
+  return created;
+}
 
-  // build inner table into hash table
-  size_t i, o, h;
-  for (i = inner_beg; i != inner_end; ++i) {
-    uint32_t key = inner_keys[i];
-    uint32_t val = inner_vals[i];
-
-    // multiplicative hashing
-    h = (uint32_t) (key * 0x9e3779b1);
-    h >>= 32 - log_buckets;
-
-    // search for empty bucket in hash table and insert data
-    int written_successful = 0;
-    while (!written_successful) {
-      uint32_t old_key = table[h].key;
-      // use compare-and-swap and try to modify key and value
-      if (old_key == 0 &&
-          __sync_bool_compare_and_swap(&(table[h].key), old_key, key)) {
-        table[h].val = val;
-        written_successful = 1;
-      } else {  // failed to write key and value
-        // move to next available bucket
-        h = (h + 1) & (buckets - 1);
+// same as aggregate for a table that only one thread updates (no atomics)
+static inline int aggregate_private(bucket_aggr_t* aggr_table,
+                                    size_t aggr_buckets,
+                                    int8_t log_aggr_buckets, uint64_t* live,
+                                    q4112_hash_t hash,
+                                    uint32_t aggr_key, uint64_t val) {
+  int created = 0;
+  size_t aggr_h = q4112_hash(hash, aggr_key);
+  aggr_h >>= 32 - log_aggr_buckets;
+  while (aggr_table[aggr_h].key != aggr_key) {
+    if (aggr_table[aggr_h].key == 0) {
+      aggr_table[aggr_h].key = aggr_key;
+      if (live != NULL) {
+        live[aggr_h / 64] |= (uint64_t) 1 << (aggr_h % 64);
       }
+      created = 1;
+      break;
     }
+    aggr_h = (aggr_h + 1) & (aggr_buckets - 1);
   }
+  aggr_table[aggr_h].sum += val;
+  aggr_table[aggr_h].count += 1;
+  return created;
+}
 
-  // barrier wait for next stage: matching
-  pthread_barrier_wait(&barrier2);
+// word of the accumulator of an (operation, argument) pair in the rows of a
+// layout (0 if the layout has none)
+static size_t layout_find(const group_layout_t* layout, int op,
+                          q4112_agg_arg_t arg) {
+  size_t a;
+  for (a = 0; a != layout->accs; ++a) {
+    if (layout->op[a] == op && layout->arg[a] == arg) return 2 + a;
+  }
+  return 0;
+}
 
-  // set thread boundaries for outer table
-  size_t outer_beg = (outer_tuples / threads) * (thread + 0);
-  size_t outer_end = (outer_tuples / threads) * (thread + 1);
-  // fix boundary for last thread
-  if (thread + 1 == threads) outer_end = outer_tuples;
+// add the accumulator of an (operation, argument) pair to a layout
+static void layout_acc(group_layout_t* layout, int op, q4112_agg_arg_t arg) {
+  if (layout_find(layout, op, arg) != 0) return;
+  assert(layout->accs != GROUP_ACCS);
+  layout->op[layout->accs] = op;
+  layout->arg[layout->accs] = arg;
+  layout->accs += 1;
+  layout->width = 2 + layout->accs;
+}
 
-  size_t aggr_h;
-  // probe outer table using hash table
-  for (o = outer_beg; o != outer_end; ++o) {
-    uint32_t key = outer_keys[o];
-    uint32_t aggr_key = outer_aggr_keys[o];
-
-    // multiplicative hashing
-    h = (uint32_t) (key * 0x9e3779b1);
-    h >>= 32 - log_buckets;
-
-    // search for matching bucket
-    uint32_t tab = table[h].key;
-    while (tab != 0) {
-      // keys match
-      if (tab == key) {
-        aggr_h = (uint32_t) (aggr_key * 0x9e3779b1);
-        aggr_h >>= 32 - log_aggr_buckets;
-
-        int occupation_successful = 0;
-        while (!occupation_successful) {
-          // if already occupied
-          if (aggr_table[aggr_h].key == aggr_key) {
-            occupation_successful = 1;
-          } else { // if not occupied, try to occupy
-            if (__sync_bool_compare_and_swap(&(aggr_table[aggr_h].key), 0, aggr_key)) {
-              occupation_successful = 1;
-            } else if (aggr_table[aggr_h].key == aggr_key) { // if failed to occupy, check if occpuied by the same group
-              occupation_successful = 1;
-            }
-          }
-          if (!occupation_successful) {
-            aggr_h = (aggr_h + 1) & (aggr_buckets - 1);
-          }
-        }
+// row layout of a set of aggregates
+static void layout_init(group_layout_t* layout, const q4112_agg_t* aggs,
+                        size_t num_aggs) {
+  size_t a;
+  layout->accs = 0;
+  layout->width = 2;
+  for (a = 0; a != num_aggs; ++a) {
+    assert(aggs[a].arg <= Q4112_ARG_PRICE);
+    switch (aggs[a].func) {
+      case Q4112_AGG_SUM:
+      case Q4112_AGG_AVG:
+        layout_acc(layout, ACC_SUM, aggs[a].arg);
+        break;
+      case Q4112_AGG_MIN:
+        layout_acc(layout, ACC_MIN, aggs[a].arg);
+        break;
+      case Q4112_AGG_MAX:
+        layout_acc(layout, ACC_MAX, aggs[a].arg);
+        break;
+      case Q4112_AGG_COUNT:
+        break;
+      default:
+        assert(0);
+    }
+  }
+}
 
-        __sync_fetch_and_add(&aggr_table[aggr_h].sum, table[h].val * (uint64_t) outer_vals[o]);
-        __sync_fetch_and_add(&aggr_table[aggr_h].count, 1);
+static void group_table_init(group_table_t* table,
+                             const group_layout_t* layout,
+                             int8_t log_buckets, q4112_hash_t hash) {
+  table->log_buckets = log_buckets;
+  table->hash = hash;
+  table->buckets = (size_t) 1 << log_buckets;
+  table->groups = 0;
+  table->rows = (uint64_t*) calloc(table->buckets, layout->width * 8);
+  assert(table->rows != NULL);
+}
 
-        // guaranteed single match (join on primary key)
-        break;
+// row of a key in a group table, created if the key is missing (the table
+// must have an empty row left)
+static inline uint64_t* group_row(group_table_t* table,
+                                  const group_layout_t* layout, uint32_t key) {
+  size_t width = layout->width, a;
+  size_t h = q4112_hash(table->hash, key);
+  h >>= 32 - table->log_buckets;
+  for (;;) {
+    uint64_t* row = &table->rows[h * width];
+    if (row[1] == 0) {
+      // new group: the accumulators start at the identity of their operation
+      row[0] = key;
+      for (a = 0; a != layout->accs; ++a) {
+        row[2 + a] = layout->op[a] == ACC_MIN ? ~0ull : 0;
       }
-      // go to next bucket (linear probing)
-      h = (h + 1) & (buckets - 1);
-      tab = table[h].key;
+      table->groups += 1;
+      return row;
     }
+    if (row[0] == key) return row;
+    h = (h + 1) & (table->buckets - 1);
   }
+}
 
-  // barrier wait for next stage: summing up
-  pthread_barrier_wait(&barrier3);
+// fold the accumulators of a row into another row of the same group
+static void group_merge(uint64_t* dst, const uint64_t* src,
+                        const group_layout_t* layout) {
+  size_t a;
+  dst[1] += src[1];
+  for (a = 2; a != layout->width; ++a) {
+    switch (layout->op[a - 2]) {
+      case ACC_SUM: dst[a] += src[a]; break;
+      case ACC_MIN: if (src[a] < dst[a]) dst[a] = src[a]; break;
+      case ACC_MAX: if (src[a] > dst[a]) dst[a] = src[a]; break;
+    }
+  }
+}
 
-  // set thread boundaries for global aggregate table
-  size_t aggr_beg = (aggr_buckets / threads) * (thread + 0);
-  size_t aggr_end = (aggr_buckets / threads) * (thread + 1);
-  // fix boundary for last thread
-  if (thread + 1 == threads) aggr_end = aggr_buckets;
+// make room for more groups, keeping the table at most half full
+static void group_table_reserve(group_table_t* table,
+                                const group_layout_t* layout, size_t groups) {
+  if ((table->groups + groups) * 2 <= table->buckets) return;
+  group_table_t grown;
+  int8_t log_buckets = table->log_buckets + 1;
+  while (((size_t) 1 << log_buckets) < (table->groups + groups) * 2) {
+    log_buckets += 1;
+  }
+  group_table_init(&grown, layout, log_buckets, table->hash);
+  size_t width = layout->width, i;
+  for (i = 0; i != table->buckets; ++i) {
+    const uint64_t* row = &table->rows[i * width];
+    if (row[1] != 0) {
+      memcpy(group_row(&grown, layout, row[0]), row, width * 8);
+    }
+  }
+  free(table->rows);
+  *table = grown;
+}
 
+// partition of a group when the threads merge their tables (different hash
+// bits than the table positions)
+static inline size_t group_partition(uint32_t key, size_t threads) {
+  uint64_t h = key * 0x9e3779b97f4a7c15ull;
+  return ((h >> 32) * threads) >> 32;
+}
 
-  uint64_t sum_avgs = 0;
-  uint32_t num_groups = 0;
-  for (i = aggr_beg; i != aggr_end; ++i) {
-    if (aggr_table[i].key != 0) {
-      sum_avgs += aggr_table[i].sum / aggr_table[i].count;
-      num_groups += 1;
+// probe the hash table with an outer key starting at its home bucket h
+// (returns 1 and items.price if the key matches)
+static inline int probe(const bucket_t* table, size_t buckets, size_t h,
+                        uint32_t key, uint32_t* val) {
+  // search for matching bucket
+  uint32_t tab = table[h].key;
+  while (tab != 0) {
+    // keys match
+    if (tab == key) {
+      // guaranteed single match (join on primary key)
+      *val = table[h].val;
+      return 1;
     }
+    // go to next bucket (linear probing)
+    h = (h + 1) & (buckets - 1);
+    tab = table[h].key;
   }
+  return 0;
+}
 
-  // save results
-  info->sum_avgs = sum_avgs;
-  info->num_groups = num_groups;
-  pthread_exit(NULL);
+// bitmap (high bit of each byte) of the buckets of a group whose tag is
+// the given one, without false positives
+static inline uint64_t swiss_match(uint64_t tags, uint8_t tag) {
+  uint64_t x = tags ^ (tag * 0x0101010101010101ull);
+  return ~(((x & 0x7f7f7f7f7f7f7f7full) + 0x7f7f7f7f7f7f7f7full) | x |
+           0x7f7f7f7f7f7f7f7full) & SWISS_HIGH_BITS;
 }
 
+// bitmap (high bit of each byte) of the empty buckets of a group
+static inline uint64_t swiss_empty(uint64_t tags) {
+  return ~tags & SWISS_HIGH_BITS;
+}
 
-uint64_t get_time_in_ns(void) {
-  struct timespec t;
-  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
-  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+// 64-bit multiplicative hash: the high half picks the group (multiply-shift
+// range reduction, so the number of groups need not be a power of 2) and 7
+// of the low bits are the tag; the other hash functions give 32 bits, so
+// their high bits pick the group and their lowest 7 bits are the tag
+static inline size_t swiss_hash(q4112_hash_t hash, uint32_t key,
+                                size_t groups, uint8_t* tag) {
+  if (hash != Q4112_HASH_MULTIPLY) {
+    uint32_t h = q4112_hash(hash, key);
+    *tag = 0x80 | (h & 0x7f);
+    return ((uint64_t) h * groups) >> 32;
+  }
+  uint64_t h = key * 0x9e3779b97f4a7c15ull;
+  *tag = 0x80 | ((h >> 25) & 0x7f);
+  return ((h >> 32) * groups) >> 32;
 }
 
-const char* add_commas_separator(uint64_t x) {
-  static char buf[32];
-  int digit = 0;
-  size_t i = sizeof(buf) / sizeof(char);
-  buf[--i] = '\0';
-  do {
-    if (digit++ == 3) {
-      buf[--i] = ',';
-      digit = 1;
+// insert into the SIMD-tagged join table, claiming an empty bucket with
+// compare-and-swap on its tag
+static inline void insert_swiss(swiss_group_t* table, size_t groups,
+                                q4112_hash_t hash, uint32_t key,
+                                uint32_t val) {
+  uint8_t tag;
+  size_t g = swiss_hash(hash, key, groups, &tag);
+  for (;;) {
+    swiss_group_t* group = &table[g];
+    uint64_t empty = swiss_empty(group->tags.word);
+    while (empty != 0) {
+      int i = __builtin_ctzll(empty) / 8;
+      if (__sync_bool_compare_and_swap(&group->tags.tags[i], 0, tag)) {
+        group->slots[i].key = key;
+        group->slots[i].val = val;
+        return;
+      }
+      empty &= empty - 1;
     }
-    buf[--i] = (x % 10) + '0';
-    x /= 10;
-  } while (x);
-  return &buf[i];
+    // group is full: go to next group
+    if (++g == groups) g = 0;
+  }
 }
 
-
-size_t smallest_power_of_2_greater_equal_n(size_t n) {
-  size_t ans = 1;
-  while (ans < n) {
-    ans *= 2;
+// probe the SIMD-tagged join table starting at the home group g of the key
+// (returns 1 and items.price if the key matches); a group with an empty
+// bucket ends the search, which happens in the first group for most keys
+// even when 90% of buckets are full
+static inline int probe_swiss(const swiss_group_t* table, size_t groups,
+                              size_t g, uint8_t tag, uint32_t key,
+                              uint32_t* val) {
+  for (;;) {
+    const swiss_group_t* group = &table[g];
+    uint64_t tags = group->tags.word;
+    uint64_t match = swiss_match(tags, tag);
+    while (match != 0) {
+      int i = __builtin_ctzll(match) / 8;
+      if (group->slots[i].key == key) {
+        *val = group->slots[i].val;
+        return 1;
+      }
+      match &= match - 1;
+    }
+    if (swiss_empty(tags) != 0) {
+      return 0;
+    }
+    if (++g == groups) g = 0;
   }
-  return ans;
 }
 
-// the function to start multi-threaded hash join for the query
-uint64_t q4112_run(
-    const uint32_t* inner_keys,
-    const uint32_t* inner_vals,
-    size_t inner_tuples,
-    const uint32_t* outer_join_keys,
-    const uint32_t* outer_aggr_keys,
-    const uint32_t* outer_vals,
-    size_t outer_tuples,
-    int threads) {
-  // check number of threads
-  int t, max_threads = sysconf(_SC_NPROCESSORS_ONLN);
-  printf("%d %d\n", max_threads, threads); 
-  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
-
-  // allocate threads info
-  q4112_run_info_hj_t* info = (q4112_run_info_hj_t*)
-      malloc(threads * sizeof(q4112_run_info_hj_t));
-  assert(info != NULL);
+// aggregation targets of the aggregate operator
+enum {
+  TARGET_NONE,          // ungrouped query: one sum and count per thread
+  TARGET_HASH,          // global hash aggregation table
+  TARGET_HASH_PRIVATE,  // hash aggregation table of a single-thread query
+  TARGET_DENSE_SHARED,  // direct-mapped array shared by all threads
+  TARGET_DENSE_PRIVATE  // direct-mapped array of this thread
+};
 
-  uint64_t start_time_ns = get_time_in_ns();
-  // estimate the global aggregation table size
-  pthread_barrier_init(&barrier, NULL, threads);
-  size_t aggr_buckets_estimate = estimate(outer_aggr_keys, outer_tuples, threads);
+// Predicates are evaluated on 64 values of a column at a time into a bitmap
+// of the values that satisfy them, with 4-way SIMD compares whose results
+// are gathered with movemask. SSE2 has only signed compares, so both sides
+// get their sign bit flipped to compare unsigned values.
+KERNEL uint64_t compare_kernel(const uint32_t* col, size_t n, uint32_t value,
+                               const q4112_cmp_t cmp) {
+  uint64_t mask = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i sign = _mm_set1_epi32(0x80000000);
+  const __m128i c = _mm_set1_epi32(value ^ 0x80000000);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*) &col[i]);
+    v = _mm_xor_si128(v, sign);
+    __m128i r;
+    if (cmp == Q4112_CMP_EQ || cmp == Q4112_CMP_NE) {
+      r = _mm_cmpeq_epi32(v, c);
+    } else if (cmp == Q4112_CMP_LT || cmp == Q4112_CMP_GE) {
+      r = _mm_cmplt_epi32(v, c);
+    } else {
+      r = _mm_cmpgt_epi32(v, c);
+    }
+    uint64_t bits = _mm_movemask_ps(_mm_castsi128_ps(r));
+    // NE, GE and LE are the complements of EQ, LT and GT
+    if (cmp == Q4112_CMP_NE || cmp == Q4112_CMP_GE || cmp == Q4112_CMP_LE) {
+      bits ^= 0xf;
+    }
+    mask |= bits << i;
+  }
+#endif
+  for (; i != n; ++i) {
+    int match;
+    switch (cmp) {
+      case Q4112_CMP_EQ: match = col[i] == value; break;
+      case Q4112_CMP_NE: match = col[i] != value; break;
+      case Q4112_CMP_LT: match = col[i] < value; break;
+      case Q4112_CMP_LE: match = col[i] <= value; break;
+      case Q4112_CMP_GT: match = col[i] > value; break;
+      default: match = col[i] >= value; break;
+    }
+    mask |= (uint64_t) match << i;
+  }
+  return mask;
+}
 
-  uint64_t estimate_ns = get_time_in_ns() - start_time_ns;
-  fprintf(stderr, "Estimation time: %12s ns\n", add_commas_separator(estimate_ns));
-  fprintf(stderr, "aggregation table size: %zu\n", aggr_buckets_estimate);
+// bitmap of the values col[0, n) (n <= 64) that satisfy a predicate
+static uint64_t predicate_mask(const q4112_predicate_t* pred,
+                               const uint32_t* col, size_t n) {
+  uint64_t mask = 0;
+  size_t v;
+  switch (pred->cmp) {
+    case Q4112_CMP_EQ:
+      return compare_kernel(col, n, pred->value, Q4112_CMP_EQ);
+    case Q4112_CMP_NE:
+      return compare_kernel(col, n, pred->value, Q4112_CMP_NE);
+    case Q4112_CMP_LT:
+      return compare_kernel(col, n, pred->value, Q4112_CMP_LT);
+    case Q4112_CMP_LE:
+      return compare_kernel(col, n, pred->value, Q4112_CMP_LE);
+    case Q4112_CMP_GT:
+      return compare_kernel(col, n, pred->value, Q4112_CMP_GT);
+    case Q4112_CMP_GE:
+      return compare_kernel(col, n, pred->value, Q4112_CMP_GE);
+    case Q4112_CMP_IN:
+      for (v = 0; v != pred->num_values; ++v) {
+        mask |= compare_kernel(col, n, pred->values[v], Q4112_CMP_EQ);
+      }
+      return mask;
+  }
+  assert(0);
+  return 0;
+}
 
+// number of predicates on a column
+static size_t count_predicates(const q4112_predicate_t* predicates,
+                               size_t num_predicates,
+                               q4112_pred_column_t column) {
+  size_t p, count = 0;
+  for (p = 0; p != num_predicates; ++p) {
+    count += predicates[p].column == column;
+  }
+  return count;
+}
 
+// bitmap of the inner tuples [inner_beg, inner_end) that satisfy the
+// predicates on items.price, in the bitmap of this thread (NULL if there
+// are none)
+static uint64_t* select_inner(const q4112_run_info_hj_t* info,
+                              size_t inner_beg, size_t inner_end) {
+  const q4112_predicate_t* predicates = info->predicates;
+  size_t num_predicates = info->num_predicates;
+  if (info->inner_sel == NULL) {
+    return NULL;
+  }
+  size_t tuples = inner_end - inner_beg;
+  uint64_t* sel = &info->inner_sel[info->thread * info->inner_sel_words];
+  assert((tuples + 63) / 64 <= info->inner_sel_words);
+  size_t i, p;
+  for (i = 0; i < tuples; i += 64) {
+    size_t n = tuples - i < 64 ? tuples - i : 64;
+    uint64_t mask = n == 64 ? ~0ull : (1ull << n) - 1;
+    for (p = 0; p != num_predicates; ++p) {
+      if (predicates[p].column == Q4112_COLUMN_PRICE) {
+        mask &= predicate_mask(&predicates[p],
+                               &info->inner_vals[inner_beg + i], n);
+      }
+    }
+    sel[i / 64] = mask;
+  }
+  return sel;
+}
+
+// is tuple i of a bitmap selected (all tuples are if the bitmap is NULL)
+static inline int selected(const uint64_t* sel, size_t i) {
+  return sel == NULL || ((sel[i / 64] >> (i % 64)) & 1);
+}
+
+// home slot of an inner key in the join table: a bucket of the linear
+// probing table or a group of the SIMD-tagged table
+KERNEL size_t home_slot(int8_t log_buckets, size_t swiss_groups,
+                        const int swiss, q4112_hash_t hash, uint32_t key,
+                        uint8_t* tag) {
+  if (swiss) {
+    return swiss_hash(hash, key, swiss_groups, tag);
+  }
+  *tag = 0;
+  return q4112_hash(hash, key) >> (32 - log_buckets);
+}
+
+// insert with plain stores into the first empty bucket of the slots
+// [slot, end) of the join table (returns 0 if they are all full)
+KERNEL int insert_owned(bucket_t* table, swiss_group_t* swiss,
+                        const int swiss_layout, size_t slot, size_t end,
+                        uint32_t key, uint32_t val, uint8_t tag) {
+  if (swiss_layout) {
+    for (; slot != end; ++slot) {
+      uint64_t empty = swiss_empty(swiss[slot].tags.word);
+      if (empty != 0) {
+        int i = __builtin_ctzll(empty) / 8;
+        swiss[slot].tags.tags[i] = tag;
+        swiss[slot].slots[i].key = key;
+        swiss[slot].slots[i].val = val;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  for (; slot != end; ++slot) {
+    if (table[slot].key == 0) {
+      table[slot].key = key;
+      table[slot].val = val;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// insert with plain stores into the first empty bucket from the slot on,
+// wrapping around at the end of the join table
+KERNEL void insert_wrap(bucket_t* table, swiss_group_t* swiss,
+                        const int swiss_layout, size_t slot, size_t slots,
+                        uint32_t key, uint32_t val, uint8_t tag) {
+  if (!insert_owned(table, swiss, swiss_layout, slot, slots, key, val, tag)) {
+    int inserted = insert_owned(table, swiss, swiss_layout, 0, slot,
+                                key, val, tag);
+    assert(inserted);
+    (void) inserted;
+  }
+}
+
+// first slot of the range of the join table owned by a thread
+static inline size_t owned_beg(size_t thread, size_t threads, size_t slots) {
+  return (thread * slots + threads - 1) / threads;
+}
+
+// build the join table without atomics: the slots of the table are split in
+// one contiguous range per thread, every thread scatters its inner tuples to
+// the threads that own their home slot and then inserts the tuples it owns
+// with plain stores. Tuples whose probe sequence leaves the range of their
+// owner (rare, only near range ends) are inserted by one thread at the end.
+KERNEL void build_owned_kernel(q4112_run_info_hj_t* info, size_t inner_beg,
+                               size_t inner_end, const uint64_t* inner_sel,
+                               const int swiss_layout,
+                               const q4112_hash_t hash) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  const uint32_t* inner_keys = info->inner_keys;
+  const uint32_t* inner_vals = info->inner_vals;
+  bucket_t* table = info->table;
+  swiss_group_t* swiss = info->swiss;
+  int8_t log_buckets = info->log_buckets;
+  size_t swiss_groups = info->swiss_groups;
+  size_t slots = swiss_layout ? swiss_groups : info->buckets;
+  bucket_t* scatter = info->scatter;
+  size_t* counts = info->owner_counts;
+  q4112_barrier_t* barrier = &info->query->barrier2;
+  size_t i, p, t, slot;
+  uint8_t tag;
+
+  // single thread: no partitioning, only wrap around at the table end
+  if (threads == 1) {
+    for (i = inner_beg; i != inner_end; ++i) {
+      if (!selected(inner_sel, i - inner_beg)) continue;
+      slot = home_slot(log_buckets, swiss_groups, swiss_layout, hash,
+                       inner_keys[i], &tag);
+      insert_wrap(table, swiss, swiss_layout, slot, slots,
+                  inner_keys[i], inner_vals[i], tag);
+    }
+    return;
+  }
+
+  // count tuples per owner
+  size_t* my_counts = &counts[thread * threads];
+  for (i = inner_beg; i != inner_end; ++i) {
+    if (!selected(inner_sel, i - inner_beg)) continue;
+    slot = home_slot(log_buckets, swiss_groups, swiss_layout, hash,
+                     inner_keys[i], &tag);
+    my_counts[slot * threads / slots] += 1;
+  }
+  q4112_barrier_wait(barrier);
+
+  // partitions are ordered by owner, then by the scattering thread
+  size_t* offsets = &counts[threads * threads + thread * threads];
+  size_t offset = 0, part_beg = 0, part_end = 0;
+  for (p = 0; p != threads; ++p) {
+    if (p == thread) part_beg = offset;
+    for (t = 0; t != threads; ++t) {
+      if (t == thread) offsets[p] = offset;
+      offset += counts[t * threads + p];
+    }
+    if (p == thread) part_end = offset;
+  }
+  for (i = inner_beg; i != inner_end; ++i) {
+    if (!selected(inner_sel, i - inner_beg)) continue;
+    slot = home_slot(log_buckets, swiss_groups, swiss_layout, hash,
+                     inner_keys[i], &tag);
+    bucket_t* out = &scatter[offsets[slot * threads / slots]++];
+    out->key = inner_keys[i];
+    out->val = inner_vals[i];
+  }
+  q4112_barrier_wait(barrier);
+
+  // insert owned tuples, keeping the overflowing ones at the partition start
+  size_t end = owned_beg(thread + 1, threads, slots), spills = part_beg;
+  for (i = part_beg; i != part_end; ++i) {
+    bucket_t tuple = scatter[i];
+    slot = home_slot(log_buckets, swiss_groups, swiss_layout, hash,
+                     tuple.key, &tag);
+    if (!insert_owned(table, swiss, swiss_layout, slot, end,
+                      tuple.key, tuple.val, tag)) {
+      scatter[spills++] = tuple;
+    }
+  }
+  info->spill_beg = part_beg;
+  info->spill_end = spills;
+
+  // one thread inserts the overflowing tuples of all threads
+  if (q4112_barrier_wait(barrier)) {
+    const q4112_run_info_hj_t* all = info->all;
+    for (t = 0; t != threads; ++t) {
+      for (i = all[t].spill_beg; i != all[t].spill_end; ++i) {
+        bucket_t tuple = scatter[i];
+        slot = home_slot(log_buckets, swiss_groups, swiss_layout, hash,
+                         tuple.key, &tag);
+        insert_wrap(table, swiss, swiss_layout, slot, slots,
+                    tuple.key, tuple.val, tag);
+      }
+    }
+  }
+}
+
+static void build_owned(q4112_run_info_hj_t* info, size_t inner_beg,
+                        size_t inner_end, const uint64_t* inner_sel) {
+  int multiply = info->hash == Q4112_HASH_MULTIPLY;
+  if (info->swiss != NULL && multiply) {
+    build_owned_kernel(info, inner_beg, inner_end, inner_sel, 1,
+                       Q4112_HASH_MULTIPLY);
+  } else if (info->swiss != NULL) {
+    build_owned_kernel(info, inner_beg, inner_end, inner_sel, 1, info->hash);
+  } else if (multiply) {
+    build_owned_kernel(info, inner_beg, inner_end, inner_sel, 0,
+                       Q4112_HASH_MULTIPLY);
+  } else {
+    build_owned_kernel(info, inner_beg, inner_end, inner_sel, 0, info->hash);
+  }
+}
+
+// The probe phase is a push-based pipeline of operators: the scan cuts the
+// outer tuples of a thread into batches and pushes each batch through the
+// probe and aggregate operators. A batch carries a selection vector (the
+// positions of the tuples still alive), so an operator that drops tuples
+// only narrows the vector and the next one needs no branch per tuple. Each
+// operator runs one tight loop per step over the whole batch, which lets the
+// probe hash all keys and prefetch their buckets before it reads any of them.
+// New operators (e.g. filters) are added to the plan without touching the
+// probe and aggregate kernels.
+
+// outer tuples per batch (the scratch vectors of a pipeline stay in L1/L2)
+#define PIPE_BATCH 1024
+
+// batch of outer tuples pushed through the pipeline
+typedef struct {
+  const uint32_t* keys;       // orders.item_id
+  const uint32_t* aggr_keys;  // orders.store_id (NULL if ungrouped)
+  const uint32_t* vals;       // orders.quantity
+  size_t tuples;
+  // positions of the selected tuples (NULL if all tuples are selected)
+  const uint32_t* sel;
+  size_t selected;
+  // items.price of each selected tuple (set by the probe operator)
+  const uint32_t* prices;
+} batch_t;
+
+typedef struct pipe_op pipe_op_t;
+
+// operator of the pipeline: consumes a batch and pushes what is left of it
+// to the next operator
+struct pipe_op {
+  void (*push)(pipe_op_t* op, batch_t* batch);
+  pipe_op_t* next;
+  q4112_run_info_hj_t* info;
+};
+
+// probe operator: keeps the tuples that match the join table
+typedef struct {
+  pipe_op_t op;
+  size_t slots[PIPE_BATCH];   // home slots of the selected keys
+  uint8_t tags[PIPE_BATCH];   // tags of the selected keys (SIMD-tagged table)
+  uint32_t sel[PIPE_BATCH];   // positions of the matching tuples
+  uint32_t prices[PIPE_BATCH];
+} probe_op_t;
+
+// aggregate operator: adds the joined tuples to the aggregation target
+typedef struct {
+  pipe_op_t op;
+  size_t new_groups;  // groups created in the hash aggregation table
+  uint64_t* rows[PIPE_BATCH];  // group rows of the multi-aggregate target
+} aggregate_op_t;
+
+// filter operator: keeps the tuples that satisfy the predicates on orders
+typedef struct {
+  pipe_op_t op;
+  uint32_t sel[PIPE_BATCH];  // positions of the selected tuples
+} filter_op_t;
+
+// mask of the first n of 64 orders whose orders.store_id is in the
+// partition of the groups of this aggregation pass
+static uint64_t part_mask(const q4112_run_info_hj_t* info,
+                          const uint32_t* aggr_keys, size_t n) {
+  int shift = 32 - info->log_aggr_buckets - info->log_aggr_parts;
+  uint64_t mask = 0;
+  size_t i;
+  for (i = 0; i != n; ++i) {
+    size_t part = (q4112_hash(info->hash, aggr_keys[i]) >> shift) &
+                  (info->aggr_parts - 1);
+    mask |= (uint64_t) (part == info->aggr_part) << i;
+  }
+  return mask;
+}
+
+// evaluate the predicates on orders 64 tuples at a time (the filter is the
+// first operator of the plan, so it gets whole batches), and keep the
+// orders of the groups of this pass if the aggregation takes several
+static void push_filter(pipe_op_t* op, batch_t* batch) {
+  filter_op_t* filter = (filter_op_t*) op;
+  const q4112_predicate_t* predicates = op->info->predicates;
+  size_t num_predicates = op->info->num_predicates;
+  size_t tuples = batch->tuples;
+  size_t o, p, selected = 0;
+  assert(batch->sel == NULL);
+  for (o = 0; o < tuples; o += 64) {
+    size_t n = tuples - o < 64 ? tuples - o : 64;
+    uint64_t mask = n == 64 ? ~0ull : (1ull << n) - 1;
+    for (p = 0; p != num_predicates && mask != 0; ++p) {
+      if (predicates[p].column == Q4112_COLUMN_QUANTITY) {
+        mask &= predicate_mask(&predicates[p], &batch->vals[o], n);
+      } else if (predicates[p].column == Q4112_COLUMN_STORE_ID) {
+        mask &= predicate_mask(&predicates[p], &batch->aggr_keys[o], n);
+      }
+    }
+    if (op->info->aggr_parts > 1 && mask != 0) {
+      mask &= part_mask(op->info, &batch->aggr_keys[o], n);
+    }
+    // positions of the set bits
+    while (mask != 0) {
+      filter->sel[selected++] = o + __builtin_ctzll(mask);
+      mask &= mask - 1;
+    }
+  }
+  if (selected == 0) return;
+  // the probe hashes a batch without selection vector sequentially
+  if (selected != tuples) {
+    batch->sel = filter->sel;
+    batch->selected = selected;
+  }
+  op->next->push(op->next, batch);
+}
+
+KERNEL void probe_batch(probe_op_t* op, batch_t* batch,
+                        const int swiss_layout, const q4112_hash_t hash) {
+  const q4112_run_info_hj_t* info = op->op.info;
+  const bucket_t* table = info->table;
+  size_t buckets = info->buckets;
+  int8_t log_buckets = info->log_buckets;
+  const swiss_group_t* swiss = info->swiss;
+  size_t swiss_groups = info->swiss_groups;
+  const uint32_t* keys = batch->keys;
+  const uint32_t* sel = batch->sel;
+  size_t* slots = op->slots;
+  uint8_t* tags = op->tags;
+  uint8_t tag;
+  size_t i, n = batch->selected, matched = 0;
+
+  // hash the keys of the batch and prefetch their home slots, so that the
+  // cache misses of the whole batch overlap
+  for (i = 0; i != n; ++i) {
+    size_t slot = home_slot(log_buckets, swiss_groups, swiss_layout, hash,
+                            keys[sel == NULL ? i : sel[i]], &tag);
+    if (swiss_layout) {
+      tags[i] = tag;
+      __builtin_prefetch(&swiss[slot]);
+    } else {
+      __builtin_prefetch(&table[slot]);
+    }
+    slots[i] = slot;
+  }
+
+  // probe and keep the matching tuples with their items.price
+  for (i = 0; i != n; ++i) {
+    uint32_t o = sel == NULL ? i : sel[i];
+    uint32_t price = 0;
+    int match = swiss_layout ?
+        probe_swiss(swiss, swiss_groups, slots[i], tags[i], keys[o], &price) :
+        probe(table, buckets, slots[i], keys[o], &price);
+    op->sel[matched] = o;
+    op->prices[matched] = price;
+    matched += match;
+  }
+  if (matched == 0) return;
+  batch->sel = op->sel;
+  batch->selected = matched;
+  batch->prices = op->prices;
+  op->op.next->push(op->op.next, batch);
+}
+
+static void push_probe_linear(pipe_op_t* op, batch_t* batch) {
+  if (op->info->hash == Q4112_HASH_MULTIPLY) {
+    probe_batch((probe_op_t*) op, batch, 0, Q4112_HASH_MULTIPLY);
+  } else {
+    probe_batch((probe_op_t*) op, batch, 0, op->info->hash);
+  }
+}
+
+static void push_probe_swiss(pipe_op_t* op, batch_t* batch) {
+  if (op->info->hash == Q4112_HASH_MULTIPLY) {
+    probe_batch((probe_op_t*) op, batch, 1, Q4112_HASH_MULTIPLY);
+  } else {
+    probe_batch((probe_op_t*) op, batch, 1, op->info->hash);
+  }
+}
+
+// index of a key among the hot keys (HOT_KEYS if it is not hot)
+KERNEL size_t hot_find(const hot_keys_t* hot, uint32_t key) {
+#ifdef __SSE2__
+  __m128i k = _mm_set1_epi32(key);
+  const __m128i* keys = (const __m128i*) hot->keys;
+  int mask = 0, i;
+  for (i = 0; i != HOT_KEYS / 4; ++i) {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128(&keys[i]), k);
+    mask |= _mm_movemask_ps(_mm_castsi128_ps(eq)) << (4 * i);
+  }
+  return mask != 0 ? (size_t) __builtin_ctz(mask) : HOT_KEYS;
+#else
+  size_t i;
+  for (i = 0; i != HOT_KEYS && hot->keys[i] != key; ++i) {}
+  return i;
+#endif
+}
+
+// aggregate the selected tuples of a batch (it follows the probe operator,
+// so the batch has a selection vector and prices); with hot keys, the
+// tuples of hot groups are added to accumulators of this thread instead of
+// the shared target
+KERNEL void aggregate_batch(aggregate_op_t* op, batch_t* batch,
+                            const int target, const int hot,
+                            const q4112_hash_t hash) {
+  q4112_run_info_hj_t* info = op->op.info;
+  bucket_aggr_t* aggr_table = info->aggr_table;
+  size_t aggr_buckets = info->aggr_buckets;
+  int8_t log_aggr_buckets = info->log_aggr_buckets;
+  uint64_t* aggr_live = info->aggr_live;
+  uint32_t dense_min = info->dense_min;
+  bucket_dense_t* dense = info->dense_table;
+  if (target == TARGET_DENSE_PRIVATE) {
+    dense += info->thread * info->dense_groups;
+  }
+  const uint32_t* aggr_keys = batch->aggr_keys;
+  const uint32_t* vals = batch->vals;
+  const uint32_t* sel = batch->sel;
+  const uint32_t* prices = batch->prices;
+
+  size_t i, n = batch->selected, new_groups = 0;
+  uint64_t sum = 0;
+  uint64_t hot_sums[HOT_KEYS], hot_counts[HOT_KEYS];
+  if (hot) {
+    memset(hot_sums, 0, sizeof(hot_sums));
+    memset(hot_counts, 0, sizeof(hot_counts));
+  }
+  for (i = 0; i != n; ++i) {
+    uint32_t o = sel[i];
+    uint64_t product = prices[i] * (uint64_t) vals[o];
+    size_t h = hot ? hot_find(&info->hot, aggr_keys[o]) : HOT_KEYS;
+    if (h != HOT_KEYS) {
+      hot_sums[h] += product;
+      hot_counts[h] += 1;
+    } else if (target == TARGET_NONE) {
+      sum += product;
+    } else if (target == TARGET_HASH) {
+      new_groups += aggregate(aggr_table, aggr_buckets, log_aggr_buckets,
+                              aggr_live, hash, aggr_keys[o], product, 1);
+    } else if (target == TARGET_HASH_PRIVATE) {
+      new_groups += aggregate_private(aggr_table, aggr_buckets,
+                                      log_aggr_buckets, aggr_live, hash,
+                                      aggr_keys[o], product);
+    } else {
+      bucket_dense_t* group = &dense[aggr_keys[o] - dense_min];
+      if (target == TARGET_DENSE_PRIVATE) {
+        group->sum += product;
+        group->count += 1;
+      } else {
+        __sync_fetch_and_add(&group->sum, product);
+        __sync_fetch_and_add(&group->count, 1);
+      }
+    }
+  }
+  if (target == TARGET_NONE) {
+    info->sum += sum;
+    info->count += n;
+  }
+  if (hot) {
+    for (i = 0; i != HOT_KEYS; ++i) {
+      info->hot_sums[i] += hot_sums[i];
+      info->hot_counts[i] += hot_counts[i];
+    }
+  }
+  op->new_groups += new_groups;
+}
+
+// (the targets without hash table ignore the hash function)
+static void push_aggregate_none(pipe_op_t* op, batch_t* batch) {
+  aggregate_batch((aggregate_op_t*) op, batch, TARGET_NONE, 0,
+                  Q4112_HASH_MULTIPLY);
+}
+
+static void push_aggregate_hash(pipe_op_t* op, batch_t* batch) {
+  if (op->info->hash == Q4112_HASH_MULTIPLY) {
+    aggregate_batch((aggregate_op_t*) op, batch, TARGET_HASH, 0,
+                    Q4112_HASH_MULTIPLY);
+  } else {
+    aggregate_batch((aggregate_op_t*) op, batch, TARGET_HASH, 0,
+                    op->info->hash);
+  }
+}
+
+static void push_aggregate_hash_hot(pipe_op_t* op, batch_t* batch) {
+  if (op->info->hash == Q4112_HASH_MULTIPLY) {
+    aggregate_batch((aggregate_op_t*) op, batch, TARGET_HASH, 1,
+                    Q4112_HASH_MULTIPLY);
+  } else {
+    aggregate_batch((aggregate_op_t*) op, batch, TARGET_HASH, 1,
+                    op->info->hash);
+  }
+}
+
+static void push_aggregate_hash_private(pipe_op_t* op, batch_t* batch) {
+  if (op->info->hash == Q4112_HASH_MULTIPLY) {
+    aggregate_batch((aggregate_op_t*) op, batch, TARGET_HASH_PRIVATE, 0,
+                    Q4112_HASH_MULTIPLY);
+  } else {
+    aggregate_batch((aggregate_op_t*) op, batch, TARGET_HASH_PRIVATE, 0,
+                    op->info->hash);
+  }
+}
+
+static void push_aggregate_dense_shared(pipe_op_t* op, batch_t* batch) {
+  aggregate_batch((aggregate_op_t*) op, batch, TARGET_DENSE_SHARED, 0,
+                  Q4112_HASH_MULTIPLY);
+}
+
+static void push_aggregate_dense_shared_hot(pipe_op_t* op, batch_t* batch) {
+  aggregate_batch((aggregate_op_t*) op, batch, TARGET_DENSE_SHARED, 1,
+                  Q4112_HASH_MULTIPLY);
+}
+
+static void push_aggregate_dense_private(pipe_op_t* op, batch_t* batch) {
+  aggregate_batch((aggregate_op_t*) op, batch, TARGET_DENSE_PRIVATE, 0,
+                  Q4112_HASH_MULTIPLY);
+}
+
+// add the selected tuples of a batch to an accumulator of their group rows
+// (specialized for the operation and argument of the accumulator)
+KERNEL void accumulate_kernel(uint64_t* const* rows, size_t word,
+                              const batch_t* batch, const int acc_op,
+                              const q4112_agg_arg_t arg) {
+  const uint32_t* vals = batch->vals;
+  const uint32_t* sel = batch->sel;
+  const uint32_t* prices = batch->prices;
+  size_t i, n = batch->selected;
+  for (i = 0; i != n; ++i) {
+    uint64_t v = arg == Q4112_ARG_REVENUE ? prices[i] * (uint64_t) vals[sel[i]] :
+                 arg == Q4112_ARG_QUANTITY ? vals[sel[i]] : prices[i];
+    uint64_t* acc = &rows[i][word];
+    if (acc_op == ACC_SUM) {
+      *acc += v;
+    } else if (acc_op == ACC_MIN) {
+      if (v < *acc) *acc = v;
+    } else {
+      if (v > *acc) *acc = v;
+    }
+  }
+}
+
+// instantiate the accumulate kernel for an operation and argument
+#define ACCUMULATE_KERNEL(acc_op, arg) \
+  case (acc_op) * 3 + (arg): \
+    accumulate_kernel(rows, 2 + a, batch, acc_op, arg); \
+    break
+
+// multi-aggregate target: find the group row of every selected tuple in the
+// private table of the thread, then update one accumulator at a time
+static void push_aggregate_groups(pipe_op_t* op, batch_t* batch) {
+  q4112_run_info_hj_t* info = op->info;
+  const group_layout_t* layout = info->group_layout;
+  group_table_t* table = &info->group_tables[info->thread];
+  uint64_t** rows = ((aggregate_op_t*) op)->rows;
+  const uint32_t* aggr_keys = batch->aggr_keys;
+  const uint32_t* sel = batch->sel;
+  size_t i, a, n = batch->selected;
+
+  group_table_reserve(table, layout, n);
+  for (i = 0; i != n; ++i) {
+    rows[i] = group_row(table, layout, aggr_keys[sel[i]]);
+    rows[i][1] += 1;
+  }
+  for (a = 0; a != layout->accs; ++a) {
+    switch (layout->op[a] * 3 + layout->arg[a]) {
+      ACCUMULATE_KERNEL(ACC_SUM, Q4112_ARG_REVENUE);
+      ACCUMULATE_KERNEL(ACC_SUM, Q4112_ARG_QUANTITY);
+      ACCUMULATE_KERNEL(ACC_SUM, Q4112_ARG_PRICE);
+      ACCUMULATE_KERNEL(ACC_MIN, Q4112_ARG_REVENUE);
+      ACCUMULATE_KERNEL(ACC_MIN, Q4112_ARG_QUANTITY);
+      ACCUMULATE_KERNEL(ACC_MIN, Q4112_ARG_PRICE);
+      ACCUMULATE_KERNEL(ACC_MAX, Q4112_ARG_REVENUE);
+      ACCUMULATE_KERNEL(ACC_MAX, Q4112_ARG_QUANTITY);
+      ACCUMULATE_KERNEL(ACC_MAX, Q4112_ARG_PRICE);
+    }
+  }
+}
+
+// pipeline of the probe phase of one thread for one query
+typedef struct {
+  pipe_op_t* first;
+  filter_op_t filter;
+  probe_op_t probe;
+  aggregate_op_t aggregate;
+} pipeline_t;
+
+// plan the pipeline of a thread: filter if there are predicates on orders,
+// probe, then aggregate (the operators pick the kernels of the join table
+// layout and aggregation target once)
+static void pipeline_init(pipeline_t* pipe, q4112_run_info_hj_t* info) {
+  pipe->filter.op.push = push_filter;
+  pipe->filter.op.next = &pipe->probe.op;
+  pipe->filter.op.info = info;
+
+  pipe->probe.op.push = info->swiss != NULL ?
+      push_probe_swiss : push_probe_linear;
+  pipe->probe.op.next = &pipe->aggregate.op;
+  pipe->probe.op.info = info;
+
+  if (info->group_layout != NULL) {
+    pipe->aggregate.op.push = push_aggregate_groups;
+  } else if (info->dense_table != NULL) {
+    pipe->aggregate.op.push = info->dense_private ?
+        push_aggregate_dense_private : info->hot.num_keys != 0 ?
+        push_aggregate_dense_shared_hot : push_aggregate_dense_shared;
+  } else if (info->aggr_table != NULL) {
+    // no other thread updates the table of a single-thread query
+    pipe->aggregate.op.push = info->threads == 1 ?
+        push_aggregate_hash_private : info->hot.num_keys != 0 ?
+        push_aggregate_hash_hot : push_aggregate_hash;
+  } else {
+    pipe->aggregate.op.push = push_aggregate_none;
+  }
+  pipe->aggregate.op.next = NULL;
+  pipe->aggregate.op.info = info;
+  pipe->aggregate.new_groups = 0;
+
+  size_t filters = info->num_predicates - count_predicates(info->predicates,
+      info->num_predicates, Q4112_COLUMN_PRICE);
+  pipe->first = filters != 0 || info->aggr_parts > 1 ?
+      &pipe->filter.op : &pipe->probe.op;
+}
+
+// scan operator: push outer tuples through the pipeline in batches
+static void pipeline_scan(pipeline_t* pipe, const uint32_t* keys,
+                          const uint32_t* aggr_keys, const uint32_t* vals,
+                          size_t tuples) {
+  size_t o;
+  for (o = 0; o < tuples; o += PIPE_BATCH) {
+    batch_t batch;
+    batch.keys = &keys[o];
+    batch.aggr_keys = aggr_keys != NULL ? &aggr_keys[o] : NULL;
+    batch.vals = &vals[o];
+    batch.tuples = tuples - o;
+    if (batch.tuples > PIPE_BATCH) batch.tuples = PIPE_BATCH;
+    batch.sel = NULL;
+    batch.selected = batch.tuples;
+    batch.prices = NULL;
+    pipe->first->push(pipe->first, &batch);
+  }
+}
+
+// insert the inner tuples [inner_beg, inner_end) into the join table with
+// compare-and-swap
+static void build_atomic(q4112_run_info_hj_t* info, size_t inner_beg,
+                         size_t inner_end, const uint64_t* inner_sel) {
+  int8_t log_buckets = info->log_buckets;
+  size_t buckets = info->buckets;
+  const uint32_t* inner_keys = info->inner_keys;
+  const uint32_t* inner_vals = info->inner_vals;
+  bucket_t* table = info->table;
+  swiss_group_t* swiss = info->swiss;
+  size_t swiss_groups = info->swiss_groups;
+
+  size_t i, h;
+  if (swiss != NULL) {
+    for (i = inner_beg; i != inner_end; ++i) {
+      if (!selected(inner_sel, i - inner_beg)) continue;
+      insert_swiss(swiss, swiss_groups, info->hash, inner_keys[i],
+                   inner_vals[i]);
+    }
+  } else {
+    for (i = inner_beg; i != inner_end; ++i) {
+      if (!selected(inner_sel, i - inner_beg)) continue;
+      uint32_t key = inner_keys[i];
+      uint32_t val = inner_vals[i];
+
+      h = q4112_hash(info->hash, key);
+      h >>= 32 - log_buckets;
+
+      // search for empty bucket in hash table and insert data
+      int written_successful = 0;
+      while (!written_successful) {
+        uint32_t old_key = table[h].key;
+        // use compare-and-swap and try to modify key and value
+        if (old_key == 0 &&
+            __sync_bool_compare_and_swap(&(table[h].key), old_key, key)) {
+          table[h].val = val;
+          written_successful = 1;
+        } else {  // failed to write key and value
+          // move to next available bucket
+          h = (h + 1) & (buckets - 1);
+        }
+      }
+    }
+  }
+}
+
+// build the inner part of this thread into the join table
+static void build_table(q4112_run_info_hj_t* info) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  size_t inner_tuples = info->inner_tuples;
+
+  // set thread boundaries for inner table (empty past the build threads)
+  size_t parts = info->build_threads != 0 ? info->build_threads : threads;
+  size_t inner_beg = inner_tuples, inner_end = inner_tuples;
+  if (thread < parts) {
+    inner_beg = (inner_tuples / parts) * (thread + 0);
+    inner_end = (inner_tuples / parts) * (thread + 1);
+    // fix boundary for last thread
+    if (thread + 1 == parts) inner_end = inner_tuples;
+  }
+
+  // items filtered out by predicates on items.price are not inserted
+  uint64_t* inner_sel = select_inner(info, inner_beg, inner_end);
+
+  // build inner table into hash table
+  if (info->build == Q4112_BUILD_PARTITIONED) {
+    build_owned(info, inner_beg, inner_end, inner_sel);
+  } else {
+    build_atomic(info, inner_beg, inner_end, inner_sel);
+  }
+}
+
+// wait until a chunk of a table is ready
+static void ready_wait(q4112_ready_t* ready, size_t chunk) {
+  if (__atomic_load_n(&ready->ready[chunk], __ATOMIC_ACQUIRE)) return;
+  pthread_mutex_lock(&ready->mutex);
+  while (!__atomic_load_n(&ready->ready[chunk], __ATOMIC_ACQUIRE)) {
+    pthread_cond_wait(&ready->cond, &ready->mutex);
+  }
+  pthread_mutex_unlock(&ready->mutex);
+}
+
+// the threads take the chunks of a table in order (returns 0 when there are
+// none left, otherwise the tuples of the chunk once it is ready)
+static int next_chunk(q4112_ready_t* ready, size_t* next,
+                      size_t* beg, size_t* end) {
+  size_t chunk = __sync_fetch_and_add(next, 1);
+  if (chunk >= ready->chunks) return 0;
+  *beg = chunk * ready->chunk_tuples;
+  *end = ready->tuples - *beg < ready->chunk_tuples ?
+      ready->tuples : *beg + ready->chunk_tuples;
+  ready_wait(ready, chunk);
+  return 1;
+}
+
+// build the join table from the chunks of items as they become ready (the
+// partitioned build needs all of items, so the chunks are inserted with
+// compare-and-swap)
+static void build_chunks(q4112_run_info_hj_t* info) {
+  size_t inner_beg, inner_end;
+  while (next_chunk(info->inner_ready, &info->query->inner_chunk,
+                    &inner_beg, &inner_end)) {
+    uint64_t* inner_sel = select_inner(info, inner_beg, inner_end);
+    build_atomic(info, inner_beg, inner_end, inner_sel);
+  }
+}
+
+// join and aggregate outer tuples (returns the number of groups they added
+// to the hash aggregation table)
+static size_t probe_tuples(q4112_run_info_hj_t* info, const uint32_t* keys,
+                           const uint32_t* aggr_keys, const uint32_t* vals,
+                           size_t tuples) {
+  pipeline_t pipe;
+  pipeline_init(&pipe, info);
+  pipeline_scan(&pipe, keys, aggr_keys, vals, tuples);
+  return pipe.aggregate.new_groups;
+}
+
+// allocate the result columns of a multi-aggregate query in one buffer:
+// the column pointers, the aggregate columns, then the keys
+static void groups_alloc(q4112_groups_t* result, size_t groups,
+                         size_t num_aggs) {
+  size_t a;
+  uint64_t** columns = (uint64_t**) malloc(
+      num_aggs * (sizeof(uint64_t*) + groups * 8) + groups * 4 + 1);
+  assert(columns != NULL);
+  uint64_t* data = (uint64_t*) &columns[num_aggs];
+  for (a = 0; a != num_aggs; ++a) {
+    columns[a] = &data[a * groups];
+  }
+  result->groups = groups;
+  result->columns = columns;
+  result->keys = (uint32_t*) &data[num_aggs * groups];
+  result->buffer = columns;
+}
+
+// merge the groups of the partition of this thread from the private tables
+// of all threads, then write them into the result columns
+static void finalize_group_rows(q4112_run_info_hj_t* info) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  const group_layout_t* layout = info->group_layout;
+  const q4112_agg_t* aggs = info->aggs;
+  size_t num_aggs = info->num_aggs;
+  size_t width = layout->width;
+  q4112_barrier_t* barrier = &info->query->barrier3;
+  size_t t, i, a;
+
+  group_table_t merged;
+  group_table_init(&merged, layout, 10, info->hash);
+  for (t = 0; t != threads; ++t) {
+    const group_table_t* table = &info->group_tables[t];
+    for (i = 0; i != table->buckets; ++i) {
+      const uint64_t* row = &table->rows[i * width];
+      if (row[1] == 0 || group_partition(row[0], threads) != thread) continue;
+      group_table_reserve(&merged, layout, 1);
+      group_merge(group_row(&merged, layout, row[0]), row, layout);
+    }
+  }
+  info->num_groups = merged.groups;
+
+  // one thread allocates the columns for the groups of all threads
+  if (q4112_barrier_wait(barrier)) {
+    size_t groups = 0;
+    for (t = 0; t != threads; ++t) {
+      groups += info->all[t].num_groups;
+    }
+    groups_alloc(info->groups, groups, num_aggs);
+  }
+  q4112_barrier_wait(barrier);
+
+  // the groups of this thread follow those of the threads before it
+  size_t g = 0;
+  for (t = 0; t != thread; ++t) {
+    g += info->all[t].num_groups;
+  }
+  uint32_t* keys = info->groups->keys;
+  uint64_t** columns = info->groups->columns;
+  for (i = 0; i != merged.buckets; ++i) {
+    const uint64_t* row = &merged.rows[i * width];
+    if (row[1] == 0) continue;
+    keys[g] = row[0];
+    for (a = 0; a != num_aggs; ++a) {
+      q4112_agg_arg_t arg = aggs[a].arg;
+      switch (aggs[a].func) {
+        case Q4112_AGG_SUM:
+          columns[a][g] = row[layout_find(layout, ACC_SUM, arg)];
+          break;
+        case Q4112_AGG_COUNT:
+          columns[a][g] = row[1];
+          break;
+        case Q4112_AGG_MIN:
+          columns[a][g] = row[layout_find(layout, ACC_MIN, arg)];
+          break;
+        case Q4112_AGG_MAX:
+          columns[a][g] = row[layout_find(layout, ACC_MAX, arg)];
+          break;
+        case Q4112_AGG_AVG:
+          columns[a][g] = row[layout_find(layout, ACC_SUM, arg)] / row[1];
+          break;
+      }
+    }
+    g += 1;
+  }
+  free(merged.rows);
+}
+
+// groups whose averages are taken together by sum_averages
+#define AVERAGE_BATCH 256
+
+// sum of the averages sums[i] / counts[i] of n groups (counts not 0): the
+// quotients are taken in double precision, which divides several lanes at
+// a time with SIMD and pipelines unlike 64-bit integer division, then
+// corrected to the exact integer quotient (the double quotient is off by
+// less than 1 if the sums fit in its 53-bit mantissa, otherwise the batch
+// is divided again as integers)
+static uint64_t sum_averages(const uint64_t* sums, const uint64_t* counts,
+                             size_t n) {
+  uint64_t total = 0, big = 0;
+  size_t i;
+  for (i = 0; i != n; ++i) {
+    uint64_t s = sums[i] & (((uint64_t) 1 << 53) - 1), c = counts[i];
+    uint64_t q = (uint64_t) ((double) s / (double) c);
+    q -= q * c > s;
+    q += s - q * c >= c;
+    total += q;
+    big |= sums[i] >> 53;
+  }
+  if (big != 0) {
+    total = 0;
+    for (i = 0; i != n; ++i) {
+      total += sums[i] / counts[i];
+    }
+  }
+  return total;
+}
+
+// sum up the averages of the groups in the part of the aggregation table
+// (or of the key range) of this thread: the hash table is walked through
+// its occupancy bitmap, so only the words of the bitmap and the buckets of
+// live groups are read (in address order), not the empty buckets between
+// them
+static void finalize_groups(q4112_run_info_hj_t* info) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  size_t aggr_buckets = info->aggr_buckets;
+  const bucket_aggr_t* aggr_table = info->aggr_table;
+  const uint64_t* aggr_live = info->aggr_live;
+  size_t dense_groups = info->dense_groups;
+  size_t i, n = 0;
+
+  uint64_t sum_avgs = 0, num_groups = 0;
+  uint64_t sums[AVERAGE_BATCH], counts[AVERAGE_BATCH];
+
+  if (info->group_layout != NULL) {
+    finalize_group_rows(info);
+    return;
+  }
+
+  // ungrouped query: the average is the sum over the joined tuples
+  if (info->dense_table == NULL && aggr_table == NULL) {
+    info->sum_avgs = info->sum;
+    info->num_groups = info->count;
+    return;
+  }
+
+  if (info->dense_table != NULL) {
+    // set thread boundaries for the key range
+    size_t dense_beg = (dense_groups / threads) * (thread + 0);
+    size_t dense_end = (dense_groups / threads) * (thread + 1);
+    // fix boundary for last thread
+    if (thread + 1 == threads) dense_end = dense_groups;
+
+    // reduce the private arrays of all threads for this part of the range
+    size_t arrays = info->dense_private ? threads : 1, a;
+    for (i = dense_beg; i != dense_end; ++i) {
+      uint64_t sum = 0, count = 0;
+      for (a = 0; a != arrays; ++a) {
+        sum += info->dense_table[a * dense_groups + i].sum;
+        count += info->dense_table[a * dense_groups + i].count;
+      }
+      if (count != 0) {
+        sums[n] = sum;
+        counts[n] = count;
+        if (++n == AVERAGE_BATCH) {
+          sum_avgs += sum_averages(sums, counts, n);
+          num_groups += n;
+          n = 0;
+        }
+      }
+    }
+    sum_avgs += sum_averages(sums, counts, n);
+    num_groups += n;
+    info->sum_avgs = sum_avgs;
+    info->num_groups = num_groups;
+    return;
+  }
+
+  // set thread boundaries for the words of the occupancy bitmap
+  size_t words = (aggr_buckets + 63) / 64;
+  size_t word_beg = (words / threads) * (thread + 0);
+  size_t word_end = (words / threads) * (thread + 1);
+  // fix boundary for last thread
+  if (thread + 1 == threads) word_end = words;
+
+  for (i = word_beg; i != word_end; ++i) {
+    uint64_t bits = aggr_live[i];
+    while (bits != 0) {
+      const bucket_aggr_t* group = &aggr_table[i * 64 + __builtin_ctzll(bits)];
+      sums[n] = group->sum;
+      counts[n] = group->count;
+      n += 1;
+      bits &= bits - 1;
+    }
+    // (a word adds at most 64 groups)
+    if (n > AVERAGE_BATCH - 64) {
+      sum_avgs += sum_averages(sums, counts, n);
+      num_groups += n;
+      n = 0;
+    }
+  }
+  sum_avgs += sum_averages(sums, counts, n);
+  num_groups += n;
+
+  // save results
+  info->sum_avgs = sum_avgs;
+  info->num_groups = num_groups;
+}
+
+uint64_t get_time_in_ns(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+void* q4112_run_thread(void* arg) {
+  q4112_run_info_hj_t* info = (q4112_run_info_hj_t*) arg;
+  assert(pthread_equal(pthread_self(), info->id));
+
+  // copy info from thread info
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  size_t outer_tuples = info->outer_tuples;
+  const uint32_t* outer_keys = info->outer_keys;
+  const uint32_t* outer_vals = info->outer_vals;
+  const uint32_t* outer_aggr_keys = info->outer_aggr_keys;
+  const q4112_packed_t* packed_keys = info->packed_keys;
+  const q4112_packed_t* packed_vals = info->packed_vals;
+  const q4112_packed_t* packed_aggr_keys = info->packed_aggr_keys;
+
+  if (info->inner_ready != NULL) {
+    build_chunks(info);
+  } else if (!info->prebuilt) {
+    build_table(info);
+  }
+
+  // barrier wait for next stage: matching
+  if (q4112_barrier_wait(&info->query->barrier2)) {
+    if (info->times != NULL) {
+      info->times->build_end_ns = get_time_in_ns();
+    }
+    arena_phase(info->arena, Q4112_PHASE_PROBE);
+  }
+
+  // threads past the probe threads have no outer tuples
+  size_t new_groups = 0, parts = info->probe_threads != 0 ?
+      info->probe_threads : threads;
+  if (packed_keys != NULL) {
+    // set thread boundaries in blocks of the packed columns
+    size_t blocks = (outer_tuples + Q4112_PACK_BLOCK - 1) / Q4112_PACK_BLOCK;
+    size_t blocks_beg = blocks, blocks_end = blocks;
+    if (thread < parts) {
+      blocks_beg = (blocks / parts) * (thread + 0);
+      blocks_end = (blocks / parts) * (thread + 1);
+      // fix boundary for last thread
+      if (thread + 1 == parts) blocks_end = blocks;
+    }
+
+    // decode one block of each column at a time (stays in L1 cache)
+    uint32_t keys[Q4112_PACK_BLOCK];
+    uint32_t aggr_keys[Q4112_PACK_BLOCK];
+    uint32_t vals[Q4112_PACK_BLOCK];
+    size_t b;
+    for (b = blocks_beg; b != blocks_end; ++b) {
+      q4112_unpack_block(packed_keys, b, keys);
+      if (packed_aggr_keys != NULL) {
+        unpack_aggr_keys(packed_aggr_keys, b, aggr_keys);
+      }
+      q4112_unpack_block(packed_vals, b, vals);
+      size_t block_tuples = outer_tuples - b * Q4112_PACK_BLOCK;
+      if (block_tuples > Q4112_PACK_BLOCK) block_tuples = Q4112_PACK_BLOCK;
+      new_groups += probe_tuples(info, keys, aggr_keys, vals, block_tuples);
+    }
+  } else if (info->outer_ready != NULL) {
+    // join the chunks of orders as they become ready
+    size_t outer_beg, outer_end;
+    while (next_chunk(info->outer_ready, &info->query->outer_chunk,
+                      &outer_beg, &outer_end)) {
+      new_groups += probe_tuples(info, &outer_keys[outer_beg],
+          outer_aggr_keys != NULL ? &outer_aggr_keys[outer_beg] : NULL,
+          &outer_vals[outer_beg], outer_end - outer_beg);
+    }
+  } else {
+    // set thread boundaries for outer table
+    size_t outer_beg = outer_tuples, outer_end = outer_tuples;
+    if (thread < parts) {
+      outer_beg = (outer_tuples / parts) * (thread + 0);
+      outer_end = (outer_tuples / parts) * (thread + 1);
+      // fix boundary for last thread
+      if (thread + 1 == parts) outer_end = outer_tuples;
+    }
+
+    // probe outer table using hash table
+    new_groups = probe_tuples(info, &outer_keys[outer_beg],
+        outer_aggr_keys != NULL ? &outer_aggr_keys[outer_beg] : NULL,
+        &outer_vals[outer_beg], outer_end - outer_beg);
+  }
+
+  // add the hot groups of this thread to the shared target
+  size_t h;
+  for (h = 0; h != info->hot.num_keys; ++h) {
+    if (info->hot_counts[h] == 0) continue;
+    uint32_t key = info->hot.keys[h];
+    if (info->dense_table != NULL) {
+      bucket_dense_t* group = &info->dense_table[key - info->dense_min];
+      __sync_fetch_and_add(&group->sum, info->hot_sums[h]);
+      __sync_fetch_and_add(&group->count, info->hot_counts[h]);
+    } else {
+      new_groups += aggregate(info->aggr_table, info->aggr_buckets,
+                              info->log_aggr_buckets, info->aggr_live,
+                              info->hash, key, info->hot_sums[h],
+                              info->hot_counts[h]);
+    }
+  }
+
+  info->new_groups = new_groups;
+
+  // groups are kept as state by the caller (no summing up)
+  if (!info->finalize) {
+    pthread_exit(NULL);
+  }
+
+  // barrier wait for next stage: summing up
+  if (q4112_barrier_wait(&info->query->barrier3)) {
+    if (info->times != NULL) {
+      info->times->probe_end_ns = get_time_in_ns();
+    }
+    arena_phase(info->arena, Q4112_PHASE_FINALIZE);
+  }
+
+  finalize_groups(info);
+  pthread_exit(NULL);
+}
+
+
+size_t smallest_power_of_2_greater_equal_n(size_t n) {
+  size_t ans = 1;
+  while (ans < n) {
+    ans *= 2;
+  }
+  return ans;
+}
+
+// buckets of the linear probing join table for the inner table of the base
+// info (a power of 2, the fill rate is between 1/3 and 2/3) and groups of
+// the SIMD-tagged one (any number, the fill rate is the one of the base)
+static int8_t join_log_buckets(const q4112_run_info_hj_t* base) {
+  int8_t log_buckets = 1;
+  size_t buckets = 2;
+  while (buckets * 0.67 < base->inner_tuples) {
+    log_buckets += 1;
+    buckets += buckets;
+  }
+  return log_buckets;
+}
+
+static size_t join_swiss_groups(const q4112_run_info_hj_t* base) {
+  double fill = base->swiss_fill != 0 ? base->swiss_fill : SWISS_FILL;
+  return base->inner_tuples / (SWISS_SLOTS * fill) + 1;
+}
+
+// fill rate of the join table of the base info
+static double join_fill(const q4112_run_info_hj_t* base) {
+  return base->table_layout == Q4112_TABLE_SWISS ?
+      (double) base->inner_tuples / (base->swiss_groups * SWISS_SLOTS) :
+      (double) base->inner_tuples / base->buckets;
+}
+
+// bytes of the join table and of the buffers of the partitioned build
+static size_t join_bytes(const q4112_run_info_hj_t* base) {
+  return base->table_layout == Q4112_TABLE_SWISS ?
+      join_swiss_groups(base) * sizeof(swiss_group_t) :
+      ((size_t) 1 << join_log_buckets(base)) * sizeof(bucket_t);
+}
+
+static size_t scatter_bytes(const q4112_run_info_hj_t* base, int threads) {
+  if (base->build != Q4112_BUILD_PARTITIONED || threads == 1) return 0;
+  return base->inner_tuples * sizeof(bucket_t) + 1 +
+         2 * (size_t) threads * threads * sizeof(size_t);
+}
+
+// words of the bitmap of the items that pass the predicates on items.price
+// for each thread: its range of items or a chunk of items that it builds as
+// the chunk becomes ready (0 if there are no such predicates)
+static size_t inner_sel_words(const q4112_run_info_hj_t* base, int threads) {
+  if (count_predicates(base->predicates, base->num_predicates,
+                       Q4112_COLUMN_PRICE) == 0) {
+    return 0;
+  }
+  size_t parts = base->build_threads != 0 ? base->build_threads : threads;
+  size_t tuples = base->inner_ready != NULL ?
+      base->inner_ready->chunk_tuples :
+      base->inner_tuples / parts + base->inner_tuples % parts;
+  return (tuples + 63) / 64 + 1;
+}
+
+static size_t inner_sel_bytes(const q4112_run_info_hj_t* base, int threads) {
+  return threads * inner_sel_words(base, threads) * 8;
+}
+
+// free the buffers of the build (threads as created)
+static void free_build_buffers(q4112_run_info_hj_t* base, int threads) {
+  arena_t* arena = base->arena;
+  arena_free(arena, base->scatter,
+             base->inner_tuples * sizeof(bucket_t) + 1);
+  arena_free(arena, base->owner_counts,
+             2 * (size_t) threads * threads * sizeof(size_t));
+  arena_free(arena, base->inner_sel, threads * base->inner_sel_words * 8);
+  base->scatter = NULL;
+  base->owner_counts = NULL;
+  base->inner_sel = NULL;
+}
+
+// free the join table and the buffers of its build (threads as created)
+static void free_join_table(q4112_run_info_hj_t* base, int threads) {
+  arena_t* arena = base->arena;
+  arena_free(arena, base->table, base->buckets * sizeof(bucket_t));
+  arena_free(arena, base->swiss, base->swiss_groups * sizeof(swiss_group_t));
+  base->table = NULL;
+  base->swiss = NULL;
+  free_build_buffers(base, threads);
+}
+
+// allocate the join table for the inner table of the base info and the
+// buffers of its build (the selection bitmaps of the items and those of the
+// partitioned build) from the arena of the base info (returns 0 if they do
+// not fit)
+static int create_join_table(q4112_run_info_hj_t* base, int threads) {
+  arena_t* arena = base->arena;
+  base->log_buckets = join_log_buckets(base);
+  base->buckets = (size_t) 1 << base->log_buckets;
+
+  base->table = NULL;
+  base->swiss = NULL;
+  base->swiss_groups = 0;
+  base->scatter = NULL;
+  base->owner_counts = NULL;
+  base->inner_sel = NULL;
+  base->inner_sel_words = 0;
+  if (base->table_layout == Q4112_TABLE_SWISS) {
+    size_t swiss_groups = join_swiss_groups(base);
+    // groups are aligned to cache lines
+    base->swiss = (swiss_group_t*) arena_memalign(arena,
+        sizeof(swiss_group_t), swiss_groups * sizeof(swiss_group_t));
+    if (base->swiss == NULL) return 0;
+    memset(base->swiss, 0, swiss_groups * sizeof(swiss_group_t));
+    base->swiss_groups = swiss_groups;
+  } else {
+    // allocate and initialize the hash table
+    // there are no 0 keys (see header) so we use 0 for "no key"
+    base->table = (bucket_t*)
+        arena_calloc(arena, base->buckets * sizeof(bucket_t));
+    if (base->table == NULL) return 0;
+  }
+
+  // scatter buffer and per-owner counts and offsets of the partitioned
+  // build
+  if (base->build == Q4112_BUILD_PARTITIONED && threads > 1) {
+    base->scatter = (bucket_t*)
+        arena_malloc(arena, base->inner_tuples * sizeof(bucket_t) + 1);
+    base->owner_counts = (size_t*) arena_calloc(arena,
+        2 * (size_t) threads * threads * sizeof(size_t));
+    if (base->scatter == NULL || base->owner_counts == NULL) {
+      free_join_table(base, threads);
+      return 0;
+    }
+  }
+
+  // selection bitmaps of the threads
+  size_t sel_words = inner_sel_words(base, threads);
+  if (sel_words != 0) {
+    base->inner_sel = (uint64_t*)
+        arena_malloc(arena, threads * sel_words * 8);
+    if (base->inner_sel == NULL) {
+      free_join_table(base, threads);
+      return 0;
+    }
+    base->inner_sel_words = sel_words;
+  }
+  return 1;
+}
+
+// aggregation target for the estimated groups: a direct-mapped array if
+// the keys of orders.store_id are dense (private arrays per thread for
+// small ranges), otherwise the global hash aggregation table
+static int aggr_target(size_t aggr_buckets_estimate,
+                       uint32_t min_key, uint32_t max_key) {
+  size_t aggr_buckets = smallest_power_of_2_greater_equal_n(aggr_buckets_estimate);
+  // the keys are dense if their range is not much larger than the table
+  size_t dense_groups = min_key <= max_key ? (size_t) max_key - min_key + 1 : 0;
+  if (dense_groups == 0 || dense_groups > 2 * aggr_buckets) {
+    return TARGET_HASH;
+  }
+  return dense_groups <= DENSE_PRIVATE_GROUPS ?
+      TARGET_DENSE_PRIVATE : TARGET_DENSE_SHARED;
+}
+
+// bytes of an aggregation target (the hash table with its occupancy bitmap)
+static size_t aggr_target_bytes(int target, int threads,
+                                size_t aggr_buckets_estimate,
+                                uint32_t min_key, uint32_t max_key) {
+  if (target == TARGET_HASH) {
+    size_t aggr_buckets = smallest_power_of_2_greater_equal_n(aggr_buckets_estimate);
+    return aggr_buckets * sizeof(bucket_aggr_t) + (aggr_buckets + 63) / 64 * 8;
+  }
+  size_t arrays = target == TARGET_DENSE_PRIVATE ? threads : 1;
+  return arrays * ((size_t) max_key - min_key + 1) * sizeof(bucket_dense_t);
+}
+
+// free the aggregation target (threads as created)
+static void free_aggr_table(q4112_run_info_hj_t* base, int threads) {
+  arena_t* arena = base->arena;
+  size_t aggr_buckets = base->aggr_buckets;
+  size_t arrays = base->dense_private ? threads : 1;
+  arena_free(arena, base->aggr_table, aggr_buckets * sizeof(bucket_aggr_t));
+  arena_free(arena, base->aggr_live, (aggr_buckets + 63) / 64 * 8);
+  arena_free(arena, base->dense_table,
+             arrays * base->dense_groups * sizeof(bucket_dense_t));
+  base->aggr_table = NULL;
+  base->aggr_live = NULL;
+  base->dense_table = NULL;
+}
+
+// allocate an aggregation target (TARGET_HASH, TARGET_DENSE_SHARED or
+// TARGET_DENSE_PRIVATE, see aggr_target) of the base info for the
+// estimated groups from its arena (returns 0 if it does not fit)
+static int create_aggr_table(q4112_run_info_hj_t* base, int threads,
+                             int target, size_t aggr_buckets_estimate,
+                             uint32_t min_key, uint32_t max_key) {
   size_t aggr_buckets = smallest_power_of_2_greater_equal_n(aggr_buckets_estimate);
   int8_t log_aggr_buckets = trailing_zero_count2(aggr_buckets);
-  fprintf(stderr, "smallest p2 table size: %zu\n", aggr_buckets);
-  fprintf(stderr, "log p2 table size: %d\n", log_aggr_buckets);
 
-  // allocate and initialize the global aggregation table
-  bucket_aggr_t* aggr_table = (bucket_aggr_t*) calloc(aggr_buckets, sizeof(bucket_aggr_t));
-  assert(aggr_table != NULL);
+  base->dense_table = NULL;
+  base->aggr_table = NULL;
+  base->aggr_live = NULL;
+  if (target != TARGET_HASH) {
+    size_t dense_groups = (size_t) max_key - min_key + 1;
+    // small ranges use private arrays per thread (no atomics)
+    int dense_private = target == TARGET_DENSE_PRIVATE;
+    size_t arrays = dense_private ? threads : 1;
+    base->dense_table = (bucket_dense_t*) arena_calloc(base->arena,
+        arrays * dense_groups * sizeof(bucket_dense_t));
+    if (base->dense_table == NULL) return 0;
+    base->dense_groups = dense_groups;
+    base->dense_min = min_key;
+    base->dense_private = dense_private;
+  } else {
+    // allocate and initialize the global aggregation table
+    base->aggr_table = (bucket_aggr_t*) arena_calloc(base->arena,
+        aggr_buckets * sizeof(bucket_aggr_t));
+    base->aggr_live = (uint64_t*) arena_calloc(base->arena,
+        (aggr_buckets + 63) / 64 * 8);
+    base->aggr_buckets = aggr_buckets;
+    base->log_aggr_buckets = log_aggr_buckets;
+    if (base->aggr_table == NULL || base->aggr_live == NULL) {
+      free_aggr_table(base, threads);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// build the hash table and probe it with all threads: the query inputs and
+// the aggregation target are taken from the base info, which is copied to
+// every thread (returns the number of groups added to the hash aggregation
+// table, or SIZE_MAX if the thread info or the join table do not fit into
+// the arena and the query did not run)
+static size_t q4112_run_threads(
+    const q4112_run_info_hj_t* base,
+    int threads,
+    uint64_t* sum_avgs,
+    uint64_t* num_groups) {
+  int t;
+
+  // allocate threads info
+  q4112_run_info_hj_t* info = (q4112_run_info_hj_t*)
+      arena_malloc(base->arena, threads * sizeof(q4112_run_info_hj_t));
+  if (info == NULL) return SIZE_MAX;
+
+  // the join table is allocated here unless the caller passes one (and the
+  // build starts here unless the caller started it with the allocation)
+  if (base->times != NULL && base->times->start_ns == 0) {
+    base->times->start_ns = get_time_in_ns();
+  }
+  q4112_run_info_hj_t query_base = *base;
+  int own_table = base->table == NULL && base->swiss == NULL;
+  if (own_table && !create_join_table(&query_base, threads)) {
+    arena_free(base->arena, info, threads * sizeof(q4112_run_info_hj_t));
+    return SIZE_MAX;
+  }
+  if (base->times != NULL) {
+    base->times->table_bytes = query_base.swiss != NULL ?
+        query_base.swiss_groups * sizeof(swiss_group_t) :
+        query_base.buckets * sizeof(bucket_t);
+  }
+
+  // set up barrier for threads
+  q4112_query_t query;
+  q4112_barrier_init(&query.barrier2, threads);
+  q4112_barrier_init(&query.barrier3, threads);
+  query.inner_chunk = 0;
+  query.outer_chunk = 0;
+
+
+  // run threads for matching
+  for (t = 0; t != threads; ++t) {
+    info[t] = query_base;
+    info[t].query = &query;
+    info[t].thread = t;
+    info[t].threads = threads;
+    info[t].all = info;
+    pthread_create(&info[t].id, NULL, q4112_run_thread, &info[t]);
+  }
+
+  // gather result
+  size_t new_groups = 0;
+  *sum_avgs = 0;
+  *num_groups = 0;
+  for (t = 0; t != threads; ++t) {
+    pthread_join(info[t].id, NULL);
+    new_groups += info[t].new_groups;
+    if (base->finalize) {
+      *sum_avgs += info[t].sum_avgs;
+      *num_groups += info[t].num_groups;
+    }
+  }
+  if (base->times != NULL) {
+    base->times->end_ns = get_time_in_ns();
+  }
+
+  // clean up
+  arena_free(base->arena, info, threads * sizeof(q4112_run_info_hj_t));
+  if (own_table) {
+    free_join_table(&query_base, threads);
+  }
+  return new_groups;
+}
+
+// Small queries run in the calling thread: for a few thousand tuples the
+// estimation pass, the allocations and the thread start-ups cost much more
+// than the join itself. Their scratch tables live on the stack, sized to
+// the query, and go through the same build and probe pipeline.
+#define SMALL_INNER 1024
+#define SMALL_OUTER 1024
+
+static uint64_t run_small(const q4112_run_info_hj_t* base) {
+  bucket_t table[SMALL_INNER * 2];
+  bucket_aggr_t aggr_table[SMALL_OUTER * 2];
+  uint64_t aggr_live[SMALL_OUTER * 2 / 64];
+  bucket_dense_t dense_table[SMALL_OUTER * 2];
+  uint64_t inner_sel[SMALL_INNER / 64 + 1];
+  size_t outer_tuples = base->outer_tuples, o;
+  const uint32_t* outer_aggr_keys = base->outer_aggr_keys;
+
+  q4112_query_t query;
+  q4112_run_info_hj_t info = *base;
+  info.query = &query;
+  info.thread = 0;
+  info.threads = 1;
+  info.all = &info;
+
+  // linear probing join table (fits in L1 cache, so no SIMD-tagged layout)
+  info.log_buckets = 1;
+  info.buckets = 2;
+  while (info.buckets * 0.67 < info.inner_tuples) {
+    info.log_buckets += 1;
+    info.buckets += info.buckets;
+  }
+  memset(table, 0, info.buckets * sizeof(bucket_t));
+  info.table = table;
+  info.swiss = NULL;
+  info.build = Q4112_BUILD_PARTITIONED;
+  info.inner_sel_words = inner_sel_words(&info, 1);
+  info.inner_sel = info.inner_sel_words != 0 ? inner_sel : NULL;
+
+  // direct-mapped aggregation if the key range is small, otherwise a hash
+  // table at most half full even if every tuple is a group
+  info.aggr_table = NULL;
+  info.aggr_live = NULL;
+  info.dense_table = NULL;
+  if (outer_aggr_keys != NULL && outer_tuples != 0) {
+    uint32_t min_key = ~0u, max_key = 0;
+    for (o = 0; o != outer_tuples; ++o) {
+      if (outer_aggr_keys[o] < min_key) min_key = outer_aggr_keys[o];
+      if (outer_aggr_keys[o] > max_key) max_key = outer_aggr_keys[o];
+    }
+    if ((size_t) max_key - min_key < SMALL_OUTER * 2) {
+      info.dense_groups = (size_t) max_key - min_key + 1;
+      info.dense_min = min_key;
+      info.dense_private = 1;
+      memset(dense_table, 0, info.dense_groups * sizeof(bucket_dense_t));
+      info.dense_table = dense_table;
+    } else {
+      info.log_aggr_buckets = 1;
+      info.aggr_buckets = 2;
+      while (info.aggr_buckets < outer_tuples * 2) {
+        info.log_aggr_buckets += 1;
+        info.aggr_buckets += info.aggr_buckets;
+      }
+      memset(aggr_table, 0, info.aggr_buckets * sizeof(bucket_aggr_t));
+      memset(aggr_live, 0, sizeof(aggr_live));
+      info.aggr_table = aggr_table;
+      info.aggr_live = aggr_live;
+    }
+  }
+
+  build_table(&info);
+  probe_tuples(&info, base->outer_keys, outer_aggr_keys, base->outer_vals,
+               outer_tuples);
+  finalize_groups(&info);
+  return info.num_groups == 0 ? 0 : info.sum_avgs / info.num_groups;
+}
+
+// One-time machine calibration for the thread counts of a plan: the cost
+// of starting and joining a thread and the cost per tuple of a small query
+// (a join with a cache-resident table, so a lower bound for larger ones)
+static pthread_once_t calibration_once = PTHREAD_ONCE_INIT;
+static double calibration_thread_ns;
+static double calibration_tuple_ns;
+
+static void* calibrate_thread(void* arg) {
+  return arg;
+}
+
+static void calibrate(void) {
+  uint32_t keys[SMALL_INNER], vals[SMALL_INNER], aggr_keys[SMALL_OUTER];
+  size_t i;
+  for (i = 0; i != SMALL_INNER; ++i) {
+    keys[i] = i * 7 % SMALL_INNER + 1;
+    vals[i] = i + 1;
+    aggr_keys[i] = i % 64 + 1;
+  }
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_keys = keys;
+  base.inner_vals = vals;
+  base.inner_tuples = SMALL_INNER;
+  base.outer_keys = vals;
+  base.outer_aggr_keys = aggr_keys;
+  base.outer_vals = vals;
+  base.outer_tuples = SMALL_OUTER;
+
+  // best of a few runs of each
+  uint64_t query_ns = ~0ull, thread_ns = ~0ull;
+  int r;
+  for (r = 0; r != 8; ++r) {
+    uint64_t start_ns = get_time_in_ns();
+    run_small(&base);
+    uint64_t ns = get_time_in_ns() - start_ns;
+    if (ns < query_ns) query_ns = ns;
+
+    // (if no thread starts, the plans keep every phase in one thread)
+    pthread_t id;
+    start_ns = get_time_in_ns();
+    if (pthread_create(&id, NULL, calibrate_thread, NULL) != 0) continue;
+    pthread_join(id, NULL);
+    ns = get_time_in_ns() - start_ns;
+    if (ns < thread_ns) thread_ns = ns;
+  }
+  calibration_tuple_ns = (query_ns + 1.0) / (SMALL_INNER + SMALL_OUTER);
+  calibration_thread_ns = thread_ns + 1.0;
+}
+
+// Memory calibration of the roofline report: a sequential scan, independent
+// reads of random cache lines and a chain of dependent reads through a
+// random cycle of the cache lines of a buffer at least MEMORY_CACHES times
+// the last-level cache (MEMORY_CACHE_BYTES if the system does not tell)
+#define MEMORY_MIN_BYTES ((size_t) 1 << 27)
+#define MEMORY_CACHES 4
+#define MEMORY_CACHE_BYTES ((size_t) 32 << 20)
+#define MEMORY_RANDOM_READS (1 << 22)
+#define MEMORY_CHAIN_READS (1 << 20)
+static pthread_once_t memory_once = PTHREAD_ONCE_INIT;
+static q4112_memory_t memory_calibration;
+
+// buffer of cache lines (8 words each, the first word of a line is the next
+// line of the cycle) and the times of a measurement
+typedef struct {
+  const uint64_t* words;
+  size_t lines;
+  q4112_barrier_t barrier;
+  uint64_t start_ns;
+  uint64_t end_ns;
+} memory_test_t;
+
+typedef struct {
+  pthread_t id;
+  int thread;
+  int threads;
+  int random;  // random reads instead of a scan of a part of the buffer
+  memory_test_t* test;
+  uint64_t sum;  // (keeps the reads)
+} memory_info_t;
+
+// read the buffer in parallel (also called for one thread directly)
+static void* memory_thread(void* arg) {
+  memory_info_t* info = (memory_info_t*) arg;
+  memory_test_t* test = info->test;
+  const uint64_t* words = test->words;
+  size_t lines = test->lines;
+  size_t lines_beg = (lines / info->threads) * (info->thread + 0);
+  size_t lines_end = (lines / info->threads) * (info->thread + 1);
+  if (info->thread + 1 == info->threads) lines_end = lines;
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  size_t i;
+
+  if (q4112_barrier_wait(&test->barrier)) {
+    test->start_ns = get_time_in_ns();
+  }
+  if (info->random) {
+    // the line numbers come from a random number generator, not from the
+    // lines read, so the reads overlap (lines is a power of 2)
+    uint64_t x = info->thread + 1;
+    for (i = 0; i != MEMORY_RANDOM_READS; ++i) {
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+      s0 += words[((x >> 24) & (lines - 1)) * 8];
+    }
+  } else {
+    for (i = lines_beg * 8; i != lines_end * 8; i += 4) {
+      s0 += words[i + 0];
+      s1 += words[i + 1];
+      s2 += words[i + 2];
+      s3 += words[i + 3];
+    }
+  }
+  info->sum = s0 + s1 + s2 + s3;
+  if (q4112_barrier_wait(&test->barrier)) {
+    test->end_ns = get_time_in_ns();
+  }
+  return NULL;
+}
+
+// time of a measurement with the given threads (the best of two)
+static uint64_t memory_test(memory_test_t* test, int threads, int random) {
+  memory_info_t* info = (memory_info_t*)
+      malloc(threads * sizeof(memory_info_t));
+  assert(info != NULL);
+  uint64_t best_ns = ~0ull;
+  int r, t;
+  for (r = 0; r != 2; ++r) {
+    q4112_barrier_init(&test->barrier, threads);
+    for (t = 0; t != threads; ++t) {
+      info[t].thread = t;
+      info[t].threads = threads;
+      info[t].random = random;
+      info[t].test = test;
+    }
+    if (threads == 1) {
+      memory_thread(&info[0]);
+    } else {
+      for (t = 0; t != threads; ++t) {
+        pthread_create(&info[t].id, NULL, memory_thread, &info[t]);
+      }
+      for (t = 0; t != threads; ++t) {
+        pthread_join(info[t].id, NULL);
+      }
+    }
+    uint64_t ns = test->end_ns - test->start_ns + 1;
+    if (ns < best_ns) best_ns = ns;
+  }
+  free(info);
+  return best_ns;
+}
+
+static void calibrate_memory(void) {
+  q4112_memory_t* memory = &memory_calibration;
+  long cache_bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (cache_bytes <= 0) cache_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  memory->cache_bytes = cache_bytes > 0 ? cache_bytes : MEMORY_CACHE_BYTES;
+  memory->threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(memory->threads > 0);
+  size_t bytes = MEMORY_MIN_BYTES;
+  while (bytes < MEMORY_CACHES * memory->cache_bytes) bytes += bytes;
+
+  // the cycle through all lines (Sattolo's shuffle of the identity)
+  uint64_t* words;
+  if (posix_memalign((void**) &words, 64, bytes) != 0) {
+    // (the calibration stays zeroed: the reports have no roofline)
+    memset(memory, 0, sizeof(q4112_memory_t));
+    return;
+  }
+  memset(words, 0, bytes);
+  size_t lines = bytes / 64, i;
+  for (i = 0; i != lines; ++i) {
+    words[i * 8] = i;
+  }
+  uint64_t x = 0x4112;
+  for (i = lines - 1; i != 0; --i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    size_t j = x % i;
+    uint64_t next = words[i * 8];
+    words[i * 8] = words[j * 8];
+    words[j * 8] = next;
+  }
+
+  memory_test_t test;
+  test.words = words;
+  test.lines = lines;
+  double random_reads = MEMORY_RANDOM_READS;
+  memory->read_bytes_per_ns = (double) bytes / memory_test(&test, 1, 0);
+  memory->read_bytes_per_ns_all =
+      (double) bytes / memory_test(&test, memory->threads, 0);
+  memory->random_reads_per_ns = random_reads / memory_test(&test, 1, 1);
+  memory->random_reads_per_ns_all = random_reads * memory->threads /
+      memory_test(&test, memory->threads, 1);
+
+  uint64_t line = 0;
+  uint64_t start_ns = get_time_in_ns();
+  for (i = 0; i != MEMORY_CHAIN_READS; ++i) {
+    line = words[line * 8];
+  }
+  memory->latency_ns =
+      (get_time_in_ns() - start_ns + (line & 1)) / (double) MEMORY_CHAIN_READS;
+  free(words);
+}
+
+void q4112_memory_calibrate(q4112_memory_t* memory) {
+  pthread_once(&memory_once, calibrate_memory);
+  *memory = memory_calibration;
+}
+
+// add time and traffic to a phase of the roofline report (accesses to a
+// table within the last-level cache are not memory accesses)
+static void roofline_phase(q4112_roofline_t* roofline, q4112_phase_t phase,
+                           uint64_t ns, int threads, size_t scanned_bytes,
+                           size_t random_accesses, size_t table_bytes) {
+  const q4112_memory_t* memory = &roofline->memory;
+  q4112_phase_report_t* report = &roofline->phases[phase];
+  report->ns += ns;
+  if (threads > report->threads) report->threads = threads;
+  report->scanned_bytes += scanned_bytes;
+  report->random_accesses += random_accesses;
+  if (table_bytes > memory->cache_bytes) {
+    report->memory_accesses += random_accesses;
+  }
+  if (table_bytes > report->table_bytes) report->table_bytes = table_bytes;
+  if (memory->read_bytes_per_ns == 0) return;
+
+  // the threads of the phase get their share of the machine
+  double read_bytes_per_ns = memory->read_bytes_per_ns * report->threads;
+  if (read_bytes_per_ns > memory->read_bytes_per_ns_all) {
+    read_bytes_per_ns = memory->read_bytes_per_ns_all;
+  }
+  double random_reads_per_ns =
+      memory->random_reads_per_ns * report->threads;
+  if (random_reads_per_ns > memory->random_reads_per_ns_all) {
+    random_reads_per_ns = memory->random_reads_per_ns_all;
+  }
+  double scan_ns = report->scanned_bytes / read_bytes_per_ns;
+  double random_ns = report->memory_accesses / random_reads_per_ns;
+  report->roofline_ns = scan_ns > random_ns ? scan_ns : random_ns;
+  report->roofline_fraction =
+      report->ns != 0 ? report->roofline_ns / report->ns : 0;
+}
+
+static void roofline_print(const q4112_roofline_t* roofline) {
+  const q4112_memory_t* memory = &roofline->memory;
+  const char* names[] = {"estimate", "reduce", "build", "probe", "finalize"};
+  int p;
+  fprintf(stderr, "memory: read %.1f GB/s (%.1f GB/s with %d threads), "
+          "random reads %.1f M/s (%.1f M/s), latency %.0f ns\n",
+          memory->read_bytes_per_ns, memory->read_bytes_per_ns_all,
+          memory->threads, memory->random_reads_per_ns * 1000,
+          memory->random_reads_per_ns_all * 1000, memory->latency_ns);
+  for (p = 0; p != Q4112_PHASES; ++p) {
+    const q4112_phase_report_t* report = &roofline->phases[p];
+    if (report->ns == 0) continue;
+    fprintf(stderr, "roofline %s: %.2f ms, %d threads, %zu MB scanned, "
+            "%zu random accesses (%zu to memory), %.0f%% of the roofline\n",
+            names[p], report->ns / 1e6, report->threads,
+            report->scanned_bytes >> 20, report->random_accesses,
+            report->memory_accesses, report->roofline_fraction * 100);
+  }
+}
+
+// a thread gets at least the work of this many thread starts
+#define TUNE_START_COST 10
+// the shared hash aggregation table gets at most one thread per this many
+// groups (more threads only add contention on the same buckets)
+#define TUNE_GROUPS_PER_THREAD 16
+// the join table is built on orders if items are at least this many times
+// the distinct values of orders.item_id
+#define TUNE_REDUCE_RATIO 4
+
+// threads that the tuples of a phase are worth (at most the given ones)
+static int tune_threads(size_t tuples, int threads) {
+  double tuples_per_thread =
+      TUNE_START_COST * calibration_thread_ns / calibration_tuple_ns;
+  double wanted = tuples / tuples_per_thread;
+  return wanted < 1 ? 1 : wanted > threads ? threads : (int) wanted;
+}
+
+// Build on orders: the threads insert the distinct orders.item_id into a
+// key set (linear probing with compare-and-swap, sized from their estimate),
+// mark the items of their range whose key is in it, and copy the marked
+// items to new columns at the offsets of their thread. If the estimate was
+// too low and the set fills up, or if the set or the new columns do not fit
+// into the memory budget, the reduction gives up.
+#define KEY_SET_FILL 0.75
+#define KEY_SET_BLOCK 1024
+
+// state shared by the threads of a reduction
+typedef struct {
+  uint32_t* keys;
+  size_t buckets;
+  int8_t log_buckets;
+  size_t capacity;  // keys before the set counts as full
+  size_t size;      // keys inserted (updated per block of orders)
+  int full;
+  q4112_barrier_t barrier;
+  // marks of the items in the set (sel_words per thread)
+  uint64_t* sel;
+  size_t sel_words;
+  // arena of the query and the reduced items (allocated from it, the set
+  // counts as full if they do not fit)
+  arena_t* arena;
+  uint32_t* inner_keys;
+  uint32_t* inner_vals;
+  size_t inner_tuples;
+} key_set_t;
+
+typedef struct q4112_reduce_info q4112_reduce_info_t;
+
+struct q4112_reduce_info {
+  pthread_t id;
+  int thread;
+  int threads;
+  const q4112_run_info_hj_t* base;
+  key_set_t* set;
+  size_t selected;  // items of this thread in the key set
+  const q4112_reduce_info_t* all;  // info of all threads
+};
+
+void* reduce_thread(void* arg) {
+  q4112_reduce_info_t* info = (q4112_reduce_info_t*) arg;
+  assert(pthread_equal(pthread_self(), info->id));
+
+  // copy info from thread info
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  const q4112_run_info_hj_t* base = info->base;
+  key_set_t* set = info->set;
+  uint32_t* keys = set->keys;
+  size_t buckets = set->buckets;
+  int8_t log_buckets = set->log_buckets;
+  size_t i, o, h, t;
+
+  // phase 1: insert orders.item_id into the key set
+  size_t outer_tuples = base->outer_tuples;
+  size_t outer_beg = (outer_tuples / threads) * (thread + 0);
+  size_t outer_end = (outer_tuples / threads) * (thread + 1);
+  if (thread + 1 == threads) outer_end = outer_tuples;
+  for (o = outer_beg; o < outer_end; o += KEY_SET_BLOCK) {
+    // every thread inserts at most a block past the capacity
+    if (__atomic_load_n(&set->full, __ATOMIC_RELAXED)) break;
+    size_t block_end = outer_end - o > KEY_SET_BLOCK ?
+        o + KEY_SET_BLOCK : outer_end;
+    size_t new_keys = 0;
+    for (i = o; i != block_end; ++i) {
+      uint32_t key = base->outer_keys[i];
+      h = q4112_hash(base->hash, key) >> (32 - log_buckets);
+      for (;;) {
+        uint32_t old_key = keys[h];
+        if (old_key == key) break;
+        if (old_key == 0) {
+          if (__sync_bool_compare_and_swap(&keys[h], 0, key)) {
+            new_keys += 1;
+            break;
+          }
+          // lost the bucket to another thread: read it again
+          continue;
+        }
+        h = (h + 1) & (buckets - 1);
+      }
+    }
+    if (__sync_add_and_fetch(&set->size, new_keys) > set->capacity) {
+      __atomic_store_n(&set->full, 1, __ATOMIC_RELAXED);
+    }
+  }
+  q4112_barrier_wait(&set->barrier);
+  if (set->full) {
+    pthread_exit(NULL);
+  }
+
+  // phase 2: mark the items of this thread in the key set
+  size_t inner_tuples = base->inner_tuples;
+  const uint32_t* inner_keys = base->inner_keys;
+  size_t inner_beg = (inner_tuples / threads) * (thread + 0);
+  size_t inner_end = (inner_tuples / threads) * (thread + 1);
+  if (thread + 1 == threads) inner_end = inner_tuples;
+  uint64_t* sel = &set->sel[thread * set->sel_words];
+  size_t marked = 0;
+  for (i = inner_beg; i != inner_end; ++i) {
+    uint32_t key = inner_keys[i];
+    h = q4112_hash(base->hash, key) >> (32 - log_buckets);
+    while (keys[h] != key && keys[h] != 0) {
+      h = (h + 1) & (buckets - 1);
+    }
+    if (keys[h] == key) {
+      sel[(i - inner_beg) / 64] |= 1ull << ((i - inner_beg) % 64);
+      marked += 1;
+    }
+  }
+  info->selected = marked;
+
+  // one thread allocates the reduced items
+  if (q4112_barrier_wait(&set->barrier)) {
+    size_t total = 0;
+    for (t = 0; t != threads; ++t) {
+      total += info->all[t].selected;
+    }
+    set->inner_keys = (uint32_t*) arena_malloc(set->arena, total * 4 + 4);
+    set->inner_vals = (uint32_t*) arena_malloc(set->arena, total * 4 + 4);
+    set->inner_tuples = total;
+    if (set->inner_keys == NULL || set->inner_vals == NULL) {
+      arena_free(set->arena, set->inner_keys, total * 4 + 4);
+      arena_free(set->arena, set->inner_vals, total * 4 + 4);
+      set->full = 1;
+    }
+  }
+  q4112_barrier_wait(&set->barrier);
+  if (set->full) {
+    pthread_exit(NULL);
+  }
+
+  // phase 3: copy the marked items after those of the previous threads
+  size_t out = 0;
+  for (t = 0; t != thread; ++t) {
+    out += info->all[t].selected;
+  }
+  for (i = inner_beg; i != inner_end; ++i) {
+    if (selected(sel, i - inner_beg)) {
+      set->inner_keys[out] = inner_keys[i];
+      set->inner_vals[out] = base->inner_vals[i];
+      out += 1;
+    }
+  }
+  pthread_exit(NULL);
+}
+
+// replace the items of the base info by those that orders reference
+// (returns 0 and leaves them if the key set filled up; the caller frees
+// the new columns to the arena)
+static int reduce_inner(q4112_run_info_hj_t* base, int threads,
+                        size_t distinct_estimate) {
+  uint64_t start_ns = get_time_in_ns();
+  key_set_t set;
+  memset(&set, 0, sizeof(set));
+  // room for four times the estimate (it is low for some key patterns) but
+  // not more than for every order, and for every thread overshooting the
+  // capacity by a block
+  size_t min_buckets = 4 * distinct_estimate;
+  if (min_buckets > 2 * base->outer_tuples) {
+    min_buckets = 2 * base->outer_tuples;
+  }
+  if (min_buckets < 8 * KEY_SET_BLOCK * (size_t) threads) {
+    min_buckets = 8 * KEY_SET_BLOCK * (size_t) threads;
+  }
+  set.buckets = smallest_power_of_2_greater_equal_n(min_buckets);
+  set.log_buckets = trailing_zero_count2(set.buckets);
+  set.capacity = set.buckets * KEY_SET_FILL;
+  // there are no 0 keys (see header) so we use 0 for "no key"
+  arena_t* arena = base->arena;
+  set.arena = arena;
+  set.sel_words = (base->inner_tuples / threads + threads) / 64 + 1;
+  size_t keys_bytes = set.buckets * 4;
+  size_t sel_bytes = threads * set.sel_words * 8;
+  size_t info_bytes = threads * sizeof(q4112_reduce_info_t);
+  set.keys = (uint32_t*) arena_calloc(arena, keys_bytes);
+  set.sel = (uint64_t*) arena_calloc(arena, sel_bytes);
+  q4112_reduce_info_t* info = (q4112_reduce_info_t*)
+      arena_malloc(arena, info_bytes);
+  if (set.keys == NULL || set.sel == NULL || info == NULL) {
+    assert(arena != NULL);
+    arena_free(arena, set.keys, keys_bytes);
+    arena_free(arena, set.sel, sel_bytes);
+    arena_free(arena, info, info_bytes);
+    return 0;
+  }
+  q4112_barrier_init(&set.barrier, threads);
+  int t;
+  for (t = 0; t != threads; ++t) {
+    info[t].thread = t;
+    info[t].threads = threads;
+    info[t].base = base;
+    info[t].set = &set;
+    info[t].selected = 0;
+    info[t].all = info;
+    pthread_create(&info[t].id, NULL, reduce_thread, &info[t]);
+  }
+  for (t = 0; t != threads; ++t) {
+    pthread_join(info[t].id, NULL);
+  }
+  arena_free(arena, info, info_bytes);
+  arena_free(arena, set.sel, sel_bytes);
+  arena_free(arena, set.keys, keys_bytes);
+
+  // orders.item_id inserted into the key set, then (unless it filled up)
+  // items.id looked up in it and the marked items copied
+  if (base->roofline != NULL) {
+    size_t lookups = set.full ? 0 : base->inner_tuples;
+    roofline_phase(base->roofline, Q4112_PHASE_REDUCE,
+                   get_time_in_ns() - start_ns, threads,
+                   base->outer_tuples * 4 + lookups * 12,
+                   base->outer_tuples + lookups, set.buckets * 4);
+  }
+
+  if (set.full) {
+    return 0;
+  }
+  base->inner_keys = set.inner_keys;
+  base->inner_vals = set.inner_vals;
+  base->inner_tuples = set.inner_tuples;
+  return 1;
+}
+
+// bytes of the orders columns of a query (plain or bit-packed)
+static size_t outer_bytes(const q4112_run_info_hj_t* base) {
+  if (base->packed_keys != NULL) {
+    return q4112_packed_bytes(base->packed_keys) +
+           q4112_packed_bytes(base->packed_vals) +
+           (base->packed_aggr_keys != NULL ?
+            q4112_packed_bytes(base->packed_aggr_keys) : 0);
+  }
+  return base->outer_tuples * 4 * (base->outer_aggr_keys != NULL ? 3 : 2);
+}
+
+// add the build, probe and summing up of q4112_run_threads to the roofline
+// report (every order is counted as a probe of the join table and an update
+// of the aggregation target, whether it joins or not; groups is the number
+// of groups summed up)
+static void roofline_threads(q4112_roofline_t* roofline,
+                             const q4112_run_info_hj_t* base,
+                             const q4112_plan_t* plan, int threads,
+                             const run_times_t* times, uint64_t groups) {
+  size_t inner_tuples = base->inner_tuples;
+  size_t outer_tuples = base->outer_tuples;
+  if (!base->prebuilt) {
+    // items read, and read again from the scatter buffer of the
+    // partitioned build
+    size_t scanned_bytes = inner_tuples * 8;
+    if (base->build == Q4112_BUILD_PARTITIONED && threads > 1) {
+      scanned_bytes += inner_tuples * 8;
+    }
+    roofline_phase(roofline, Q4112_PHASE_BUILD,
+                   times->build_end_ns - times->start_ns, plan->build_threads,
+                   scanned_bytes, inner_tuples, times->table_bytes);
+  }
+
+  // private dense arrays are one per thread, the other targets are shared
+  // (and the hash table is summed up from its occupancy bitmap and the
+  // buckets of its groups)
+  size_t aggr_bytes = 0, finalize_bytes = 0;
+  if (base->aggr_table != NULL) {
+    aggr_bytes = base->aggr_buckets * sizeof(bucket_aggr_t);
+    finalize_bytes = (base->aggr_buckets + 63) / 64 * 8 +
+                     groups * sizeof(bucket_aggr_t);
+  } else if (base->dense_table != NULL) {
+    aggr_bytes = base->dense_groups * sizeof(bucket_dense_t);
+    finalize_bytes = aggr_bytes * (base->dense_private ? threads : 1);
+  }
+  roofline_phase(roofline, Q4112_PHASE_PROBE,
+                 times->probe_end_ns - times->build_end_ns,
+                 plan->probe_threads, outer_bytes(base), outer_tuples,
+                 times->table_bytes);
+  if (aggr_bytes != 0) {
+    roofline_phase(roofline, Q4112_PHASE_PROBE, 0, plan->probe_threads, 0,
+                   outer_tuples, aggr_bytes);
+  }
+  roofline_phase(roofline, Q4112_PHASE_FINALIZE,
+                 times->end_ns - times->probe_end_ns, threads,
+                 finalize_bytes, 0, 0);
+}
+
+// Memory budget: the join table, the aggregation target and the thread
+// infos of a query are sized against the bytes left in its arena before
+// any of them is allocated. If they do not fit, the engine takes lower-
+// memory strategies one at a time, the cheapest first: one shared
+// direct-mapped array instead of one per thread, the atomic build instead
+// of the scatter buffer of the partitioned build, the SIMD-tagged join
+// table at its fill rate and then at SWISS_MAX_FILL (where it is smaller
+// than the table it replaces), and last the hash aggregation table in
+// passes over orders, each with a table for a partition of the groups
+// (every pass probes all of orders again).
+#define MAX_AGGR_PARTS 4096
+
+// bytes of the tables of a query with an aggregation target (TARGET_NONE
+// for none) in passes over orders
+static size_t query_bytes(const q4112_run_info_hj_t* base, int threads,
+                          int target, size_t aggr_buckets_estimate,
+                          uint32_t min_key, uint32_t max_key, size_t parts) {
+  size_t bytes = threads * sizeof(q4112_run_info_hj_t);
+  if (!base->prebuilt) {
+    bytes += join_bytes(base) + scatter_bytes(base, threads) +
+             inner_sel_bytes(base, threads);
+  }
+  if (target != TARGET_NONE) {
+    bytes += aggr_target_bytes(target, threads,
+        (aggr_buckets_estimate + parts - 1) / parts, min_key, max_key);
+  }
+  return bytes;
+}
+
+// fit the tables of a query into the bytes left in its arena (changes the
+// build mode and the join table layout of the base info, the aggregation
+// target and the passes, and notes them in the usage report if not NULL;
+// returns 0 if even the smallest tables do not fit)
+static int fit_budget(q4112_run_info_hj_t* base, int threads, int* target,
+                      size_t aggr_buckets_estimate, uint32_t min_key,
+                      uint32_t max_key, size_t* parts, q4112_usage_t* usage) {
+  size_t available = arena_available(base->arena);
+  size_t estimate = aggr_buckets_estimate;
+  *parts = 1;
+  if (query_bytes(base, threads, *target, estimate, min_key, max_key, 1) <=
+      available) {
+    return 1;
+  }
+
+  // one shared direct-mapped array
+  if (*target == TARGET_DENSE_PRIVATE) {
+    *target = TARGET_DENSE_SHARED;
+    if (usage != NULL) usage->shared_dense = 1;
+    if (query_bytes(base, threads, *target, estimate, min_key, max_key, 1) <=
+        available) {
+      return 1;
+    }
+  }
+
+  if (!base->prebuilt) {
+    // the atomic build
+    if (scatter_bytes(base, threads) != 0) {
+      base->build = Q4112_BUILD_ATOMIC;
+      if (usage != NULL) usage->atomic_build = 1;
+      if (query_bytes(base, threads, *target, estimate, min_key, max_key,
+                      1) <= available) {
+        return 1;
+      }
+    }
+    // a denser join table
+    double fills[2] = {SWISS_FILL, SWISS_MAX_FILL};
+    int f;
+    for (f = 0; f != 2; ++f) {
+      q4112_run_info_hj_t swiss = *base;
+      swiss.table_layout = Q4112_TABLE_SWISS;
+      swiss.swiss_fill = fills[f];
+      if (join_bytes(&swiss) >= join_bytes(base)) continue;
+      base->table_layout = Q4112_TABLE_SWISS;
+      base->swiss_fill = fills[f];
+      if (query_bytes(base, threads, *target, estimate, min_key, max_key,
+                      1) <= available) {
+        return 1;
+      }
+    }
+  }
+
+  // aggregation in passes (a direct-mapped array is not split)
+  if (*target == TARGET_NONE) return 0;
+  *target = TARGET_HASH;
+  while (query_bytes(base, threads, *target, estimate, min_key, max_key,
+                     *parts) > available) {
+    if (*parts == MAX_AGGR_PARTS || *parts >= estimate) return 0;
+    *parts *= 2;
+  }
+  return 1;
+}
+
+// plan the query (build side and threads per phase), estimate the groups,
+// then join and aggregate the columns of the base info (plain or
+// bit-packed), using a direct-mapped aggregation array if the keys of
+// orders.store_id are dense
+static uint64_t q4112_run_columns(q4112_run_info_hj_t* base, int threads) {
+  // the roofline report starts from the memory of the machine
+  q4112_roofline_t* roofline = base->roofline;
+  if (roofline != NULL) {
+    memset(roofline, 0, sizeof(q4112_roofline_t));
+    q4112_memory_calibrate(&roofline->memory);
+  }
+  // and the memory report from the budget
+  q4112_usage_t* usage = base->usage;
+  usage_init(usage, base->memory_budget, base->table_layout);
+
+  // small queries skip all of the parallel machinery (their tables are on
+  // the stack)
+  if (base->inner_tuples <= SMALL_INNER && base->outer_tuples <= SMALL_OUTER &&
+      base->packed_keys == NULL && !base->prebuilt) {
+    assert(threads > 0);
+    if (base->plan != NULL) {
+      memset(base->plan, 0, sizeof(q4112_plan_t));
+      base->plan->side = Q4112_SIDE_ITEMS;
+      base->plan->build_tuples = base->inner_tuples;
+      base->plan->build_threads = 1;
+      base->plan->probe_threads = 1;
+    }
+    uint64_t start_ns = get_time_in_ns();
+    uint64_t result = run_small(base);
+    // one phase in the calling thread on tables in the cache
+    if (roofline != NULL) {
+      roofline_phase(roofline, Q4112_PHASE_PROBE,
+                     get_time_in_ns() - start_ns, 1,
+                     base->inner_tuples * 8 + outer_bytes(base),
+                     base->inner_tuples + base->outer_tuples, 0);
+      roofline_print(roofline);
+    }
+    return result;
+  }
+
+  // check number of threads
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+
+  // scratch memory of the query
+  arena_t arena;
+  arena_init(&arena, base->memory_budget);
+  base->arena = &arena;
+
+  // threads per phase from the input sizes, unless they are fixed
+  q4112_plan_t plan;
+  memset(&plan, 0, sizeof(plan));
+  int tune = !base->fixed_threads;
+  if (tune) {
+    pthread_once(&calibration_once, calibrate);
+    plan.thread_ns = calibration_thread_ns;
+    plan.tuple_ns = calibration_tuple_ns;
+  }
+  plan.estimate_threads = tune ?
+      tune_threads(base->outer_tuples, threads) : threads;
+
+  // build on orders if they reference few of the items
+  const uint32_t* inner_keys = base->inner_keys;
+  const uint32_t* inner_vals = base->inner_vals;
+  size_t inner_tuples = base->inner_tuples;
+  plan.side = Q4112_SIDE_ITEMS;
+  if (base->packed_keys == NULL && !base->prebuilt &&
+      (base->side == Q4112_SIDE_ORDERS ||
+       (base->side == Q4112_SIDE_AUTO && base->outer_tuples < inner_tuples))) {
+    uint32_t min_key, max_key;
+    uint64_t start_ns = get_time_in_ns();
+    size_t distinct_keys = estimate_columns(base->outer_keys, NULL,
+        base->outer_tuples, plan.estimate_threads, base->hash, &arena,
+        &min_key, &max_key, NULL, NULL, NULL);
+    if (roofline != NULL) {
+      roofline_phase(roofline, Q4112_PHASE_ESTIMATE,
+                     get_time_in_ns() - start_ns, plan.estimate_threads,
+                     base->outer_tuples * 4, 0, 0);
+    }
+    // (no reduction if the estimation did not fit into the budget)
+    if (distinct_keys != SIZE_MAX &&
+        (base->side == Q4112_SIDE_ORDERS ||
+         distinct_keys * TUNE_REDUCE_RATIO <= inner_tuples)) {
+      plan.outer_distinct_keys = distinct_keys;
+      arena_phase(&arena, Q4112_PHASE_REDUCE);
+      if (reduce_inner(base, tune ? tune_threads(inner_tuples, threads) :
+                       threads, distinct_keys)) {
+        plan.side = Q4112_SIDE_ORDERS;
+      }
+    }
+  }
+  // a join table built beforehand needs no build threads
+  plan.build_tuples = base->inner_tuples;
+  plan.build_threads = base->prebuilt ? 0 : tune ?
+      tune_threads(base->inner_tuples, threads) : threads;
+  plan.probe_threads = tune ?
+      tune_threads(base->outer_tuples, threads) : threads;
+  int query_threads = plan.build_threads > plan.probe_threads ?
+      plan.build_threads : plan.probe_threads;
+
+  // ungrouped query (no orders.store_id): no aggregation table
+  base->aggr_table = NULL;
+  base->aggr_live = NULL;
+  base->dense_table = NULL;
+  int target = TARGET_NONE, fits = 1;
+  uint32_t min_key = 0, max_key = 0;
+  size_t aggr_buckets_estimate = 0;
+  hot_keys_t hot_groups;
+  hot_groups.num_keys = 0;
+  if (base->outer_aggr_keys != NULL || base->packed_aggr_keys != NULL) {
+    arena_phase(&arena, Q4112_PHASE_ESTIMATE);
+    uint64_t start_time_ns = get_time_in_ns();
+    // estimate the global aggregation table size and find the heavy
+    // hitters of orders.store_id and orders.item_id
+    hot_keys_t hot_join_keys;
+    aggr_buckets_estimate = estimate_columns(
+        base->outer_aggr_keys, base->packed_aggr_keys, base->outer_tuples,
+        plan.estimate_threads, base->hash, &arena, &min_key, &max_key,
+        &hot_groups, base->outer_keys, &hot_join_keys);
+    fits = aggr_buckets_estimate != SIZE_MAX;
+    if (fits) {
+      plan.hot_groups = hot_groups.num_keys;
+      plan.hot_join_keys = base->outer_keys != NULL ?
+          hot_join_keys.num_keys : 0;
+    }
+
+    uint64_t estimate_ns = get_time_in_ns() - start_time_ns;
+    if (roofline != NULL) {
+      roofline_phase(roofline, Q4112_PHASE_ESTIMATE, estimate_ns,
+                     plan.estimate_threads,
+                     base->packed_aggr_keys != NULL ?
+                     q4112_packed_bytes(base->packed_aggr_keys) :
+                     base->outer_tuples * 4, 0, 0);
+    }
+    if (fits) {
+      target = aggr_target(aggr_buckets_estimate, min_key, max_key);
+    }
+
+    // few groups in the shared hash table: fewer threads probe
+    if (tune && target == TARGET_HASH) {
+      size_t most = aggr_buckets_estimate / TUNE_GROUPS_PER_THREAD;
+      if (most < 1) most = 1;
+      if ((size_t) plan.probe_threads > most) plan.probe_threads = most;
+      query_threads = plan.build_threads > plan.probe_threads ?
+          plan.build_threads : plan.probe_threads;
+    }
+  }
+
+  // fit the tables into the memory budget
+  size_t parts = 1, pass;
+  base->build_threads = plan.build_threads;
+  base->probe_threads = plan.probe_threads;
+  arena_phase(&arena, Q4112_PHASE_BUILD);
+  if (fits) {
+    fits = fit_budget(base, query_threads, &target, aggr_buckets_estimate,
+                      min_key, max_key, &parts, usage);
+  }
+
+  // hot groups only contend in targets shared by the threads (a hot join
+  // key is one bucket that every thread only reads, so it stays in the
+  // cache of every core and needs no replicas)
+  if (target == TARGET_HASH || target == TARGET_DENSE_SHARED) {
+    base->hot = hot_groups;
+  }
+
+  if (base->plan != NULL) {
+    *base->plan = plan;
+  }
+
+  // the join table is built in the first pass and probed in every pass,
+  // which aggregates its partition of the groups in a table of its own
+  uint64_t sum_avgs = 0, num_groups = 0;
+  int prebuilt = base->prebuilt;
+  base->finalize = 1;
+  base->aggr_parts = parts;
+  base->log_aggr_parts = trailing_zero_count2(parts);
+  for (pass = 0; fits && pass != parts; ++pass) {
+    if (target != TARGET_NONE) {
+      fits = create_aggr_table(base, query_threads, target,
+                               (aggr_buckets_estimate + parts - 1) / parts,
+                               min_key, max_key);
+      if (!fits) break;
+      assert(base->aggr_table == NULL ||
+             base->log_aggr_buckets + base->log_aggr_parts <= 32);
+    }
+    run_times_t times;
+    memset(&times, 0, sizeof(times));
+    if (pass == 0 && !prebuilt) {
+      times.start_ns = get_time_in_ns();
+      fits = create_join_table(base, query_threads);
+      if (!fits) {
+        free_aggr_table(base, query_threads);
+        break;
+      }
+    }
+    base->aggr_part = pass;
+    base->times = roofline != NULL ? &times : NULL;
+    uint64_t pass_sum_avgs, pass_groups;
+    fits = q4112_run_threads(base, query_threads, &pass_sum_avgs,
+                             &pass_groups) != SIZE_MAX;
+    base->times = NULL;
+    if (!fits) {
+      free_aggr_table(base, query_threads);
+      break;
+    }
+    sum_avgs += pass_sum_avgs;
+    num_groups += pass_groups;
+    if (roofline != NULL) {
+      roofline_threads(roofline, base, &plan, query_threads, &times,
+                       pass_groups);
+    }
+    free_aggr_table(base, query_threads);
+    base->prebuilt = 1;
+  }
+  base->prebuilt = prebuilt;
+  if (roofline != NULL) {
+    roofline_print(roofline);
+  }
+
+  // the memory report (with the fill rate of the join table)
+  usage_peaks(usage, &arena);
+  if (usage != NULL) {
+    usage->table = base->table_layout;
+    if (fits) usage->join_fill = join_fill(base);
+    usage->aggr_passes = parts;
+    usage->over_budget = !fits;
+  }
+
+  // clean up
+  if (!prebuilt) {
+    free_join_table(base, query_threads);
+  }
+  if (plan.side == Q4112_SIDE_ORDERS) {
+    arena_free(&arena, (uint32_t*) base->inner_keys,
+               base->inner_tuples * 4 + 4);
+    arena_free(&arena, (uint32_t*) base->inner_vals,
+               base->inner_tuples * 4 + 4);
+    base->inner_keys = inner_keys;
+    base->inner_vals = inner_vals;
+    base->inner_tuples = inner_tuples;
+  }
+  base->arena = NULL;
+  arena_destroy(&arena);
+
+  // predicates may leave no joined tuples (and a query over its budget
+  // does not run)
+  if (!fits) {
+    return 0;
+  }
+  return num_groups == 0 ? 0 : sum_avgs / num_groups;
+}
+
+void q4112_options_init(q4112_options_t* options) {
+  memset(options, 0, sizeof(q4112_options_t));
+  options->table = Q4112_TABLE_LINEAR;
+  options->build = Q4112_BUILD_PARTITIONED;
+  options->hash = Q4112_HASH_MULTIPLY;
+}
+
+// copy the predicates of the options to the query (orders.store_id can only
+// be restricted in the query with GROUP BY)
+static void set_predicates(q4112_run_info_hj_t* base,
+                           const q4112_options_t* options) {
+  size_t p;
+  for (p = 0; p != options->num_predicates; ++p) {
+    const q4112_predicate_t* pred = &options->predicates[p];
+    assert(pred->column <= Q4112_COLUMN_PRICE);
+    assert(pred->cmp <= Q4112_CMP_IN);
+    assert(pred->column != Q4112_COLUMN_STORE_ID ||
+           base->outer_aggr_keys != NULL);
+    assert(pred->cmp != Q4112_CMP_IN || pred->num_values == 0 ||
+           pred->values != NULL);
+  }
+  base->predicates = options->predicates;
+  base->num_predicates = options->num_predicates;
+}
+
+// copy the hash function of the options to the query
+static void set_hash(q4112_run_info_hj_t* base, q4112_hash_t hash) {
+  assert(hash <= Q4112_HASH_TABULATION);
+  q4112_hash_init();
+  base->hash = hash;
+}
+
+// copy the build side, thread and memory options and the plan, roofline
+// and memory reports to the query
+static void set_plan(q4112_run_info_hj_t* base,
+                     const q4112_options_t* options) {
+  assert(options->side <= Q4112_SIDE_ORDERS);
+  base->side = options->side;
+  base->fixed_threads = options->fixed_threads;
+  base->plan = options->plan;
+  base->roofline = options->roofline;
+  base->memory_budget = options->memory_budget;
+  base->usage = options->usage;
+}
+
+// the function to start multi-threaded hash join for the query
+uint64_t q4112_run(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    int threads) {
+  return q4112_run_options(inner_keys, inner_vals, inner_tuples,
+                           outer_join_keys, outer_aggr_keys, outer_vals,
+                           outer_tuples, threads, NULL);
+}
+
+uint64_t q4112_run_options(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    int threads,
+    const q4112_options_t* options) {
+  q4112_options_t defaults;
+  if (options == NULL) {
+    q4112_options_init(&defaults);
+    options = &defaults;
+  }
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_keys = inner_keys;
+  base.inner_vals = inner_vals;
+  base.inner_tuples = inner_tuples;
+  base.outer_keys = outer_join_keys;
+  base.outer_aggr_keys = outer_aggr_keys;
+  base.outer_vals = outer_vals;
+  base.outer_tuples = outer_tuples;
+  base.table_layout = options->table;
+  base.build = options->build;
+  set_hash(&base, options->hash);
+  set_predicates(&base, options);
+  set_plan(&base, options);
+  return q4112_run_columns(&base, threads);
+}
 
-  fprintf(stderr, "calculate hash table\n");
-  // set the number of hash table buckets to be 2^k
-  // the hash table fill rate will be between 1/3 and 2/3
-  int8_t log_buckets = 1;
-  size_t buckets = 2;
-  while (buckets * 0.67 < inner_tuples) {
-    log_buckets += 1;
-    buckets += buckets;
+void q4112_run_groups(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    const q4112_agg_t* aggs,
+    size_t num_aggs,
+    q4112_groups_t* result,
+    int threads,
+    const q4112_options_t* options) {
+  // check number of threads
+  int t, max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+  assert(outer_aggr_keys != NULL && num_aggs > 0);
+
+  q4112_options_t defaults;
+  if (options == NULL) {
+    q4112_options_init(&defaults);
+    options = &defaults;
   }
+  group_layout_t layout;
+  layout_init(&layout, aggs, num_aggs);
 
-  fprintf(stderr, "create hash table\n");
-  // allocate and initialize the hash table
-  // there are no 0 keys (see header) so we use 0 for "no key"
-  bucket_t* table = (bucket_t*) calloc(buckets, sizeof(bucket_t));
-  assert(table != NULL);
+  // the private tables grow with the groups of their thread, so there is
+  // no estimation pass over orders.store_id
+  group_table_t* group_tables = (group_table_t*)
+      malloc(threads * sizeof(group_table_t));
+  assert(group_tables != NULL);
+  for (t = 0; t != threads; ++t) {
+    group_table_init(&group_tables[t], &layout, 10, options->hash);
+  }
 
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_keys = inner_keys;
+  base.inner_vals = inner_vals;
+  base.inner_tuples = inner_tuples;
+  base.outer_keys = outer_join_keys;
+  base.outer_aggr_keys = outer_aggr_keys;
+  base.outer_vals = outer_vals;
+  base.outer_tuples = outer_tuples;
+  base.table_layout = options->table;
+  base.build = options->build;
+  set_hash(&base, options->hash);
+  set_predicates(&base, options);
+  base.group_layout = &layout;
+  base.group_tables = group_tables;
+  base.aggs = aggs;
+  base.num_aggs = num_aggs;
+  base.groups = result;
+  base.finalize = 1;
 
-  fprintf(stderr, "create barriers\n");
-  // set up barrier for threads
-  pthread_barrier_init(&barrier2, NULL, threads);
-  pthread_barrier_init(&barrier3, NULL, threads);
+  // (no groups if the thread info or the join table cannot be allocated)
+  uint64_t sum_avgs, num_groups;
+  if (q4112_run_threads(&base, threads, &sum_avgs, &num_groups) ==
+      SIZE_MAX) {
+    memset(result, 0, sizeof(q4112_groups_t));
+  } else {
+    assert(num_groups == result->groups);
+  }
+
+  for (t = 0; t != threads; ++t) {
+    free(group_tables[t].rows);
+  }
+  free(group_tables);
+}
 
+void q4112_groups_free(q4112_groups_t* result) {
+  free(result->buffer);
+  result->groups = 0;
+  result->keys = NULL;
+  result->columns = NULL;
+  result->buffer = NULL;
+}
 
-  fprintf(stderr, "run threads\n");
-  // run threads for matching
+q4112_ready_t* q4112_ready_create(size_t tuples, size_t chunk_tuples) {
+  assert(chunk_tuples > 0);
+  q4112_ready_t* ready = (q4112_ready_t*) malloc(sizeof(q4112_ready_t));
+  assert(ready != NULL);
+  ready->tuples = tuples;
+  ready->chunk_tuples = chunk_tuples;
+  ready->chunks = (tuples + chunk_tuples - 1) / chunk_tuples;
+  ready->ready = (uint8_t*) calloc(ready->chunks + 1, 1);
+  assert(ready->ready != NULL);
+  pthread_mutex_init(&ready->mutex, NULL);
+  pthread_cond_init(&ready->cond, NULL);
+  return ready;
+}
+
+void q4112_ready_mark(q4112_ready_t* ready, size_t chunk) {
+  assert(chunk < ready->chunks);
+  pthread_mutex_lock(&ready->mutex);
+  __atomic_store_n(&ready->ready[chunk], 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&ready->cond);
+  pthread_mutex_unlock(&ready->mutex);
+}
+
+void q4112_ready_free(q4112_ready_t* ready) {
+  pthread_mutex_destroy(&ready->mutex);
+  pthread_cond_destroy(&ready->cond);
+  free(ready->ready);
+  free(ready);
+}
+
+// query running in the background: a thread of its own starts the threads
+// of the query, waits for them and keeps the result
+struct q4112_async {
+  pthread_t id;
+  q4112_run_info_hj_t base;
+  int threads;
+  // the average revenue of every group (the query with GROUP BY)
+  q4112_agg_t agg;
+  group_layout_t layout;
+  uint64_t result;
+  int done;
+};
+
+void* async_thread(void* arg) {
+  q4112_async_t* query = (q4112_async_t*) arg;
+  assert(pthread_equal(pthread_self(), query->id));
+  q4112_run_info_hj_t* base = &query->base;
+  int threads = query->threads, t;
+  uint64_t sum_avgs, num_groups;
+
+  // ungrouped query: the average is the sum over the joined tuples (0 if
+  // the thread info or the join table cannot be allocated)
+  if (base->group_layout == NULL) {
+    if (q4112_run_threads(base, threads, &sum_avgs, &num_groups) ==
+        SIZE_MAX) {
+      num_groups = 0;
+    }
+    query->result = num_groups == 0 ? 0 : sum_avgs / num_groups;
+    __atomic_store_n(&query->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  // the groups are not known before orders are loaded, so the private
+  // tables grow with the groups of their thread
+  group_table_t* group_tables = (group_table_t*)
+      malloc(threads * sizeof(group_table_t));
+  assert(group_tables != NULL);
   for (t = 0; t != threads; ++t) {
-    info[t].thread = t;
-    info[t].threads = threads;
-    info[t].inner_keys = inner_keys;
-    info[t].inner_vals = inner_vals;
-    info[t].outer_keys = outer_join_keys;
-    info[t].outer_vals = outer_vals;
-    info[t].outer_aggr_keys = outer_aggr_keys;
-    info[t].inner_tuples = inner_tuples;
-    info[t].outer_tuples = outer_tuples;
-    info[t].table = table;
-    info[t].log_buckets = log_buckets;
-    info[t].buckets = buckets;
-    info[t].aggr_table = aggr_table;
-    info[t].log_aggr_buckets = log_aggr_buckets;
-    info[t].aggr_buckets = aggr_buckets;
-    pthread_create(&info[t].id, NULL, q4112_run_thread, &info[t]);
+    group_table_init(&group_tables[t], &query->layout, 10, base->hash);
   }
+  // (no groups if the thread info or the join table cannot be allocated)
+  q4112_groups_t groups;
+  memset(&groups, 0, sizeof(groups));
+  base->group_tables = group_tables;
+  base->groups = &groups;
+  q4112_run_threads(base, threads, &sum_avgs, &num_groups);
 
-  fprintf(stderr, "gather result\n");
-  // gather result
-  uint64_t sum_avgs = 0;
-  uint32_t num_groups = 0;
+  // average of the per-group averages
+  uint64_t sum = 0;
+  size_t g;
+  for (g = 0; g != groups.groups; ++g) {
+    sum += groups.columns[0][g];
+  }
+  query->result = groups.groups == 0 ? 0 : sum / groups.groups;
+  q4112_groups_free(&groups);
   for (t = 0; t != threads; ++t) {
-    pthread_join(info[t].id, NULL);
-    sum_avgs += info[t].sum_avgs;
-    num_groups += info[t].num_groups;
+    free(group_tables[t].rows);
   }
+  free(group_tables);
+  __atomic_store_n(&query->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
-  // clean up
-  pthread_barrier_destroy(&barrier);
-  pthread_barrier_destroy(&barrier2);
-  pthread_barrier_destroy(&barrier3);
-  free(info);
-  free(table);
-  free(aggr_table);
+q4112_async_t* q4112_run_async(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    q4112_ready_t* inner_ready,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    q4112_ready_t* outer_ready,
+    int threads,
+    const q4112_options_t* options) {
+  // check number of threads
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+  assert(inner_ready == NULL || inner_ready->tuples == inner_tuples);
+  assert(outer_ready == NULL || outer_ready->tuples == outer_tuples);
+
+  q4112_options_t defaults;
+  if (options == NULL) {
+    q4112_options_init(&defaults);
+    options = &defaults;
+  }
+  q4112_async_t* query = (q4112_async_t*) malloc(sizeof(q4112_async_t));
+  assert(query != NULL);
+  memset(query, 0, sizeof(q4112_async_t));
+  q4112_run_info_hj_t* base = &query->base;
+  base->inner_keys = inner_keys;
+  base->inner_vals = inner_vals;
+  base->inner_tuples = inner_tuples;
+  base->inner_ready = inner_ready;
+  base->outer_keys = outer_join_keys;
+  base->outer_aggr_keys = outer_aggr_keys;
+  base->outer_vals = outer_vals;
+  base->outer_tuples = outer_tuples;
+  base->outer_ready = outer_ready;
+  base->table_layout = options->table;
+  // the partitioned build scatters all of items first
+  base->build = inner_ready != NULL ? Q4112_BUILD_ATOMIC : options->build;
+  set_hash(base, options->hash);
+  set_predicates(base, options);
+  base->finalize = 1;
+  if (outer_aggr_keys != NULL) {
+    query->agg.func = Q4112_AGG_AVG;
+    query->agg.arg = Q4112_ARG_REVENUE;
+    layout_init(&query->layout, &query->agg, 1);
+    base->group_layout = &query->layout;
+    base->aggs = &query->agg;
+    base->num_aggs = 1;
+  }
+  query->threads = threads;
+  if (pthread_create(&query->id, NULL, async_thread, query) != 0) {
+    free(query);
+    return NULL;
+  }
+  return query;
+}
+
+int q4112_async_done(const q4112_async_t* query) {
+  return __atomic_load_n(&query->done, __ATOMIC_ACQUIRE);
+}
+
+uint64_t q4112_async_wait(q4112_async_t* query) {
+  pthread_join(query->id, NULL);
+  uint64_t result = query->result;
+  free(query);
+  return result;
+}
+
+// join table of items built once (in memory or attached from a snapshot)
+struct q4112_join_table {
+  q4112_table_t layout;
+  q4112_hash_t hash;
+  int8_t log_buckets;
+  size_t buckets;
+  bucket_t* table;
+  swiss_group_t* swiss;
+  size_t swiss_groups;
+  size_t inner_tuples;
+  uint64_t checksum;  // of the items columns
+  // mapping of an attached snapshot (NULL if built in memory)
+  void* map;
+  size_t map_bytes;
+};
+
+// header of a join table snapshot (native byte order, since the table
+// follows in its in-memory layout)
+#define SNAPSHOT_MAGIC 0x314a323131345151ull  // "QQ4112J1"
+#define SNAPSHOT_ALIGN 4096
+typedef struct {
+  uint64_t magic;
+  uint64_t layout;
+  uint64_t log_buckets;
+  uint64_t buckets;
+  uint64_t swiss_groups;
+  uint64_t inner_tuples;
+  uint64_t checksum;
+  uint64_t table_offset;  // page aligned, so the mapped table is aligned
+  uint64_t table_bytes;
+  // hash function (0, multiplicative hashing, in files that predate it)
+  uint64_t hash;
+} snapshot_header_t;
+
+// checksum of the items columns a join table is built from (multiply-xor
+// hashing in 4 independent lanes, so it runs at memory bandwidth)
+static uint64_t columns_checksum(const uint32_t* keys, const uint32_t* vals,
+                                 size_t tuples) {
+  const uint64_t m = 0x9e3779b97f4a7c15ull;
+  uint64_t h[4] = {1, 2, 3, 4};
+  size_t i, l;
+  for (i = 0; i + 4 <= tuples; i += 4) {
+    for (l = 0; l != 4; ++l) {
+      h[l] = (h[l] ^ (((uint64_t) keys[i + l] << 32) | vals[i + l])) * m;
+    }
+  }
+  for (; i != tuples; ++i) {
+    h[0] = (h[0] ^ (((uint64_t) keys[i] << 32) | vals[i])) * m;
+  }
+  uint64_t x = tuples;
+  for (l = 0; l != 4; ++l) {
+    x = (x ^ h[l]) * m;
+    x ^= x >> 29;
+  }
+  return x;
+}
+
+static size_t join_table_bytes(const q4112_join_table_t* join) {
+  return join->swiss != NULL ? join->swiss_groups * sizeof(swiss_group_t) :
+                               join->buckets * sizeof(bucket_t);
+}
+
+q4112_join_table_t* q4112_join_build(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    int threads,
+    const q4112_options_t* options) {
+  // check number of threads
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+
+  q4112_options_t defaults;
+  if (options == NULL) {
+    q4112_options_init(&defaults);
+    options = &defaults;
+  }
+  assert(count_predicates(options->predicates, options->num_predicates,
+                          Q4112_COLUMN_PRICE) == 0);
+
+  // run the build phase of the query only (no orders tuples)
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_keys = inner_keys;
+  base.inner_vals = inner_vals;
+  base.inner_tuples = inner_tuples;
+  base.table_layout = options->table;
+  base.build = options->build;
+  set_hash(&base, options->hash);
+  q4112_usage_t* usage = options->usage;
+  usage_init(usage, options->memory_budget, options->table);
+  arena_t arena;
+  arena_init(&arena, options->memory_budget);
+  arena_phase(&arena, Q4112_PHASE_BUILD);
+  base.arena = &arena;
+  uint64_t sum_avgs, num_groups;
+  int fits = create_join_table(&base, threads);
+  if (fits && q4112_run_threads(&base, threads, &sum_avgs, &num_groups) ==
+      SIZE_MAX) {
+    free_join_table(&base, threads);
+    fits = 0;
+  }
+  usage_peaks(usage, &arena);
+  if (usage != NULL) {
+    usage->over_budget = !fits;
+    if (fits) usage->join_fill = join_fill(&base);
+  }
+  if (!fits) {
+    arena_destroy(&arena);
+    return NULL;
+  }
+  // the table is kept (and freed by q4112_join_free), so it leaves the
+  // arena without being freed
+  free_build_buffers(&base, threads);
+  arena_give(&arena, base.swiss != NULL ?
+      base.swiss_groups * sizeof(swiss_group_t) :
+      base.buckets * sizeof(bucket_t));
+  arena_destroy(&arena);
+
+  q4112_join_table_t* join = (q4112_join_table_t*)
+      calloc(1, sizeof(q4112_join_table_t));
+  assert(join != NULL);
+  join->layout = options->table;
+  join->hash = options->hash;
+  join->log_buckets = base.log_buckets;
+  join->buckets = base.buckets;
+  join->table = base.table;
+  join->swiss = base.swiss;
+  join->swiss_groups = base.swiss_groups;
+  join->inner_tuples = inner_tuples;
+  join->checksum = columns_checksum(inner_keys, inner_vals, inner_tuples);
+  return join;
+}
+
+int q4112_join_save(const q4112_join_table_t* join, const char* path) {
+  snapshot_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SNAPSHOT_MAGIC;
+  header.layout = join->layout;
+  header.hash = join->hash;
+  header.log_buckets = join->log_buckets;
+  header.buckets = join->buckets;
+  header.swiss_groups = join->swiss_groups;
+  header.inner_tuples = join->inner_tuples;
+  header.checksum = join->checksum;
+  header.table_offset = SNAPSHOT_ALIGN;
+  header.table_bytes = join_table_bytes(join);
+
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) return -1;
+  char padding[SNAPSHOT_ALIGN - sizeof(header)];
+  memset(padding, 0, sizeof(padding));
+  const void* table = join->swiss != NULL ? (const void*) join->swiss :
+                                            (const void*) join->table;
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(padding, sizeof(padding), 1, file) == 1 &&
+           fwrite(table, header.table_bytes, 1, file) == 1;
+  if (fclose(file) != 0) ok = 0;
+  return ok ? 0 : -1;
+}
+
+// does a join table have an empty bucket (a group with one for the
+// SIMD-tagged layout), which ends the probes of missing keys
+static int snapshot_has_empty(const void* table, int swiss, size_t slots) {
+  size_t i;
+  if (swiss) {
+    const swiss_group_t* groups = (const swiss_group_t*) table;
+    for (i = 0; i != slots; ++i) {
+      if (swiss_empty(groups[i].tags.word) != 0) return 1;
+    }
+    return 0;
+  }
+  const bucket_t* buckets = (const bucket_t*) table;
+  for (i = 0; i != slots; ++i) {
+    if (buckets[i].key == 0) return 1;
+  }
+  return 0;
+}
+
+q4112_join_table_t* q4112_join_load(
+    const char* path,
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= SNAPSHOT_ALIGN) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  // the header must describe a table of these items that fits the file
+  // (sizes checked before they are multiplied, since they come from the
+  // file), and the table must have an empty bucket or probes never end
+  const snapshot_header_t* header = (const snapshot_header_t*) map;
+  int swiss = header->layout == Q4112_TABLE_SWISS;
+  int valid = header->magic == SNAPSHOT_MAGIC &&
+      header->layout <= Q4112_TABLE_SWISS &&
+      header->hash <= Q4112_HASH_TABULATION &&
+      header->inner_tuples == inner_tuples &&
+      header->log_buckets >= 1 && header->log_buckets <= 32 &&
+      header->buckets == (uint64_t) 1 << header->log_buckets &&
+      header->buckets <= SIZE_MAX / sizeof(bucket_t) &&
+      header->swiss_groups <= ((uint64_t) 1 << 32) &&
+      header->swiss_groups <= SIZE_MAX / sizeof(swiss_group_t) &&
+      (!swiss || header->swiss_groups != 0) &&
+      header->table_offset == SNAPSHOT_ALIGN &&
+      header->table_bytes <= (uint64_t) st.st_size - header->table_offset &&
+      header->table_bytes == (swiss ?
+          header->swiss_groups * sizeof(swiss_group_t) :
+          header->buckets * sizeof(bucket_t)) &&
+      snapshot_has_empty((const char*) map + header->table_offset, swiss,
+                         swiss ? header->swiss_groups : header->buckets) &&
+      header->checksum == columns_checksum(inner_keys, inner_vals,
+                                           inner_tuples);
+  if (!valid) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  q4112_join_table_t* join = (q4112_join_table_t*)
+      calloc(1, sizeof(q4112_join_table_t));
+  assert(join != NULL);
+  join->layout = header->layout;
+  join->hash = header->hash;
+  join->log_buckets = header->log_buckets;
+  join->buckets = header->buckets;
+  join->swiss_groups = header->swiss_groups;
+  join->inner_tuples = header->inner_tuples;
+  join->checksum = header->checksum;
+  void* table = (char*) map + header->table_offset;
+  if (join->layout == Q4112_TABLE_SWISS) {
+    join->swiss = (swiss_group_t*) table;
+  } else {
+    join->table = (bucket_t*) table;
+  }
+  join->map = map;
+  join->map_bytes = st.st_size;
+  return join;
+}
+
+uint64_t q4112_run_join(
+    const q4112_join_table_t* join,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    int threads,
+    const q4112_options_t* options) {
+  q4112_options_t defaults;
+  if (options == NULL) {
+    q4112_options_init(&defaults);
+    options = &defaults;
+  }
+  assert(count_predicates(options->predicates, options->num_predicates,
+                          Q4112_COLUMN_PRICE) == 0);
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_tuples = join->inner_tuples;
+  base.outer_keys = outer_join_keys;
+  base.outer_aggr_keys = outer_aggr_keys;
+  base.outer_vals = outer_vals;
+  base.outer_tuples = outer_tuples;
+  set_predicates(&base, options);
+  // the table is only read, so an attached snapshot stays read-only
+  base.prebuilt = 1;
+  base.table_layout = join->layout;
+  set_hash(&base, join->hash);
+  base.log_buckets = join->log_buckets;
+  base.buckets = join->buckets;
+  base.table = join->table;
+  base.swiss = join->swiss;
+  base.swiss_groups = join->swiss_groups;
+  set_plan(&base, options);
+  return q4112_run_columns(&base, threads);
+}
+
+void q4112_join_free(q4112_join_table_t* join) {
+  if (join->map != NULL) {
+    munmap(join->map, join->map_bytes);
+  } else {
+    free(join->table);
+    free(join->swiss);
+  }
+  free(join);
+}
+
+// orders tuples joined with all queries of a shared scan before moving on
+// (the block of the three columns, 192 KB, stays in the L2 cache while the
+// tables of the queries take turns in the other caches)
+#define SHARED_BLOCK 16384
+
+// thread info of a shared scan
+typedef struct {
+  pthread_t id;
+  int thread;
+  int threads;
+  size_t queries;
+  // info of query q for thread t is at info[q * threads + t]
+  q4112_run_info_hj_t* info;
+} q4112_shared_info_t;
+
+void* q4112_shared_thread(void* arg) {
+  q4112_shared_info_t* shared = (q4112_shared_info_t*) arg;
+  assert(pthread_equal(pthread_self(), shared->id));
+
+  size_t thread  = shared->thread;
+  size_t threads = shared->threads;
+  size_t queries = shared->queries;
+  // info of query q for this thread is at info[q * threads]
+  q4112_run_info_hj_t* info = &shared->info[thread];
+  size_t q, o;
+
+  // build the join tables of all queries
+  for (q = 0; q != queries; ++q) {
+    build_table(&info[q * threads]);
+  }
+
+  // barrier wait for next stage: matching
+  if (q4112_barrier_wait(&info->query->barrier2)) {
+    arena_phase(info->arena, Q4112_PHASE_PROBE);
+  }
+
+  // set thread boundaries for outer table (same for all queries)
+  size_t outer_tuples = info->outer_tuples;
+  const uint32_t* outer_keys = info->outer_keys;
+  const uint32_t* outer_aggr_keys = info->outer_aggr_keys;
+  const uint32_t* outer_vals = info->outer_vals;
+  size_t outer_beg = (outer_tuples / threads) * (thread + 0);
+  size_t outer_end = (outer_tuples / threads) * (thread + 1);
+  // fix boundary for last thread
+  if (thread + 1 == threads) outer_end = outer_tuples;
+
+  // single pass over orders: each block is read from memory once and
+  // joined with every query while it is in cache
+  for (o = outer_beg; o < outer_end; o += SHARED_BLOCK) {
+    size_t block_tuples = outer_end - o;
+    if (block_tuples > SHARED_BLOCK) block_tuples = SHARED_BLOCK;
+    for (q = 0; q != queries; ++q) {
+      info[q * threads].new_groups += probe_tuples(
+          &info[q * threads], &outer_keys[o],
+          outer_aggr_keys != NULL ? &outer_aggr_keys[o] : NULL,
+          &outer_vals[o], block_tuples);
+    }
+  }
+
+  // barrier wait for next stage: summing up
+  if (q4112_barrier_wait(&info->query->barrier3)) {
+    arena_phase(info->arena, Q4112_PHASE_FINALIZE);
+  }
+
+  for (q = 0; q != queries; ++q) {
+    finalize_groups(&info[q * threads]);
+  }
+  pthread_exit(NULL);
+}
+
+void q4112_run_shared(
+    q4112_shared_query_t* queries,
+    size_t num_queries,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    int threads,
+    const q4112_options_t* options) {
+  // check number of threads
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+  if (num_queries == 0) return;
+
+  q4112_options_t defaults;
+  if (options == NULL) {
+    q4112_options_init(&defaults);
+    options = &defaults;
+  }
+  size_t q, t;
+
+  // the scratch memory of all queries shares the budget
+  q4112_usage_t* usage = options->usage;
+  usage_init(usage, options->memory_budget, options->table);
+  arena_t arena;
+  arena_init(&arena, options->memory_budget);
+
+  // the queries share orders.store_id, so the groups are estimated once
+  uint32_t min_key = 0, max_key = 0;
+  size_t aggr_buckets_estimate = 0;
+  int fits = 1;
+  if (outer_aggr_keys != NULL) {
+    aggr_buckets_estimate = estimate_columns(outer_aggr_keys, NULL,
+        outer_tuples, threads, Q4112_HASH_MULTIPLY, &arena, &min_key,
+        &max_key, NULL, NULL, NULL);
+    fits = aggr_buckets_estimate != SIZE_MAX;
+  }
+
+  // set up barrier for threads (shared by all queries)
+  q4112_query_t query;
+  q4112_barrier_init(&query.barrier2, threads);
+  q4112_barrier_init(&query.barrier3, threads);
+
+  // join and aggregation tables of every query (the queries before a query
+  // whose tables do not fit keep theirs until the clean up)
+  arena_phase(&arena, Q4112_PHASE_BUILD);
+  size_t info_bytes = num_queries * threads * sizeof(q4112_run_info_hj_t);
+  q4112_run_info_hj_t* info = NULL;
+  if (fits) {
+    info = (q4112_run_info_hj_t*) arena_malloc(&arena, info_bytes);
+    fits = info != NULL;
+  }
+  size_t created = 0;
+  for (q = 0; fits && q != num_queries; ++q) {
+    q4112_run_info_hj_t base;
+    memset(&base, 0, sizeof(base));
+    base.inner_keys = queries[q].inner_keys;
+    base.inner_vals = queries[q].inner_vals;
+    base.inner_tuples = queries[q].inner_tuples;
+    base.outer_keys = outer_join_keys;
+    base.outer_aggr_keys = outer_aggr_keys;
+    base.outer_vals = outer_vals;
+    base.outer_tuples = outer_tuples;
+    base.table_layout = options->table;
+    base.build = options->build;
+    set_predicates(&base, options);
+    base.finalize = 1;
+    base.arena = &arena;
+    if (outer_aggr_keys != NULL &&
+        !create_aggr_table(&base, threads,
+                           aggr_target(aggr_buckets_estimate, min_key,
+                                       max_key),
+                           aggr_buckets_estimate, min_key, max_key)) {
+      fits = 0;
+      break;
+    }
+    if (!create_join_table(&base, threads)) {
+      free_aggr_table(&base, threads);
+      fits = 0;
+      break;
+    }
+    created += 1;
+    for (t = 0; t != threads; ++t) {
+      info[q * threads + t] = base;
+      info[q * threads + t].query = &query;
+      info[q * threads + t].thread = t;
+      info[q * threads + t].threads = threads;
+      info[q * threads + t].all = &info[q * threads];
+    }
+  }
+
+  // run threads
+  size_t shared_bytes = threads * sizeof(q4112_shared_info_t);
+  q4112_shared_info_t* shared = NULL;
+  if (fits) {
+    shared = (q4112_shared_info_t*) arena_malloc(&arena, shared_bytes);
+    fits = shared != NULL;
+  }
+  for (t = 0; fits && t != threads; ++t) {
+    shared[t].thread = t;
+    shared[t].threads = threads;
+    shared[t].queries = num_queries;
+    shared[t].info = info;
+    pthread_create(&shared[t].id, NULL, q4112_shared_thread, &shared[t]);
+  }
+  for (t = 0; fits && t != threads; ++t) {
+    pthread_join(shared[t].id, NULL);
+  }
+
+  // gather results (0 for all queries if their tables do not fit into the
+  // budget) and clean up
+  for (q = 0; q != num_queries; ++q) {
+    uint64_t sum_avgs = 0, num_groups = 0;
+    for (t = 0; fits && t != threads; ++t) {
+      sum_avgs += info[q * threads + t].sum_avgs;
+      num_groups += info[q * threads + t].num_groups;
+    }
+    queries[q].result = num_groups ? sum_avgs / num_groups : 0;
+  }
+  for (q = 0; q != created; ++q) {
+    free_join_table(&info[q * threads], threads);
+    free_aggr_table(&info[q * threads], threads);
+  }
+  usage_peaks(usage, &arena);
+  if (usage != NULL) usage->over_budget = !fits;
+  arena_free(&arena, shared, shared_bytes);
+  arena_free(&arena, info, info_bytes);
+  arena_destroy(&arena);
+}
+
+uint64_t q4112_run_packed(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    const q4112_packed_t* outer_join_keys,
+    const q4112_packed_t* outer_aggr_keys,
+    const q4112_packed_t* outer_vals,
+    int threads) {
+  // all columns of orders must have the same tuples
+  assert(outer_aggr_keys == NULL ||
+         outer_aggr_keys->tuples == outer_join_keys->tuples);
+  assert(outer_vals->tuples == outer_join_keys->tuples);
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_keys = inner_keys;
+  base.inner_vals = inner_vals;
+  base.inner_tuples = inner_tuples;
+  base.packed_keys = outer_join_keys;
+  base.packed_aggr_keys = outer_aggr_keys;
+  base.packed_vals = outer_vals;
+  base.outer_tuples = outer_join_keys->tuples;
+  return q4112_run_columns(&base, threads);
+}
+
+
+// insert a group into an aggregation table that has a free bucket for it
+static void aggr_insert(bucket_aggr_t* table, size_t buckets, int8_t log_buckets,
+                        const bucket_aggr_t* group, size_t* groups) {
+  size_t h = (uint32_t) (group->key * 0x9e3779b1);
+  h >>= 32 - log_buckets;
+  while (table[h].key != 0 && table[h].key != group->key) {
+    h = (h + 1) & (buckets - 1);
+  }
+  if (table[h].key == 0) {
+    table[h].key = group->key;
+    *groups += 1;
+  }
+  table[h].sum += group->sum;
+  table[h].count += group->count;
+}
+
+// grow the state so that it can hold the given number of groups with a
+// fill rate of at most 1/2 (rehashing the groups it already has)
+static void aggr_reserve(q4112_aggr_state_t* state, size_t groups) {
+  if (state->buckets != 0 && groups <= state->buckets / 2) {
+    return;
+  }
+  size_t buckets = smallest_power_of_2_greater_equal_n(groups * 2);
+  if (buckets < 2) buckets = 2;
+  bucket_aggr_t* table = (bucket_aggr_t*) calloc(buckets, sizeof(bucket_aggr_t));
+  assert(table != NULL);
+  int8_t log_buckets = trailing_zero_count2(buckets);
+
+  size_t i, moved = 0;
+  for (i = 0; i != state->buckets; ++i) {
+    if (state->table[i].key != 0) {
+      aggr_insert(table, buckets, log_buckets, &state->table[i], &moved);
+    }
+  }
+  assert(moved == state->groups);
+  free(state->table);
+  state->table = table;
+  state->buckets = buckets;
+  state->log_buckets = log_buckets;
+}
+
+void q4112_aggr_init(q4112_aggr_state_t* state, size_t groups) {
+  memset(state, 0, sizeof(q4112_aggr_state_t));
+  aggr_reserve(state, groups);
+}
+
+void q4112_aggr_free(q4112_aggr_state_t* state) {
+  free(state->table);
+  memset(state, 0, sizeof(q4112_aggr_state_t));
+}
+
+// fold a batch of orders into the state: the state table is used directly as
+// the global aggregation table, so no per-batch table is merged afterwards
+int q4112_run_aggr(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    int threads,
+    q4112_aggr_state_t* state) {
+  // check number of threads
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+
+  // estimate the groups of the batch (worst case: all of them are new)
+  size_t groups_estimate = estimate(outer_aggr_keys, outer_tuples, threads);
+  aggr_reserve(state, state->groups + groups_estimate);
+
+  q4112_run_info_hj_t base;
+  memset(&base, 0, sizeof(base));
+  base.inner_keys = inner_keys;
+  base.inner_vals = inner_vals;
+  base.inner_tuples = inner_tuples;
+  base.outer_keys = outer_join_keys;
+  base.outer_aggr_keys = outer_aggr_keys;
+  base.outer_vals = outer_vals;
+  base.outer_tuples = outer_tuples;
+  base.aggr_table = state->table;
+  base.aggr_buckets = state->buckets;
+  base.log_aggr_buckets = state->log_buckets;
+
+  // (without a budget the tables only fail to fit if malloc fails)
+  uint64_t sum_avgs;
+  uint64_t num_groups;
+  // (the join table is allocated before any group is inserted, so on
+  // failure the groups of the state are unchanged)
+  size_t new_groups = q4112_run_threads(&base, threads, &sum_avgs,
+                                        &num_groups);
+  if (new_groups == SIZE_MAX) return -1;
+  state->groups += new_groups;
+  return 0;
+}
+
+void q4112_aggr_merge(q4112_aggr_state_t* dst, const q4112_aggr_state_t* src) {
+  aggr_reserve(dst, dst->groups + src->groups);
+  size_t i;
+  for (i = 0; i != src->buckets; ++i) {
+    if (src->table[i].key != 0) {
+      aggr_insert(dst->table, dst->buckets, dst->log_buckets,
+                  &src->table[i], &dst->groups);
+    }
+  }
+}
+
+void q4112_aggr_merge_groups(q4112_aggr_state_t* dst,
+                             const bucket_aggr_t* groups, size_t size) {
+  aggr_reserve(dst, dst->groups + size);
+  size_t i;
+  for (i = 0; i != size; ++i) {
+    aggr_insert(dst->table, dst->buckets, dst->log_buckets,
+                &groups[i], &dst->groups);
+  }
+}
 
-  return sum_avgs / num_groups;
-}
\ No newline at end of file
+uint64_t q4112_aggr_result(const q4112_aggr_state_t* state) {
+  uint64_t sum_avgs = 0, sums[AVERAGE_BATCH], counts[AVERAGE_BATCH];
+  size_t i, n = 0, num_groups = 0;
+  for (i = 0; i != state->buckets; ++i) {
+    if (state->table[i].key != 0) {
+      sums[n] = state->table[i].sum;
+      counts[n] = state->table[i].count;
+      if (++n == AVERAGE_BATCH) {
+        sum_avgs += sum_averages(sums, counts, n);
+        num_groups += n;
+        n = 0;
+      }
+    }
+  }
+  sum_avgs += sum_averages(sums, counts, n);
+  num_groups += n;
+  return num_groups == 0 ? 0 : sum_avgs / num_groups;
+}
@@ -42,6 +42,483 @@ uint64_t q4112_gen(
 
 // execute query
 uint64_t q4112_run(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
+    // most threads to use (must not exceed hardware threads; queries of at
+    // most 1024 items and 1024 orders run in the calling thread)
+    int threads);
+
+// join table layouts
+typedef enum {
+  // open addressing with linear probing, fill rate between 1/3 and 2/3
+  Q4112_TABLE_LINEAR = 0,
+  // cache-line groups of 7 buckets probed with one SIMD-within-a-register
+  // compare of their 8-bit tags, fill rate 90%
+  Q4112_TABLE_SWISS
+} q4112_table_t;
+
+// join table build modes
+typedef enum {
+  // every thread owns a contiguous range of the table and inserts the inner
+  // tuples scattered to it with plain stores (no atomics)
+  Q4112_BUILD_PARTITIONED = 0,
+  // every thread inserts its part of the inner table with compare-and-swap
+  Q4112_BUILD_ATOMIC
+} q4112_build_t;
+
+// hash functions of the hash tables (the join table, the aggregation tables
+// and the partitions of the distinct value estimate)
+typedef enum {
+  // multiplicative hashing (key * 0x9e3779b1, high bits): the fastest, but
+  // keys that differ only in their high bits (e.g. multiples of a power of
+  // 2) share buckets
+  Q4112_HASH_MULTIPLY = 0,
+  // CRC32C of the key (one instruction with SSE 4.2, table lookups without
+  // it; linear, so some key sets still collide)
+  Q4112_HASH_CRC32C,
+  // finalizer of MurmurHash3 (two multiplications and three xor-shifts)
+  Q4112_HASH_MURMUR,
+  // simple tabulation hashing (4 lookups in tables of random words,
+  // 3-independent)
+  Q4112_HASH_TABULATION
+} q4112_hash_t;
+
+// columns a predicate can restrict
+typedef enum {
+  // orders.quantity (outer_vals)
+  Q4112_COLUMN_QUANTITY,
+  // orders.store_id (outer_aggr_keys, only for the query with GROUP BY)
+  Q4112_COLUMN_STORE_ID,
+  // items.price (inner_vals): removes items from the join table
+  Q4112_COLUMN_PRICE
+} q4112_pred_column_t;
+
+// comparisons of a predicate (unsigned, column on the left)
+typedef enum {
+  Q4112_CMP_EQ,
+  Q4112_CMP_NE,
+  Q4112_CMP_LT,
+  Q4112_CMP_LE,
+  Q4112_CMP_GT,
+  Q4112_CMP_GE,
+  // value in the list of values
+  Q4112_CMP_IN
+} q4112_cmp_t;
+
+// predicate on a column (predicates are combined with AND)
+typedef struct {
+  q4112_pred_column_t column;
+  q4112_cmp_t cmp;
+  // constant of the comparison
+  uint32_t value;
+  // list of Q4112_CMP_IN (compared one by one, meant for short lists)
+  const uint32_t* values;
+  size_t num_values;
+} q4112_predicate_t;
+
+// build side of the join
+typedef enum {
+  // chosen from the sizes of items and orders and the estimated distinct
+  // values of orders.item_id
+  Q4112_SIDE_AUTO = 0,
+  // join table on all items
+  Q4112_SIDE_ITEMS,
+  // join table on the items that orders reference: the distinct values of
+  // orders.item_id are collected first and items are reduced to them (not
+  // for bit-packed orders)
+  Q4112_SIDE_ORDERS
+} q4112_side_t;
+
+// what the engine chose for a query
+typedef struct {
+  // Q4112_SIDE_ITEMS or Q4112_SIDE_ORDERS
+  q4112_side_t side;
+  // estimated distinct values of orders.item_id (0 if not estimated)
+  size_t outer_distinct_keys;
+  // items in the join table
+  size_t build_tuples;
+  // heavy hitters found by the estimation pass (groups of orders.store_id
+  // aggregated privately by every thread, and values of orders.item_id)
+  size_t hot_groups;
+  size_t hot_join_keys;
+  // threads of each phase
+  int estimate_threads;
+  int build_threads;
+  int probe_threads;
+  // machine calibration: start and join of a thread, and one tuple of a
+  // join with a cache-resident table (0 if not calibrated)
+  double thread_ns;
+  double tuple_ns;
+} q4112_plan_t;
+
+// memory of the machine, measured once per process on a buffer several
+// times larger than the last-level cache (all 0 if the buffer could not be
+// allocated)
+typedef struct {
+  // sustained sequential read bandwidth of one thread and of all threads
+  double read_bytes_per_ns;
+  double read_bytes_per_ns_all;
+  // independent reads of random cache lines per ns, by one thread and by
+  // all threads
+  double random_reads_per_ns;
+  double random_reads_per_ns_all;
+  // latency of a read of a random cache line that depends on the last one
+  double latency_ns;
+  // last-level cache (tables that fit are not counted as memory accesses)
+  size_t cache_bytes;
+  // hardware threads of the measurements with all threads
+  int threads;
+} q4112_memory_t;
+
+// measure the memory of the machine (only the first call measures, it takes
+// about a second; the others return the same numbers)
+void q4112_memory_calibrate(
+    q4112_memory_t* memory);
+
+// phases of a query in the roofline report
+typedef enum {
+  // distinct values and heavy hitters of orders.item_id and orders.store_id
+  Q4112_PHASE_ESTIMATE,
+  // items reduced to those that orders reference (build on orders)
+  Q4112_PHASE_REDUCE,
+  // join table build (including its allocation and the thread start-ups)
+  Q4112_PHASE_BUILD,
+  // join and aggregation of orders
+  Q4112_PHASE_PROBE,
+  // summing up of the groups
+  Q4112_PHASE_FINALIZE,
+  Q4112_PHASES
+} q4112_phase_t;
+
+// time and memory traffic of a phase (all 0 if the query skipped it)
+typedef struct {
+  uint64_t ns;
+  int threads;
+  // bytes read in order from the input columns and intermediate buffers
+  size_t scanned_bytes;
+  // estimated accesses to random buckets of tables, and those of them to
+  // tables larger than the last-level cache
+  size_t random_accesses;
+  size_t memory_accesses;
+  // largest table accessed at random
+  size_t table_bytes;
+  // time of the phase at the memory roofline of its threads: the scanned
+  // bytes at the read bandwidth or the memory accesses at the random read
+  // rate, whichever takes longer (0 if the memory is not calibrated)
+  double roofline_ns;
+  // roofline_ns / ns: near 1 the phase is memory bound, far below 1 it is
+  // bound by computation, synchronization or latency
+  double roofline_fraction;
+} q4112_phase_report_t;
+
+// roofline report of a query
+typedef struct {
+  q4112_memory_t memory;
+  q4112_phase_report_t phases[Q4112_PHASES];
+} q4112_roofline_t;
+
+// scratch memory of a query (its tables and buffers, not its columns) and
+// the lower-memory strategies its budget made the engine take
+typedef struct {
+  // budget of the query (0 for none)
+  size_t budget_bytes;
+  // most bytes allocated at a time during the query and during each phase
+  // (0 for the phases it skipped)
+  size_t peak_bytes;
+  size_t phase_peak_bytes[Q4112_PHASES];
+  // private direct-mapped arrays per thread replaced by one shared array
+  int shared_dense;
+  // partitioned build replaced by the atomic build (no scatter buffer)
+  int atomic_build;
+  // join table layout and its fill rate
+  q4112_table_t table;
+  double join_fill;
+  // passes over orders, each one aggregating the groups of a partition of
+  // the hashes of orders.store_id in a table sized for that partition
+  // (1 if the groups fit into one table)
+  size_t aggr_passes;
+  // even the smallest strategies did not fit: the query did not run and
+  // returned 0 (NULL for q4112_join_build)
+  int over_budget;
+} q4112_usage_t;
+
+// execution options (initialize with q4112_options_init)
+typedef struct {
+  // join table layout
+  q4112_table_t table;
+  // join table build mode
+  q4112_build_t build;
+  // hash function of the join and aggregation tables
+  q4112_hash_t hash;
+  // predicates evaluated while scanning the columns, before the join table
+  // is touched (not supported by the 64-bit columns of q4112_run_wide)
+  const q4112_predicate_t* predicates;
+  size_t num_predicates;
+  // build side of the join
+  q4112_side_t side;
+  // run every phase with exactly the threads passed (otherwise the threads
+  // passed are the upper bound and each phase gets as many as its input is
+  // worth on this machine)
+  int fixed_threads;
+  // filled with what the engine chose (NULL for no report)
+  q4112_plan_t* plan;
+  // filled by q4112_run_options and q4112_run_join with the time and memory
+  // traffic of every phase (NULL for no report; the first report calibrates
+  // the memory, see q4112_memory_calibrate)
+  q4112_roofline_t* roofline;
+  // bytes of scratch memory q4112_run_options, q4112_run_join,
+  // q4112_join_build and q4112_run_shared may allocate (0 for no limit):
+  // the first two replace tables that do not fit by smaller ones (see
+  // q4112_usage_t), the others fail if their tables do not fit;
+  // q4112_run_groups and q4112_run_async ignore the budget (their group
+  // tables grow while orders are probed), and so do the small queries that
+  // q4112_run_options runs in the calling thread with their tables on the
+  // stack (they report a peak of 0)
+  size_t memory_budget;
+  // filled by the same four functions with the memory of the query (NULL
+  // for no report)
+  q4112_usage_t* usage;
+} q4112_options_t;
+
+// set the default options (used by q4112_run)
+void q4112_options_init(
+    q4112_options_t* options);
+
+// execute query with the given options (NULL for the defaults)
+uint64_t q4112_run_options(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
+    // most threads to use (must not exceed hardware threads; all of them in
+    // every phase with options.fixed_threads)
+    int threads,
+    // execution options
+    const q4112_options_t* options);
+
+// join table built from items once and probed by any number of queries;
+// it can be saved to a file in its in-memory layout and attached again
+// with mmap without building it
+typedef struct q4112_join_table q4112_join_table_t;
+
+// build the join table of items (the table layout, build mode, hash
+// function and memory budget of the options are used, predicates on
+// items.price are not supported; returns NULL if the table does not fit
+// into the budget)
+q4112_join_table_t* q4112_join_build(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // number of threads to use (must not exceed hardware threads)
+    int threads,
+    // execution options (NULL for the defaults)
+    const q4112_options_t* options);
+
+// write the join table to a file: a header with the table metadata and a
+// checksum of the items columns, then the table at a page-aligned offset
+// (returns 0, or -1 with errno set if the file cannot be written)
+int q4112_join_save(
+    const q4112_join_table_t* join,
+    const char* path);
+
+// attach a saved join table with a read-only private mapping of the file
+// (returns NULL if the file cannot be mapped, is not a valid join table, or
+// was built from other items columns than the given ones)
+q4112_join_table_t* q4112_join_load(
+    const char* path,
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples);
+
+// execute query with a built or attached join table (the table layout,
+// build mode and hash function of the options are ignored, the hash
+// function of the join table is used; predicates on items.price are not
+// supported)
+uint64_t q4112_run_join(
+    const q4112_join_table_t* join,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
+    // most threads to use for probing (must not exceed hardware threads;
+    // all of them with options.fixed_threads)
+    int threads,
+    // execution options (NULL for the defaults)
+    const q4112_options_t* options);
+
+// free a built join table or unmap an attached one
+void q4112_join_free(
+    q4112_join_table_t* join);
+
+// readiness of the chunks of a table whose columns are filled while a query
+// runs: the loader fills the chunks (chunk_tuples tuples, the last one may
+// be shorter) in any order and marks each one when all columns hold it
+typedef struct q4112_ready q4112_ready_t;
+
+q4112_ready_t* q4112_ready_create(
+    // tuples of the table
+    size_t tuples,
+    // tuples per chunk (at least 1)
+    size_t chunk_tuples);
+
+// mark a chunk ready (the columns of the chunk must not change afterwards)
+void q4112_ready_mark(
+    q4112_ready_t* ready,
+    size_t chunk);
+
+// free after the queries that read the table are done
+void q4112_ready_free(
+    q4112_ready_t* ready);
+
+// query running in the background
+typedef struct q4112_async q4112_async_t;
+
+// start the query and return at once: the threads insert the chunks of
+// items into the join table as they become ready (with compare-and-swap),
+// then join and aggregate the chunks of orders as they become ready, into
+// private group tables that grow with the groups (no estimation pass); the
+// columns and options must stay valid until the query is done (the table
+// layout, hash function and predicates of the options are used; returns
+// NULL if the query thread could not be started)
+q4112_async_t* q4112_run_async(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // chunks of items (NULL if the columns are already filled)
+    q4112_ready_t* inner_ready,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
+    // chunks of orders (NULL if the columns are already filled)
+    q4112_ready_t* outer_ready,
+    // number of threads to use (must not exceed hardware threads)
+    int threads,
+    // execution options (NULL for the defaults)
+    const q4112_options_t* options);
+
+// has the query finished (q4112_async_wait returns at once)
+int q4112_async_done(
+    const q4112_async_t* query);
+
+// wait for the query, free it and return its result
+uint64_t q4112_async_wait(
+    q4112_async_t* query);
+
+// query of a shared scan: it has its own items table (e.g. a snapshot of
+// items.price) and is answered together with other queries over the same
+// orders columns
+typedef struct {
+  // column items.id
+  const uint32_t* inner_keys;
+  // column items.price
+  const uint32_t* inner_vals;
+  // tuples for table items
+  size_t inner_tuples;
+  // query result (set by q4112_run_shared, 0 if nothing joins or if the
+  // tables of the queries do not fit into the memory budget)
+  uint64_t result;
+} q4112_shared_query_t;
+
+// execute several queries with a single pass over the orders columns
+void q4112_run_shared(
+    // queries with their items tables
+    q4112_shared_query_t* queries,
+    // number of queries
+    size_t num_queries,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
+    // number of threads to use (must not exceed hardware threads)
+    int threads,
+    // execution options (NULL for the defaults)
+    const q4112_options_t* options);
+
+// aggregate functions of q4112_run_groups
+typedef enum {
+  Q4112_AGG_SUM,
+  Q4112_AGG_COUNT,
+  Q4112_AGG_MIN,
+  Q4112_AGG_MAX,
+  // rounded down like the averages of q4112_run
+  Q4112_AGG_AVG
+} q4112_agg_func_t;
+
+// arguments of the aggregate functions (unused by COUNT)
+typedef enum {
+  // items.price * orders.quantity
+  Q4112_ARG_REVENUE,
+  // orders.quantity
+  Q4112_ARG_QUANTITY,
+  // items.price
+  Q4112_ARG_PRICE
+} q4112_agg_arg_t;
+
+typedef struct {
+  q4112_agg_func_t func;
+  q4112_agg_arg_t arg;
+} q4112_agg_t;
+
+// result of q4112_run_groups: one row per group (in no particular order)
+// as columns that all point into one buffer, which the threads of the query
+// write directly
+typedef struct {
+  size_t groups;
+  // orders.store_id of each group
+  uint32_t* keys;
+  // columns[a][g] is aggregate a of group g
+  uint64_t** columns;
+  // the buffer holding the columns (free with q4112_groups_free)
+  void* buffer;
+} q4112_groups_t;
+
+// execute the join grouped by orders.store_id and compute a list of
+// aggregates of every group in one pass over orders
+void q4112_run_groups(
     // column items.id
     const uint32_t* inner_keys,
     // column items.price
@@ -56,12 +533,214 @@ uint64_t q4112_run(
     const uint32_t* outer_vals,
     // tuples for table orders
     size_t outer_tuples,
+    // aggregates to compute (at least one)
+    const q4112_agg_t* aggs,
+    size_t num_aggs,
+    // result columns
+    q4112_groups_t* result,
+    // number of threads to use (must not exceed hardware threads)
+    int threads,
+    // execution options (NULL for the defaults)
+    const q4112_options_t* options);
+
+void q4112_groups_free(
+    q4112_groups_t* result);
+
+// unsigned 128-bit integer (sums of 64-bit products)
+typedef unsigned __int128 q4112_u128_t;
+
+// column of unsigned integers with 32 or 64 bits
+typedef struct {
+  // uint32_t or uint64_t array
+  const void* data;
+  // 32 or 64
+  int bits;
+} q4112_column_t;
+
+// execute query on columns with 32-bit or 64-bit keys and values: products
+// are summed in 128 bits and counted in 64 bits per group (if all columns
+// are 32-bit, the query runs on the 32-bit engine of q4112_run_options)
+q4112_u128_t q4112_run_wide(
+    // column items.id (key never 0)
+    const q4112_column_t* inner_keys,
+    // column items.price
+    const q4112_column_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // column orders.item_id (key never 0)
+    const q4112_column_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const q4112_column_t* outer_aggr_keys,
+    // column orders.quantity
+    const q4112_column_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
     // number of threads to use (must not exceed hardware threads)
+    int threads,
+    // execution options (NULL for the defaults)
+    const q4112_options_t* options);
+
+// per-group aggregation state of orders.store_id (mergeable across
+// batches of orders and across processes)
+typedef struct {
+  uint32_t key;
+  uint64_t sum;
+  uint64_t count;  // (64 bits, a group can have more than 2^32 orders)
+} bucket_aggr_t;
+
+typedef struct {
+  // open addressing table of groups (key 0 means empty bucket)
+  bucket_aggr_t* table;
+  size_t buckets;
+  int8_t log_buckets;
+  // occupied buckets
+  size_t groups;
+} q4112_aggr_state_t;
+
+// initialize an empty aggregation state
+void q4112_aggr_init(
+    q4112_aggr_state_t* state,
+    // expected distinct values for orders.store_id (0 if unknown)
+    size_t groups);
+
+// release the memory of an aggregation state
+void q4112_aggr_free(
+    q4112_aggr_state_t* state);
+
+// execute query on a batch of orders and fold it into the state (returns
+// 0, or -1 if the tables of the batch could not be allocated, leaving the
+// groups of the state unchanged)
+int q4112_run_aggr(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for this batch of table orders
+    size_t outer_tuples,
+    // number of threads to use (must not exceed hardware threads)
+    int threads,
+    // state to fold the batch into
+    q4112_aggr_state_t* state);
+
+// merge the groups of src into dst
+void q4112_aggr_merge(
+    q4112_aggr_state_t* dst,
+    const q4112_aggr_state_t* src);
+
+// merge a compact array of groups (e.g. received from another process)
+void q4112_aggr_merge_groups(
+    q4112_aggr_state_t* dst,
+    const bucket_aggr_t* groups,
+    size_t size);
+
+// compute query result (average of per-group averages) from a state
+uint64_t q4112_aggr_result(
+    const q4112_aggr_state_t* state);
+
+// values per block and 32-bit lanes per row of a bit-packed column
+#define Q4112_PACK_BLOCK 256
+#define Q4112_PACK_LANES 8
+
+// bit-packed column with frame-of-reference or dictionary encoding
+// (see q4112_pack.c for the layout)
+typedef struct {
+  uint32_t* words;
+  size_t tuples;
+  // smallest value of the column (0 for dictionary encoding)
+  uint32_t base;
+  // bits per value or code (0 to 32)
+  int8_t bits;
+  // distinct values indexed by code (NULL for frame-of-reference)
+  uint32_t* dict;
+  size_t dict_size;
+} q4112_packed_t;
+
+// pack a column using the fewest bits for (value - smallest value)
+void q4112_pack(
+    q4112_packed_t* col,
+    const uint32_t* vals,
+    size_t tuples);
+
+// pack a column as codes of a dictionary of its distinct values
+// (returns 0 and packs nothing if there are more than max_dict_size)
+int q4112_pack_dict(
+    q4112_packed_t* col,
+    const uint32_t* vals,
+    size_t tuples,
+    size_t max_dict_size);
+
+// decode block of Q4112_PACK_BLOCK values (last block is padded with base)
+void q4112_unpack_block(
+    const q4112_packed_t* col,
+    size_t block,
+    uint32_t* out);
+
+// decode block without the dictionary lookup (codes of dictionary columns)
+void q4112_unpack_codes(
+    const q4112_packed_t* col,
+    size_t block,
+    uint32_t* out);
+
+// bytes used by the packed values
+size_t q4112_packed_bytes(
+    const q4112_packed_t* col);
+
+void q4112_packed_free(
+    q4112_packed_t* col);
+
+// execute query on bit-packed orders columns, decoding them block by block
+// (a dictionary encoded orders.store_id is grouped on its codes)
+uint64_t q4112_run_packed(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // column orders.item_id
+    const q4112_packed_t* outer_join_keys,
+    // column orders.store_id (NULL for the query without GROUP BY)
+    const q4112_packed_t* outer_aggr_keys,
+    // column orders.quantity
+    const q4112_packed_t* outer_vals,
+    // most threads to use (must not exceed hardware threads)
+    int threads);
+
+// execute query with worker processes on this host, each owning a hash
+// partition (on items.id / orders.item_id) of both tables
+// (returns 0 if a worker could not be started or failed)
+uint64_t q4112_run_dist(
+    // column items.id
+    const uint32_t* inner_keys,
+    // column items.price
+    const uint32_t* inner_vals,
+    // tuples for table item
+    size_t inner_tuples,
+    // column orders.item_id
+    const uint32_t* outer_join_keys,
+    // column orders.store_id
+    const uint32_t* outer_aggr_keys,
+    // column orders.quantity
+    const uint32_t* outer_vals,
+    // tuples for table orders
+    size_t outer_tuples,
+    // number of worker processes
+    int workers,
+    // number of threads to use per worker process
     int threads);
 
 size_t estimate(
-    const uint32_t* keys, 
-    size_t size);
+    const uint32_t* keys,
+    size_t size,
+    int threads);
 
 uint32_t trailing_zero_count(
     uint32_t bitmap);
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "q4112.h"
+
+// compare the time from the start of loading to the result of a query that
+// waits for all columns (q4112_run after the load) with one that runs while
+// they load (q4112_run_async with chunk readiness); the load copies chunks
+// of generated columns at a given rate, items first, then orders
+// usage: q4112_async_bench [inner_tuples] [outer_tuples] [groups] [threads]
+//                          [load_ns_per_tuple] [chunk_tuples]
+// (prints one CSV line per mode, groups 0 runs the query without GROUP BY)
+
+uint64_t real_time(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+// columns of a table and their copies that the loader fills
+typedef struct {
+  const uint32_t* src[3];
+  uint32_t* dst[3];
+  size_t tuples;
+  q4112_ready_t* ready;  // NULL if nobody waits for the chunks
+} table_load_t;
+
+typedef struct {
+  table_load_t tables[2];
+  size_t chunk_tuples;
+  double ns_per_tuple;
+} load_t;
+
+// copy the chunks, each one no sooner than the load rate allows
+static void* load_thread(void* arg) {
+  load_t* load = (load_t*) arg;
+  uint64_t start_ns = real_time();
+  size_t loaded = 0, beg, c;
+  int t;
+  for (t = 0; t != 2; ++t) {
+    table_load_t* table = &load->tables[t];
+    for (beg = 0; beg < table->tuples; beg += load->chunk_tuples) {
+      size_t tuples = table->tuples - beg < load->chunk_tuples ?
+          table->tuples - beg : load->chunk_tuples;
+      for (c = 0; c != 3; ++c) {
+        if (table->src[c] == NULL) continue;
+        memcpy(&table->dst[c][beg], &table->src[c][beg], tuples * 4);
+      }
+      loaded += tuples;
+      uint64_t due_ns = start_ns + loaded * load->ns_per_tuple;
+      uint64_t now_ns = real_time();
+      if (now_ns < due_ns) {
+        uint64_t wait_ns = due_ns - now_ns;
+        struct timespec wait = {wait_ns / 1000000000, wait_ns % 1000000000};
+        nanosleep(&wait, NULL);
+      }
+      if (table->ready != NULL) {
+        q4112_ready_mark(table->ready, beg / load->chunk_tuples);
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t inner_tuples = argc > 1 ? atoll(argv[1]) : 1000000;
+  size_t outer_tuples = argc > 2 ? atoll(argv[2]) : 100000000;
+  size_t groups       = argc > 3 ? atoll(argv[3]) : 100;
+  int threads         = argc > 4 ? atoi(argv[4]) : max_threads;
+  double ns_per_tuple = argc > 5 ? atof(argv[5]) : 2.0;
+  size_t chunk_tuples = argc > 6 ? atoll(argv[6]) : 65536;
+  assert(inner_tuples > 0 && inner_tuples <= outer_tuples);
+  assert(groups <= outer_tuples);
+  assert(threads > 0 && threads <= max_threads);
+  assert(ns_per_tuple >= 0 && chunk_tuples > 0);
+  int m, c;
+
+  uint32_t* cols[2][5];
+  size_t col_tuples[5] = {inner_tuples, inner_tuples, outer_tuples,
+                          outer_tuples, outer_tuples};
+  for (m = 0; m != 2; ++m) {
+    for (c = 0; c != 5; ++c) {
+      cols[m][c] = NULL;
+      if (c == 3 && groups == 0) continue;
+      cols[m][c] = (uint32_t*) malloc(col_tuples[c] * 4);
+      assert(cols[m][c] != NULL);
+    }
+  }
+  // items.id, items.price, orders.item_id, orders.store_id, orders.quantity
+  uint32_t** gen = cols[0];
+  uint32_t** loaded = cols[1];
+  uint64_t gen_res = q4112_gen(gen[0], gen[1], inner_tuples, 1.0, 99999,
+      gen[2], gen[3], gen[4], outer_tuples, 1.0, 99999, groups, 0, 0.0);
+
+  printf("%s,%s,%s,%s,%s,%s,%s,%s\n", "inner_tuples", "outer_tuples",
+         "groups", "threads", "load_ns_per_tuple", "chunk_tuples", "mode",
+         "nanoseconds");
+
+  const char* names[] = {"blocking", "async"};
+  for (m = 0; m != 2; ++m) {
+    load_t load;
+    memset(&load, 0, sizeof(load));
+    load.chunk_tuples = chunk_tuples;
+    load.ns_per_tuple = ns_per_tuple;
+    table_load_t* items = &load.tables[0];
+    table_load_t* orders = &load.tables[1];
+    items->src[0] = gen[0];
+    items->src[1] = gen[1];
+    items->dst[0] = loaded[0];
+    items->dst[1] = loaded[1];
+    items->tuples = inner_tuples;
+    orders->src[0] = gen[2];
+    orders->src[1] = gen[3];
+    orders->src[2] = gen[4];
+    orders->dst[0] = loaded[2];
+    orders->dst[1] = loaded[3];
+    orders->dst[2] = loaded[4];
+    orders->tuples = outer_tuples;
+    if (m == 1) {
+      items->ready = q4112_ready_create(inner_tuples, chunk_tuples);
+      orders->ready = q4112_ready_create(outer_tuples, chunk_tuples);
+    }
+
+    uint64_t run_ns = real_time();
+    pthread_t loader;
+    pthread_create(&loader, NULL, load_thread, &load);
+    uint64_t run_res;
+    if (m == 0) {
+      pthread_join(loader, NULL);
+      run_res = q4112_run(loaded[0], loaded[1], inner_tuples, loaded[2],
+                          loaded[3], loaded[4], outer_tuples, threads);
+    } else {
+      q4112_async_t* query = q4112_run_async(loaded[0], loaded[1],
+          inner_tuples, items->ready, loaded[2], loaded[3], loaded[4],
+          outer_tuples, orders->ready, threads, NULL);
+      assert(query != NULL);
+      run_res = q4112_async_wait(query);
+      pthread_join(loader, NULL);
+      q4112_ready_free(items->ready);
+      q4112_ready_free(orders->ready);
+    }
+    run_ns = real_time() - run_ns;
+    assert(run_res == gen_res);
+    printf("%zu,%zu,%zu,%d,%.2f,%zu,%s,%llu\n", inner_tuples, outer_tuples,
+           groups, threads, ns_per_tuple, chunk_tuples, names[m],
+           (unsigned long long) run_ns);
+  }
+
+  for (m = 0; m != 2; ++m) {
+    for (c = 0; c != 5; ++c) {
+      free(cols[m][c]);
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#ifndef _Q4112_BARRIER_
+#define _Q4112_BARRIER_
+
+#include <sched.h>
+
+// Sense-reversing spinning barrier for the threads of one query. Unlike
+// pthread barriers it needs no system call when all threads are running,
+// and it lives in the per-query state so that queries can run concurrently.
+// Waiting threads yield the processor after spinning for a while, since
+// concurrent queries may run more threads than there are hardware threads.
+
+// spins before a waiting thread yields the processor
+#define Q4112_BARRIER_SPINS 1024
+
+typedef struct {
+  int threads;
+  int count;  // threads still to arrive in this round
+  int sense;  // flipped by the last thread of every round
+} q4112_barrier_t;
+
+static inline void q4112_barrier_init(q4112_barrier_t* barrier, int threads) {
+  barrier->threads = threads;
+  barrier->count = threads;
+  barrier->sense = 0;
+}
+
+// wait for all threads (returns 1 in exactly one thread, the last to arrive,
+// like PTHREAD_BARRIER_SERIAL_THREAD, and 0 in the others)
+static inline int q4112_barrier_wait(q4112_barrier_t* barrier) {
+  int sense = !__atomic_load_n(&barrier->sense, __ATOMIC_RELAXED);
+  if (__atomic_sub_fetch(&barrier->count, 1, __ATOMIC_ACQ_REL) == 0) {
+    // reset for the next round before the others are released
+    __atomic_store_n(&barrier->count, barrier->threads, __ATOMIC_RELAXED);
+    __atomic_store_n(&barrier->sense, sense, __ATOMIC_RELEASE);
+    return 1;
+  }
+  int spins = 0;
+  while (__atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE) != sense) {
+    if (++spins == Q4112_BARRIER_SPINS) {
+      sched_yield();
+      spins = 0;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  return 0;
+}
+
+#endif
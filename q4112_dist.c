@@ -0,0 +1,318 @@
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "q4112.h"
+
+// Partitioned execution with local worker processes. The coordinator hash
+// partitions items and orders on the join key and streams every partition
+// over a Unix domain socket to the worker that owns it. Each worker joins
+// its partitions with q4112_run_aggr() and sends back its per-group
+// aggregation state, which the coordinator merges into the final result.
+// Since orders are partitioned on orders.item_id, the same orders.store_id
+// can appear in many workers, so only the (mergeable) group states are
+// combined and never the per-worker averages.
+
+
+// tuples buffered per worker before they are sent
+#define CHUNK_TUPLES 16384
+
+// per-worker send buffer
+typedef struct {
+  int fd;
+  pid_t pid;
+  size_t tuples;
+  uint32_t* cols[3];
+} q4112_dist_worker_t;
+
+
+// send or receive the whole buffer (returns 0, or -1 if the socket failed
+// or the process at the other end is gone)
+static int write_all(int fd, const void* buf, size_t size) {
+  const char* p = (const char*) buf;
+  while (size != 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void* buf, size_t size) {
+  char* p = (char*) buf;
+  while (size != 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// the worker that owns a join key
+// (the workers hash tables use the high bits of key * 0x9e3779b1, so
+// partitioning on the same bits would cluster each partition into one
+// range of buckets; use an independent finalizer-style hash instead)
+static inline size_t partition_of(uint32_t key, int workers) {
+  uint32_t h = key;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return ((uint64_t) h * workers) >> 32;
+}
+
+// send buffered tuples of a worker as one chunk: tuples, then each column
+static int flush(q4112_dist_worker_t* w, int columns) {
+  if (w->tuples == 0) return 0;
+  uint64_t tuples = w->tuples;
+  int c;
+  if (write_all(w->fd, &tuples, sizeof(tuples)) != 0) return -1;
+  for (c = 0; c != columns; ++c) {
+    if (write_all(w->fd, w->cols[c], tuples * sizeof(uint32_t)) != 0) {
+      return -1;
+    }
+  }
+  w->tuples = 0;
+  return 0;
+}
+
+// partition a table on its first column and stream it to the workers
+// (returns 0, or -1 if a worker is gone)
+static int scatter(q4112_dist_worker_t* w, int workers,
+                    const uint32_t** cols, int columns, size_t tuples) {
+  size_t i, p;
+  int c;
+  for (i = 0; i != tuples; ++i) {
+    p = partition_of(cols[0][i], workers);
+    for (c = 0; c != columns; ++c) {
+      w[p].cols[c][w[p].tuples] = cols[c][i];
+    }
+    if (++w[p].tuples == CHUNK_TUPLES && flush(&w[p], columns) != 0) {
+      return -1;
+    }
+  }
+  // flush remaining tuples and mark end of table with an empty chunk
+  uint64_t end = 0;
+  for (p = 0; p != workers; ++p) {
+    if (flush(&w[p], columns) != 0 ||
+        write_all(w[p].fd, &end, sizeof(end)) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// receive a table streamed by scatter() into growing columns
+// (returns SIZE_MAX if the coordinator is gone)
+static size_t gather(int fd, uint32_t** cols, int columns) {
+  size_t tuples = 0, capacity = CHUNK_TUPLES;
+  int c;
+  for (c = 0; c != columns; ++c) {
+    cols[c] = (uint32_t*) malloc(capacity * sizeof(uint32_t));
+    assert(cols[c] != NULL);
+  }
+  for (;;) {
+    uint64_t chunk;
+    if (read_all(fd, &chunk, sizeof(chunk)) != 0) return SIZE_MAX;
+    if (chunk == 0) break;
+    while (tuples + chunk > capacity) {
+      capacity += capacity;
+      for (c = 0; c != columns; ++c) {
+        cols[c] = (uint32_t*) realloc(cols[c], capacity * sizeof(uint32_t));
+        assert(cols[c] != NULL);
+      }
+    }
+    for (c = 0; c != columns; ++c) {
+      if (read_all(fd, &cols[c][tuples], chunk * sizeof(uint32_t)) != 0) {
+        return SIZE_MAX;
+      }
+    }
+    tuples += chunk;
+  }
+  return tuples;
+}
+
+// worker process: receive partitions, run the join and send back groups
+// (returns 0, or -1 if the exchange or the join failed; the process exits
+// right after, so the columns are not freed on failure)
+static int worker_main(int fd, int threads) {
+  uint32_t* inner[2];
+  uint32_t* outer[3];
+  size_t inner_tuples = gather(fd, inner, 2);
+  if (inner_tuples == SIZE_MAX) return -1;
+  size_t outer_tuples = gather(fd, outer, 3);
+  if (outer_tuples == SIZE_MAX) return -1;
+
+  q4112_aggr_state_t state;
+  q4112_aggr_init(&state, 0);
+  if (q4112_run_aggr(inner[0], inner[1], inner_tuples,
+                     outer[0], outer[1], outer[2], outer_tuples,
+                     threads, &state) != 0) {
+    return -1;
+  }
+
+  // send occupied groups only
+  bucket_aggr_t* groups = (bucket_aggr_t*)
+      malloc((state.groups + 1) * sizeof(bucket_aggr_t));
+  assert(groups != NULL);
+  size_t i, g = 0;
+  for (i = 0; i != state.buckets; ++i) {
+    if (state.table[i].key != 0) {
+      groups[g++] = state.table[i];
+    }
+  }
+  assert(g == state.groups);
+  uint64_t size = g;
+  int res = write_all(fd, &size, sizeof(size));
+  if (res == 0) {
+    res = write_all(fd, groups, g * sizeof(bucket_aggr_t));
+  }
+
+  free(groups);
+  q4112_aggr_free(&state);
+  free(inner[0]);
+  free(inner[1]);
+  free(outer[0]);
+  free(outer[1]);
+  free(outer[2]);
+  return res;
+}
+
+// reap a worker, returns 0 if it failed
+static int wait_worker(pid_t pid) {
+  int status;
+  pid_t res;
+  do {
+    res = waitpid(pid, &status, 0);
+  } while (res < 0 && errno == EINTR);
+  return res == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+// kill and reap the workers after a failed start or exchange
+static void stop_workers(q4112_dist_worker_t* info, int workers) {
+  int w, c;
+  for (w = 0; w != workers; ++w) {
+    kill(info[w].pid, SIGKILL);
+    wait_worker(info[w].pid);
+    close(info[w].fd);
+    for (c = 0; c != 3; ++c) {
+      free(info[w].cols[c]);
+    }
+  }
+  free(info);
+}
+
+uint64_t q4112_run_dist(
+    const uint32_t* inner_keys,
+    const uint32_t* inner_vals,
+    size_t inner_tuples,
+    const uint32_t* outer_join_keys,
+    const uint32_t* outer_aggr_keys,
+    const uint32_t* outer_vals,
+    size_t outer_tuples,
+    int workers,
+    int threads) {
+  assert(workers > 0 && threads > 0);
+  int w, c;
+
+  q4112_dist_worker_t* info = (q4112_dist_worker_t*)
+      malloc(workers * sizeof(q4112_dist_worker_t));
+  assert(info != NULL);
+
+  // start workers (flush pending output so children do not repeat it)
+  fflush(NULL);
+  for (w = 0; w != workers; ++w) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      stop_workers(info, w);
+      return 0;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      stop_workers(info, w);
+      return 0;
+    }
+    if (pid == 0) {
+      // close sockets of workers started before this one
+      for (c = 0; c != w; ++c) {
+        close(info[c].fd);
+      }
+      close(fds[0]);
+      int res = worker_main(fds[1], threads);
+      close(fds[1]);
+      _exit(res == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    info[w].fd = fds[0];
+    info[w].pid = pid;
+    info[w].tuples = 0;
+    for (c = 0; c != 3; ++c) {
+      info[w].cols[c] = (uint32_t*) malloc(CHUNK_TUPLES * sizeof(uint32_t));
+      assert(info[w].cols[c] != NULL);
+    }
+  }
+
+  // exchange partitions (build side first, workers read in this order)
+  const uint32_t* inner[2] = {inner_keys, inner_vals};
+  const uint32_t* outer[3] = {outer_join_keys, outer_aggr_keys, outer_vals};
+  if (scatter(info, workers, inner, 2, inner_tuples) != 0 ||
+      scatter(info, workers, outer, 3, outer_tuples) != 0) {
+    stop_workers(info, workers);
+    return 0;
+  }
+
+  // merge per-worker group states (a worker that died sends no groups)
+  q4112_aggr_state_t state;
+  q4112_aggr_init(&state, 0);
+  for (w = 0; w != workers; ++w) {
+    uint64_t size;
+    if (read_all(info[w].fd, &size, sizeof(size)) != 0 ||
+        size > SIZE_MAX / sizeof(bucket_aggr_t) - 1) {
+      break;
+    }
+    bucket_aggr_t* groups = (bucket_aggr_t*)
+        malloc((size + 1) * sizeof(bucket_aggr_t));
+    assert(groups != NULL);
+    if (read_all(info[w].fd, groups, size * sizeof(bucket_aggr_t)) != 0) {
+      free(groups);
+      break;
+    }
+    q4112_aggr_merge_groups(&state, groups, size);
+    free(groups);
+  }
+  if (w != workers) {
+    stop_workers(info, workers);
+    q4112_aggr_free(&state);
+    return 0;
+  }
+
+  // wait for workers and clean up
+  int failed = 0;
+  for (w = 0; w != workers; ++w) {
+    failed |= !wait_worker(info[w].pid);
+    close(info[w].fd);
+    for (c = 0; c != 3; ++c) {
+      free(info[w].cols[c]);
+    }
+  }
+  free(info);
+
+  uint64_t result = failed ? 0 : q4112_aggr_result(&state);
+  q4112_aggr_free(&state);
+  return result;
+}
@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "q4112.h"
+
+// run the query with N local worker processes and validate the result
+// usage: q4112_dist [inner_tuples] [outer_tuples] [groups] [hh_groups]
+//                   [hh_probability] [workers] [threads per worker]
+
+uint64_t real_time(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+const char* add_commas(uint64_t x) {
+  static char buf[32];
+  int digit = 0;
+  size_t i = sizeof(buf) / sizeof(char);
+  buf[--i] = '\0';
+  do {
+    if (digit++ == 3) {
+      buf[--i] = ',';
+      digit = 1;
+    }
+    buf[--i] = (x % 10) + '0';
+    x /= 10;
+  } while (x);
+  return &buf[i];
+}
+
+int main(int argc, char* argv[]) {
+  // get number of hardware threads
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0);
+  // get arguments from command line
+  size_t inner_tuples   = argc > 1 ? atoll(argv[1]) : 100000;
+  size_t outer_tuples   = argc > 2 ? atoll(argv[2]) : 10000000;
+  size_t groups         = argc > 3 ? atoll(argv[3]) : 10000;
+  size_t hh_groups      = argc > 4 ? atoll(argv[4]) : 0;
+  double hh_probability = argc > 5 ?  atof(argv[5]) : 0.0;
+  int workers           = argc > 6 ? atoi(argv[6]) : 4;
+  int threads           = argc > 7 ? atoi(argv[7]) : 1;
+
+  // check validadity of arguments
+  assert(inner_tuples > 0);
+  assert(outer_tuples >= inner_tuples);
+  assert(groups > 0 && groups <= outer_tuples);
+  assert(hh_groups <= groups);
+  assert(hh_probability >= 0 && hh_probability <= 1);
+  assert(workers > 0);
+  assert(threads > 0 && threads <= max_threads);
+
+  // allocate space for inner table
+  uint32_t* inner_keys = (uint32_t*) malloc(inner_tuples * 4);
+  assert(inner_keys != NULL);
+  uint32_t* inner_vals = (uint32_t*) malloc(inner_tuples * 4);
+  assert(inner_vals != NULL);
+  // allocate space for outer table
+  uint32_t* outer_join_keys = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_join_keys != NULL);
+  uint32_t* outer_aggr_keys = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_aggr_keys != NULL);
+  uint32_t* outer_vals = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_vals != NULL);
+
+  fprintf(stderr, "Workers: %d x %d threads\n", workers, threads);
+  fprintf(stderr, "Inner tuples: %13s\n", add_commas(inner_tuples));
+  fprintf(stderr, "Outer tuples: %13s\n", add_commas(outer_tuples));
+  fprintf(stderr, "Groups (all): %13s\n", add_commas(groups));
+
+  // generate data and get correct result
+  uint64_t gen_res = q4112_gen(inner_keys, inner_vals, inner_tuples,
+      1.0, 99999,
+      outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples,
+      1.0, 99999, groups, hh_groups, hh_probability);
+
+  // run join using the worker processes
+  uint64_t run_ns = real_time();
+  uint64_t run_res = q4112_run_dist(inner_keys, inner_vals, inner_tuples,
+      outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples,
+      workers, threads);
+  run_ns = real_time() - run_ns;
+  fprintf(stderr, "Execution time:  %12s ns\n", add_commas(run_ns));
+  fprintf(stderr, "Query result: %llu (expected %llu)\n",
+      (unsigned long long) run_res, (unsigned long long) gen_res);
+
+  // validate result and cleanup memory
+  assert(gen_res == run_res);
+  free(inner_keys);
+  free(inner_vals);
+  free(outer_join_keys);
+  free(outer_aggr_keys);
+  free(outer_vals);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+#ifndef _Q4112_HASH_
+#define _Q4112_HASH_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "q4112.h"
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+// Hash functions of the hash tables (see q4112_hash_t). Every function maps
+// a 32-bit key to a 32-bit value whose high bits pick the bucket (h >> (32 -
+// log_buckets)) and whose low bits pick the partition of the distinct value
+// estimate. The tables of tabulation hashing and of CRC32C without the
+// instruction are filled by q4112_hash_init from a fixed seed, so a hash
+// value is the same in every process (join table snapshots rely on it).
+
+typedef struct {
+  uint32_t tabulation[4][256];
+  uint32_t crc32c[256];
+} q4112_hash_tables_t;
+
+static q4112_hash_tables_t q4112_hash_tables;
+static pthread_once_t q4112_hash_once = PTHREAD_ONCE_INIT;
+
+static void q4112_hash_fill(void) {
+  uint64_t x = 0x4112411241124112ull;
+  int t, i, b;
+  for (t = 0; t != 4; ++t) {
+    for (i = 0; i != 256; ++i) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      q4112_hash_tables.tabulation[t][i] = (uint32_t) (x >> 32);
+    }
+  }
+  // reflected Castagnoli polynomial
+  for (i = 0; i != 256; ++i) {
+    uint32_t crc = i;
+    for (b = 0; b != 8; ++b) {
+      crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78u : 0);
+    }
+    q4112_hash_tables.crc32c[i] = crc;
+  }
+}
+
+// fill the tables (once per program, before the first hash)
+static inline void q4112_hash_init(void) {
+  pthread_once(&q4112_hash_once, q4112_hash_fill);
+}
+
+// CRC32C of the 4 bytes of the key with initial value 0 (the instruction
+// with SSE 4.2, one table lookup per byte otherwise)
+static inline uint32_t q4112_hash_crc32c(uint32_t key) {
+#ifdef __SSE4_2__
+  return _mm_crc32_u32(0, key);
+#else
+  const uint32_t* table = q4112_hash_tables.crc32c;
+  uint32_t crc = 0;
+  int b;
+  for (b = 0; b != 4; ++b) {
+    crc = table[(crc ^ key) & 0xff] ^ (crc >> 8);
+    key >>= 8;
+  }
+  return crc;
+#endif
+}
+
+// finalizer of MurmurHash3 (every key bit affects every hash bit)
+static inline uint32_t q4112_hash_murmur(uint32_t key) {
+  key ^= key >> 16;
+  key *= 0x85ebca6bu;
+  key ^= key >> 13;
+  key *= 0xc2b2ae35u;
+  key ^= key >> 16;
+  return key;
+}
+
+// simple tabulation: xor of one random word per key byte
+static inline uint32_t q4112_hash_tabulation(uint32_t key) {
+  const uint32_t (*table)[256] = q4112_hash_tables.tabulation;
+  return table[0][key & 0xff] ^ table[1][(key >> 8) & 0xff] ^
+         table[2][(key >> 16) & 0xff] ^ table[3][key >> 24];
+}
+
+// hash of a key (the branches fold away where the function is a constant,
+// and are predicted perfectly in loops where it is not)
+static inline __attribute__((always_inline))
+uint32_t q4112_hash(q4112_hash_t hash, uint32_t key) {
+  switch (hash) {
+    case Q4112_HASH_CRC32C:
+      return q4112_hash_crc32c(key);
+    case Q4112_HASH_MURMUR:
+      return q4112_hash_murmur(key);
+    case Q4112_HASH_TABULATION:
+      return q4112_hash_tabulation(key);
+    default:
+      return key * 0x9e3779b1;
+  }
+}
+
+#endif
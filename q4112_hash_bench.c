@@ -0,0 +1,208 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "q4112.h"
+#include "q4112_hash.h"
+
+// compare the hash functions of the hash tables: hashing throughput, and the
+// build and probe time and probe lengths of a linear probing join table
+// (sized like the one of q4112_run, fill rate between 1/3 and 2/3) on
+// generated and adversarial key sets
+// usage: q4112_hash_bench [tuples]
+// (prints one CSV line per hash function and key set; the probe length of a
+// key is the buckets read to find it, the miss length is the buckets read
+// for a missing key, averaged over all home buckets)
+
+// key sets: items.id of q4112_gen, 1..n, multiples of a power of 2 spread
+// over all 32 bits (keys that differ only in their high bits), two 16-bit
+// columns packed into a key (store << 16 | item, 1000 items per store) and
+// keys whose 4 bytes are small numbers (the digits of 1..n in the smallest
+// base that fits 4 digits, like packed dates or addresses), and keys made
+// for multiplicative hashing: their hashes put them into every 8th bucket
+// only (the inverse of the multiplier times the wanted hashes)
+#define KEY_SETS 6
+
+// hashes done for the throughput of a hash function
+#define HASHES (1 << 24)
+
+// probe lengths counted one by one in the histogram (longer ones are
+// counted at its end)
+#define MAX_PROBE_LENGTH 4096
+
+// results of the hash loops (so that the compiler keeps them)
+static volatile uint64_t sink;
+
+uint64_t real_time(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+static uint32_t small_bytes(uint32_t x, uint32_t base) {
+  uint32_t key = 0;
+  int b;
+  for (b = 0; b != 4; ++b) {
+    key |= (x % base) << (8 * b);
+    x /= base;
+  }
+  return key;
+}
+
+static void make_keys(int set, uint32_t* keys, size_t tuples) {
+  size_t i;
+  int bits = 0;
+  while (((size_t) 1 << bits) <= tuples) ++bits;
+  uint32_t base = 2;
+  while ((size_t) base * base * base * base <= tuples) ++base;
+  int log_buckets = 1;
+  size_t buckets = 2;
+  while (buckets * 0.67 < tuples) {
+    log_buckets += 1;
+    buckets += buckets;
+  }
+  uint32_t inverse = 0x9e3779b1;  // (Newton iteration mod 2^32)
+  for (i = 0; i != 5; ++i) {
+    inverse *= 2 - 0x9e3779b1 * inverse;
+  }
+  if (set == 0) {
+    uint32_t* vals = (uint32_t*) malloc(tuples * 4);
+    uint32_t* outer_keys = (uint32_t*) malloc(tuples * 4);
+    uint32_t* outer_vals = (uint32_t*) malloc(tuples * 4);
+    assert(vals != NULL && outer_keys != NULL && outer_vals != NULL);
+    q4112_gen(keys, vals, tuples, 1.0, 99999, outer_keys, NULL, outer_vals,
+              tuples, 1.0, 99999, 0, 0, 0.0);
+    free(vals);
+    free(outer_keys);
+    free(outer_vals);
+  }
+  for (i = 0; set != 0 && i != tuples; ++i) {
+    uint32_t x = i + 1;
+    keys[i] = set == 1 ? x :
+              set == 2 ? x << (32 - bits) :
+              set == 3 ? ((x / 1000 + 1) << 16) | (x % 1000) :
+              set == 4 ? small_bytes(x, base) :
+              inverse * (((x % (buckets / 8)) << (35 - log_buckets)) |
+                         (x / (buckets / 8)));
+  }
+}
+
+// time the hash function on the keys and check the probe lengths of a
+// linear probing table built from them
+static void bench(q4112_hash_t hash, const char* hash_name,
+                  const char* set_name, const uint32_t* keys, size_t tuples,
+                  size_t* histogram) {
+  size_t i, r;
+  int8_t log_buckets = 1;
+  size_t buckets = 2;
+  while (buckets * 0.67 < tuples) {
+    log_buckets += 1;
+    buckets += buckets;
+  }
+  uint32_t* table = (uint32_t*) calloc(buckets, 4);
+  assert(table != NULL);
+
+  // hashing throughput
+  uint64_t sum = 0;
+  size_t rounds = HASHES / tuples + 1;
+  uint64_t hash_ns = real_time();
+  for (r = 0; r != rounds; ++r) {
+    for (i = 0; i != tuples; ++i) {
+      sum += q4112_hash(hash, keys[i]);
+    }
+  }
+  hash_ns = real_time() - hash_ns;
+
+  // build and probe (with plain stores, the keys are distinct)
+  uint64_t build_ns = real_time();
+  for (i = 0; i != tuples; ++i) {
+    size_t h = q4112_hash(hash, keys[i]) >> (32 - log_buckets);
+    while (table[h] != 0) {
+      h = (h + 1) & (buckets - 1);
+    }
+    table[h] = keys[i];
+  }
+  build_ns = real_time() - build_ns;
+  uint64_t probe_ns = real_time();
+  for (i = 0; i != tuples; ++i) {
+    size_t h = q4112_hash(hash, keys[i]) >> (32 - log_buckets);
+    while (table[h] != keys[i]) {
+      h = (h + 1) & (buckets - 1);
+    }
+    sum += h;
+  }
+  probe_ns = real_time() - probe_ns;
+
+  // probe lengths of the keys
+  memset(histogram, 0, (MAX_PROBE_LENGTH + 1) * sizeof(size_t));
+  size_t max_length = 0, total_length = 0;
+  for (i = 0; i != buckets; ++i) {
+    if (table[i] == 0) continue;
+    size_t home = q4112_hash(hash, table[i]) >> (32 - log_buckets);
+    size_t length = ((i - home) & (buckets - 1)) + 1;
+    histogram[length < MAX_PROBE_LENGTH ? length : MAX_PROBE_LENGTH] += 1;
+    total_length += length;
+    if (length > max_length) max_length = length;
+  }
+  size_t p99_length = 0, seen = 0;
+  while (seen < tuples - tuples / 100) {
+    seen += histogram[++p99_length];
+  }
+
+  // miss lengths: from every bucket to the first empty one (walked
+  // backwards from an empty bucket, so the table is read once)
+  size_t empty = 0, run = 0, total_miss = 0;
+  while (table[empty] != 0) ++empty;
+  for (i = 0; i != buckets; ++i) {
+    size_t b = (empty - i) & (buckets - 1);
+    run = table[b] == 0 ? 0 : run + 1;
+    total_miss += run + 1;
+  }
+  free(table);
+
+  sink = sum;
+  printf("%s,%s,%zu,%zu,%.2f,%.2f,%.2f,%.3f,%zu,%zu,%.3f\n", hash_name,
+         set_name, tuples, buckets, (double) hash_ns / (rounds * tuples),
+         (double) build_ns / tuples, (double) probe_ns / tuples,
+         (double) total_length / tuples, p99_length, max_length,
+         (double) total_miss / buckets);
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  size_t tuples = argc > 1 ? atoll(argv[1]) : 1000000;
+  // the packed two-column keys have 16 bits per column
+  // (and the keys made for multiplicative hashing need 8 buckets)
+  assert(tuples >= 8 && tuples < 65535000);
+  q4112_hash_init();
+
+  uint32_t* keys = (uint32_t*) malloc(tuples * 4);
+  assert(keys != NULL);
+  size_t* histogram = (size_t*)
+      malloc((MAX_PROBE_LENGTH + 1) * sizeof(size_t));
+  assert(histogram != NULL);
+  const char* set_names[] = {"generated", "sequential", "stride",
+                             "packed_columns", "small_bytes",
+                             "multiply_adversary"};
+  q4112_hash_t hashes[] = {Q4112_HASH_MULTIPLY, Q4112_HASH_CRC32C,
+                           Q4112_HASH_MURMUR, Q4112_HASH_TABULATION};
+  const char* hash_names[] = {"multiply", "crc32c", "murmur", "tabulation"};
+  int s, f;
+
+  printf("%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n", "hash", "keys", "tuples",
+         "buckets", "hash_ns", "build_ns", "probe_ns", "mean_probe_length",
+         "p99_probe_length", "max_probe_length", "mean_miss_length");
+  for (s = 0; s != KEY_SETS; ++s) {
+    make_keys(s, keys, tuples);
+    for (f = 0; f != 4; ++f) {
+      bench(hashes[f], hash_names[f], set_names[s], keys, tuples, histogram);
+    }
+  }
+  free(keys);
+  free(histogram);
+  return EXIT_SUCCESS;
+}
@@ -5,40 +5,285 @@
 #include <unistd.h>
 #include <stdio.h>
 
+#include "q4112_barrier.h"
+
 typedef struct {
   uint32_t key;
   uint32_t val;
 } bucket_t;
 
+// pre-aggregate orders by item_id before the join if items is small
+// (the thread-local tables stay in cache) and orders is much larger
+#define EAGER_MAX_INNER 256
+#define EAGER_MIN_RATIO 64
+
+// join table shared by all threads, chosen after the inner keys are scanned
 typedef struct {
-  pthread_barrier_t barrier;
+  bucket_t* table;
+  int8_t log_buckets;
+  size_t buckets;
+  // direct-indexed table: items.id - min_key is the bucket (no hashing)
+  int direct;
+  uint32_t min_key;
+  // hash table build: inner tuples scattered to the thread that owns their
+  // bucket and tuples of each thread per owner (threads x threads)
+  bucket_t* scatter;
+  size_t* owner_counts;
+} q4112_join_table_t;
+
+typedef struct q4112_run_info q4112_run_info_t;
+
+struct q4112_run_info {
+  q4112_barrier_t* barrier;  // shared by the threads of the query
   pthread_t id;
   int thread;
   int threads;
-  size_t buckets;
   size_t inner_tuples;
   size_t outer_tuples;
-  int8_t log_buckets;
   const uint32_t* inner_keys;
   const uint32_t* inner_vals;
   const uint32_t* outer_keys;
   const uint32_t* outer_vals;
   uint64_t sum;
-  uint32_t count;
-  bucket_t* table;
-} q4112_run_info_t;
+  uint64_t count;
+  uint32_t min_key;
+  uint32_t max_key;
+  // inner tuples of this thread that overflowed its range of buckets
+  size_t spill_beg;
+  size_t spill_end;
+  int eager;
+  q4112_run_info_t* all;  // info of all threads
+  q4112_join_table_t* join;
+};
+
+// choose the join table once the key range of the inner table is known:
+// a direct-indexed table if the range is not larger than the hash table
+// would be (no hashing, no collisions and never more memory), otherwise an
+// open addressing hash table
+static void create_join_table(q4112_join_table_t* join, size_t inner_tuples,
+                              int threads, uint32_t min_key, uint32_t max_key) {
+  // set the number of hash table buckets to be 2^k
+  // the hash table fill rate will be between 1/3 and 2/3
+  int8_t log_buckets = 1;
+  size_t buckets = 2;
+  while (buckets * 0.67 < inner_tuples) {
+    log_buckets += 1;
+    buckets += buckets;
+  }
+
+  size_t range = inner_tuples && min_key <= max_key ?
+      (size_t) max_key - min_key + 1 : 0;
+  if (range != 0 && range <= buckets) {
+    join->direct = 1;
+    join->min_key = min_key;
+    join->buckets = range;
+    join->log_buckets = 0;
+  } else {
+    join->direct = 0;
+    join->min_key = 0;
+    join->buckets = buckets;
+    join->log_buckets = log_buckets;
+  }
+
+  // allocate and initialize the table
+  // there are no 0 keys (see header) so we use 0 for "no key"
+  join->table = (bucket_t*) calloc(join->buckets, sizeof(bucket_t));
+  assert(join->table != NULL);
+
+  // the hash table is built by partitioning the inner tuples to the threads
+  join->scatter = NULL;
+  join->owner_counts = NULL;
+  if (!join->direct && threads > 1) {
+    join->scatter = (bucket_t*) malloc(inner_tuples * sizeof(bucket_t));
+    assert(join->scatter != NULL);
+    join->owner_counts = (size_t*) calloc(threads * threads, sizeof(size_t));
+    assert(join->owner_counts != NULL);
+  }
+}
 
-// use global variable barrier
-pthread_barrier_t barrier; 
+// insert with plain stores into the first empty bucket of [h, end) (returns
+// 0 if they are all full)
+static inline int insert_owned(bucket_t* table, size_t h, size_t end,
+                               uint32_t key, uint32_t val) {
+  for (; h != end; ++h) {
+    if (table[h].key == 0) {
+      table[h].key = key;
+      table[h].val = val;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// insert with plain stores, wrapping around at the end of the table
+static inline void insert_wrap(bucket_t* table, size_t buckets,
+                               int8_t log_buckets, uint32_t key,
+                               uint32_t val) {
+  size_t h = (uint32_t) (key * 0x9e3779b1);
+  h >>= 32 - log_buckets;
+  if (!insert_owned(table, h, buckets, key, val)) {
+    int inserted = insert_owned(table, 0, h, key, val);
+    assert(inserted);
+    (void) inserted;
+  }
+}
+
+// build the hash table without atomics: thread t owns the buckets
+// [t * buckets / threads, (t + 1) * buckets / threads), every thread
+// scatters its inner tuples to the owners of their home buckets and then
+// inserts the tuples it owns with plain stores. Tuples that would probe
+// past the end of the range of their owner are inserted by one thread after
+// all others are done, which gives the same linear probing table as
+// inserting with compare-and-swap.
+static void build_owned(q4112_run_info_t* info, size_t inner_beg,
+                        size_t inner_end) {
+  q4112_join_table_t* join = info->join;
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  const uint32_t* inner_keys = info->inner_keys;
+  const uint32_t* inner_vals = info->inner_vals;
+  bucket_t* table = join->table;
+  bucket_t* scatter = join->scatter;
+  size_t* counts = join->owner_counts;
+  q4112_barrier_t* barrier = info->barrier;
+  int8_t log_buckets = join->log_buckets;
+  size_t buckets = join->buckets;
+  size_t i, h, p, t;
+
+  if (threads == 1) {
+    for (i = inner_beg; i < inner_end; ++i) {
+      insert_wrap(table, buckets, log_buckets, inner_keys[i], inner_vals[i]);
+    }
+    return;
+  }
+
+  // count tuples per owner (the owner is the high bits of the bucket)
+  size_t* my_counts = &counts[thread * threads];
+  for (i = inner_beg; i < inner_end; ++i) {
+    h = (uint32_t) (inner_keys[i] * 0x9e3779b1);
+    h >>= 32 - log_buckets;
+    my_counts[(h * threads) >> log_buckets] += 1;
+  }
+  q4112_barrier_wait(barrier);
+
+  // partitions are ordered by owner, then by the scattering thread
+  size_t* offsets = (size_t*) malloc(threads * sizeof(size_t));
+  assert(offsets != NULL);
+  size_t offset = 0, part_beg = 0, part_end = 0;
+  for (p = 0; p < threads; ++p) {
+    if (p == thread) part_beg = offset;
+    for (t = 0; t < threads; ++t) {
+      if (t == thread) offsets[p] = offset;
+      offset += counts[t * threads + p];
+    }
+    if (p == thread) part_end = offset;
+  }
+  for (i = inner_beg; i < inner_end; ++i) {
+    h = (uint32_t) (inner_keys[i] * 0x9e3779b1);
+    h >>= 32 - log_buckets;
+    bucket_t* out = &scatter[offsets[(h * threads) >> log_buckets]++];
+    out->key = inner_keys[i];
+    out->val = inner_vals[i];
+  }
+  free(offsets);
+  q4112_barrier_wait(barrier);
+
+  // insert owned tuples, keeping the overflowing ones at the partition start
+  size_t end = ((thread + 1) * buckets + threads - 1) / threads;
+  size_t spills = part_beg;
+  for (i = part_beg; i < part_end; ++i) {
+    bucket_t tuple = scatter[i];
+    h = (uint32_t) (tuple.key * 0x9e3779b1);
+    h >>= 32 - log_buckets;
+    if (!insert_owned(table, h, end, tuple.key, tuple.val)) {
+      scatter[spills++] = tuple;
+    }
+  }
+  info->spill_beg = part_beg;
+  info->spill_end = spills;
+
+  // one thread inserts the overflowing tuples of all threads
+  if (q4112_barrier_wait(barrier)) {
+    for (t = 0; t < threads; ++t) {
+      for (i = info->all[t].spill_beg; i < info->all[t].spill_end; ++i) {
+        insert_wrap(table, buckets, log_buckets,
+                    scatter[i].key, scatter[i].val);
+      }
+    }
+  }
+}
+
+// probe the join table with an outer key (returns 1 and the bucket of the
+// matching items tuple if the key matches)
+static inline int probe_join(const bucket_t* table, size_t buckets,
+                             int8_t log_buckets, int direct, uint32_t base,
+                             uint32_t key, size_t* bucket) {
+  size_t h;
+  if (direct) {
+    h = (uint32_t) (key - base);
+    *bucket = h;
+    return h < buckets && table[h].key == key;
+  }
+  h = (uint32_t) (key * 0x9e3779b1);
+  h >>= 32 - log_buckets;
+  while (table[h].key != 0) {
+    if (table[h].key == key) {
+      *bucket = h;
+      return 1;
+    }
+    h = (h + 1) & (buckets - 1);
+  }
+  return 0;
+}
+
+// SUM(price * quantity) is the sum over items of price * SUM(quantity), so
+// orders are first aggregated by item_id into a thread-local table and only
+// the aggregated tuples are joined with items.price. The local table has one
+// bucket per bucket of the (small, read-only) join table, so the item_id of
+// an order is found with the same probe that filters out orders whose
+// item_id is not in items, and those never take a bucket.
+static void eager_aggregate(const q4112_join_table_t* join,
+                            const uint32_t* outer_keys,
+                            const uint32_t* outer_vals, size_t outer_beg,
+                            size_t outer_end, uint64_t* sum_out,
+                            uint64_t* count_out) {
+  const bucket_t* table = join->table;
+  size_t o, h, buckets = join->buckets;
+  int8_t log_buckets = join->log_buckets;
+  int direct = join->direct;
+  uint32_t base = join->min_key;
+  // SUM(orders.quantity) per item_id (the count of joined tuples does not
+  // depend on the item, so it is kept as a single counter)
+  uint64_t* local = (uint64_t*) calloc(buckets, sizeof(uint64_t));
+  assert(local != NULL);
+
+  // pre-aggregate orders by item_id
+  uint64_t count = 0;
+  for (o = outer_beg; o < outer_end; ++o) {
+    if (probe_join(table, buckets, log_buckets, direct, base,
+                   outer_keys[o], &h)) {
+      local[h] += outer_vals[o];
+      count += 1;
+    }
+  }
+
+  // join the pre-aggregated orders
+  uint64_t sum = 0;
+  for (h = 0; h != buckets; ++h) {
+    sum += table[h].val * local[h];
+  }
+  free(local);
+  *sum_out = sum;
+  *count_out = count;
+}
 
 void* q4112_run_thread(void* arg) {
   q4112_run_info_t* info = (q4112_run_info_t*) arg;
   assert(pthread_equal(pthread_self(), info->id));
 
   // copy info
-  bucket_t* table = info->table;
-  int8_t log_buckets = info->log_buckets;
-  size_t buckets = info->buckets;
+  q4112_join_table_t* join = info->join;
+  q4112_barrier_t* barrier = info->barrier;
   size_t thread  = info->thread;
   size_t threads = info->threads;
   size_t inner_tuples = info->inner_tuples;
@@ -54,39 +299,44 @@ void* q4112_run_thread(void* arg) {
   if (thread + 1 == threads) 
     inner_end = inner_tuples;
 
-  // scan whole inner table but split outer table
-  size_t i, o, h;
+  // key range of this part of the inner table
+  size_t i, o, h, t;
+  uint32_t min_key = ~0u, max_key = 0;
   for (i = inner_beg; i < inner_end; ++i) {
-    uint32_t key = inner_keys[i];
-    uint32_t val = inner_vals[i];
-
-    // multiplicative hashing
-    h = (uint32_t) (key * 0x9e3779b1);
-    h >>= 32 - log_buckets;
-
-    // search for empty bucket
-    // flag == 1 means insert this key successfully
-    size_t flag; 
-    flag = 0;
-    while (flag == 0) {
-      if (table[h].key == 0) {
-        if (__sync_bool_compare_and_swap(&table[h].key, 0, key)) { 
-          table[h].val = val;
-          flag = 1;
-        }
-      }
-
-      if (flag == 0) {
-        // go to next bucket (linear probing)
-        h = (h + 1) & (buckets - 1);
-      }
+    if (inner_keys[i] < min_key) min_key = inner_keys[i];
+    if (inner_keys[i] > max_key) max_key = inner_keys[i];
+  }
+  info->min_key = min_key;
+  info->max_key = max_key;
+
+  // one thread creates the table for the key range of all threads
+  if (q4112_barrier_wait(barrier)) {
+    for (t = 0; t < threads; ++t) {
+      if (info->all[t].min_key < min_key) min_key = info->all[t].min_key;
+      if (info->all[t].max_key > max_key) max_key = info->all[t].max_key;
     }
-
+    create_join_table(join, inner_tuples, threads, min_key, max_key);
+  }
+  q4112_barrier_wait(barrier);
+
+  bucket_t* table = join->table;
+  int8_t log_buckets = join->log_buckets;
+  size_t buckets = join->buckets;
+  uint32_t base = join->min_key;
+
+  if (join->direct) {
+    // primary keys are unique, so every key has its own bucket
+    for (i = inner_beg; i < inner_end; ++i) {
+      table[inner_keys[i] - base].key = inner_keys[i];
+      table[inner_keys[i] - base].val = inner_vals[i];
+    }
+  } else {
+    build_owned(info, inner_beg, inner_end);
   }
 
   // Here the first part(inner part) finished.
   // All threads wait here
-  pthread_barrier_wait(&barrier);
+  q4112_barrier_wait(barrier);
 
   // After all thread finished first part(inner part), they start the 
   // second part(outer part) at the same time.
@@ -98,32 +348,48 @@ void* q4112_run_thread(void* arg) {
     outer_end = outer_tuples;
 
   // initialize single aggregate
-  uint32_t count = 0;
+  uint64_t count = 0;
   uint64_t sum = 0;
 
-  // probe outer table using hash table
-  for (o = outer_beg; o < outer_end; ++o) {
-    uint32_t key = outer_keys[o];
-
-    // multiplicative hashing
-    h = (uint32_t) (key * 0x9e3779b1);
-    h >>= 32 - log_buckets;
-
-    // search for matching bucket
-    uint32_t tab = table[h].key;
-    while (tab != 0) {
-      // keys match
-      if (tab == key) {   
-        // update single aggregate
-        sum += table[h].val * (uint64_t) outer_vals[o];
+  if (info->eager) {
+    eager_aggregate(join, outer_keys, outer_vals,
+                    outer_beg, outer_end, &sum, &count);
+  } else if (join->direct) {
+    // probe with a single load (keys outside the range wrap to large
+    // unsigned offsets and are rejected by the range check)
+    for (o = outer_beg; o < outer_end; ++o) {
+      uint32_t key = outer_keys[o];
+      size_t d = (uint32_t) (key - base);
+      if (d < buckets && table[d].key == key) {
+        sum += table[d].val * (uint64_t) outer_vals[o];
         count += 1;
-        // guaranteed single match (join on primary key)
-        break;
       }
+    }
+  } else {
+    // probe outer table using hash table
+    for (o = outer_beg; o < outer_end; ++o) {
+      uint32_t key = outer_keys[o];
+
+      // multiplicative hashing
+      h = (uint32_t) (key * 0x9e3779b1);
+      h >>= 32 - log_buckets;
+
+      // search for matching bucket
+      uint32_t tab = table[h].key;
+      while (tab != 0) {
+        // keys match
+        if (tab == key) {   
+          // update single aggregate
+          sum += table[h].val * (uint64_t) outer_vals[o];
+          count += 1;
+          // guaranteed single match (join on primary key)
+          break;
+        }
 
-      // go to next bucket (linear probing)
-      h = (h + 1) & (buckets - 1);
-      tab = table[h].key;
+        // go to next bucket (linear probing)
+        h = (h + 1) & (buckets - 1);
+        tab = table[h].key;
+      }
     }
   }
 
@@ -151,22 +417,16 @@ uint64_t q4112_run(
       malloc(threads * sizeof(q4112_run_info_t));
   assert(info != NULL);
 
-  // set the number of hash table buckets to be 2^k
-  // the hash table fill rate will be between 1/3 and 2/3
-  int8_t log_buckets = 1;
-  size_t buckets = 2;
-  while (buckets * 0.67 < inner_tuples) {
-    log_buckets += 1;
-    buckets += buckets; 
-  }
+  // the join table is created by the threads
+  q4112_join_table_t join;
 
-  // allocate and initialize the hash table
-  // there are no 0 keys (see header) so we use 0 for "no key"
-  bucket_t* table = (bucket_t*) calloc(buckets, sizeof(bucket_t)); // * here bucket_t* represents array ?
-  assert(table != NULL);
+  // choose eager aggregation if the join input shrinks a lot
+  int eager = inner_tuples <= EAGER_MAX_INNER &&
+              inner_tuples * EAGER_MIN_RATIO <= outer_tuples;
 
-  // set barrier
-  pthread_barrier_init(&barrier, NULL, threads);
+  // set barrier (per query, like the join table)
+  q4112_barrier_t barrier;
+  q4112_barrier_init(&barrier, threads);
 
   for (t = 0; t < threads; ++t) {
     info[t].thread = t;
@@ -177,15 +437,16 @@ uint64_t q4112_run(
     info[t].outer_vals = outer_vals;
     info[t].inner_tuples = inner_tuples;
     info[t].outer_tuples = outer_tuples;
-    info[t].log_buckets = log_buckets;
-    info[t].table = table;
-    info[t].buckets = buckets;
+    info[t].eager = eager;
+    info[t].all = info;
+    info[t].join = &join;
+    info[t].barrier = &barrier;
     pthread_create(&info[t].id, NULL, q4112_run_thread, &info[t]);
   }
 
   // gather result
   uint64_t sum = 0;
-  uint32_t count = 0;
+  uint64_t count = 0;
   for (t = 0; t < threads; ++t) {
     pthread_join(info[t].id, NULL);
     sum += info[t].sum;
@@ -193,12 +454,10 @@ uint64_t q4112_run(
   }
 
   // cleanup and return average (integer division)
-  free(table);
+  free(join.table);
+  free(join.scatter);
+  free(join.owner_counts);
   free(info);
 
   return sum / count;
 }
-
-
-
-
@@ -7,6 +7,11 @@ typedef struct {
   uint32_t val;
 } bucket_t;
 
+// pre-aggregate orders by item_id before the join if items is small and
+// orders is much larger
+#define EAGER_MAX_INNER 256
+#define EAGER_MIN_RATIO 64
+
 uint64_t q4112_run(
     const uint32_t* inner_keys,
     const uint32_t* inner_vals,
@@ -57,9 +62,44 @@ uint64_t q4112_run(
 
 
   // initialize single aggregate
-  uint32_t count = 0;
+  uint64_t count = 0;
   uint64_t sum = 0;
 
+  if (inner_tuples <= EAGER_MAX_INNER &&
+      inner_tuples * EAGER_MIN_RATIO <= outer_tuples) {
+    // SUM(price * quantity) is the sum over items of price * SUM(quantity):
+    // aggregate orders.quantity per bucket of the join table (i.e. per
+    // item_id), then join the aggregated tuples with items.price
+    uint64_t* quantities = (uint64_t*) calloc(buckets, sizeof(uint64_t));
+    assert(quantities != NULL);
+    for (o = 0; o < outer_tuples; ++o) {
+      uint32_t key = outer_join_keys[o];
+
+      // multiplicative hashing
+      h = (uint32_t) (key * 0x9e3779b1);
+      h >>= 32 - log_buckets;
+
+      // search for matching bucket
+      uint32_t tab = table[h].key;
+      while (tab != 0) {
+        if (tab == key) {
+          quantities[h] += outer_vals[o];
+          count += 1;
+          break;
+        }
+        h = (h + 1) & (buckets - 1);
+        tab = table[h].key;
+      }
+    }
+    // empty buckets have no quantity
+    for (h = 0; h < buckets; ++h) {
+      sum += table[h].val * quantities[h];
+    }
+    free(quantities);
+    free(table);
+    return sum / count;
+  }
+
   // probe outer table using hash table
   for (o = 0; o < outer_tuples; ++o) {
     uint32_t key = outer_join_keys[o];
@@ -0,0 +1,592 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// the kernels are static in q4112.c, so they are timed in the same
+// translation unit (and inlined exactly as in the query)
+#include "q4112.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// time the building blocks of q4112_run separately: the hash functions,
+// trailing_zero_count, the FM sketch update, the join table build,
+// the probe at several hit rates and atomic vs. private aggregation, each
+// over working sets from L1 to DRAM size
+// usage: q4112_kernel_bench [tuples] [threads] [working_set_bytes...]
+// (prints one CSV line per kernel and working set; the working set is the
+// table of the kernel, or the input of the hashes; the threads only apply
+// to the aggregation kernels, and its cycles per tuple are per thread)
+
+#define REPEATS 3
+
+// cycles of the time stamp counter (reference cycles at the nominal
+// frequency) if there is one, nanoseconds otherwise
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return get_time_in_ns();
+#endif
+}
+
+typedef struct {
+  uint64_t cycles;
+  uint64_t ns;
+} timing_t;
+
+static void timer_start(timing_t* t) {
+  t->ns -= get_time_in_ns();
+  t->cycles -= cycles();
+}
+
+static void timer_stop(timing_t* t) {
+  t->cycles += cycles();
+  t->ns += get_time_in_ns();
+}
+
+// results of the kernels (so that the compiler keeps them)
+static volatile uint64_t sink;
+
+// bijective mix of 32-bit integers (distinct keys for distinct inputs and a
+// key 0 only for input 0)
+static uint32_t mix32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
+static uint64_t next_random(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static size_t largest_power_of_2_less_equal_n(size_t n) {
+  size_t ans = 1;
+  while (ans * 2 <= n) {
+    ans *= 2;
+  }
+  return ans;
+}
+
+static void report(const char* kernel, const char* param, size_t bytes,
+                   size_t tuples, int threads, const timing_t* t) {
+  printf("%s,%s,%zu,%zu,%d,%.2f,%.2f\n", kernel, param, bytes, tuples,
+         threads, (double) t->cycles / tuples, (double) t->ns / tuples);
+  fflush(stdout);
+}
+
+static void best_of(timing_t* best, const timing_t* t) {
+  if (best->cycles == 0 || t->cycles < best->cycles) *best = *t;
+}
+
+
+// hashes and trailing_zero_count over a column of the working set size
+// (read in a loop until tuples keys are done)
+
+KERNEL void hash_kernel(const uint32_t* keys, size_t mask, size_t tuples,
+                        const q4112_hash_t hash, timing_t* t) {
+  size_t i;
+  uint64_t sum = 0;
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    sum += q4112_hash(hash, keys[i & mask]);
+  }
+  timer_stop(t);
+  sink = sum;
+}
+
+// (one loop per hash function)
+static void bench_hash32(const uint32_t* keys, size_t mask, size_t tuples,
+                         q4112_hash_t hash, timing_t* t) {
+  switch (hash) {
+    case Q4112_HASH_CRC32C:
+      hash_kernel(keys, mask, tuples, Q4112_HASH_CRC32C, t);
+      break;
+    case Q4112_HASH_MURMUR:
+      hash_kernel(keys, mask, tuples, Q4112_HASH_MURMUR, t);
+      break;
+    case Q4112_HASH_TABULATION:
+      hash_kernel(keys, mask, tuples, Q4112_HASH_TABULATION, t);
+      break;
+    default:
+      hash_kernel(keys, mask, tuples, Q4112_HASH_MULTIPLY, t);
+  }
+}
+
+static void bench_hash64(const uint32_t* keys, size_t mask, size_t tuples,
+                         timing_t* t) {
+  size_t i;
+  uint64_t sum = 0;
+  uint8_t tag;
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    sum += swiss_hash(Q4112_HASH_MULTIPLY, keys[i & mask], mask + 1, &tag) +
+           tag;
+  }
+  timer_stop(t);
+  sink = sum;
+}
+
+static void bench_trailing_zero_count(const uint32_t* bitmaps, size_t mask,
+                                      size_t tuples, timing_t* t) {
+  size_t i;
+  uint64_t sum = 0;
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    sum += trailing_zero_count(~bitmaps[i & mask]);
+  }
+  timer_stop(t);
+  sink = sum;
+}
+
+// the instruction that trailing_zero_count could be (for comparison)
+static void bench_ctz(const uint32_t* bitmaps, size_t mask, size_t tuples,
+                      timing_t* t) {
+  size_t i;
+  uint64_t sum = 0;
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    uint32_t x = ~bitmaps[i & mask];
+    sum += x != 0 ? (uint32_t) __builtin_ctz(x) : (uint32_t) -1;
+  }
+  timer_stop(t);
+  sink = sum;
+}
+
+
+// FM sketch update of the estimation pass with bitmaps of the working set
+// size (one per partition)
+static void bench_fm(const uint32_t* stream, size_t tuples,
+                     uint32_t* bitmaps, size_t partitions, timing_t* t) {
+  int8_t log_partitions = 0;
+  while (((size_t) 1 << log_partitions) < partitions) ++log_partitions;
+  size_t i;
+  memset(bitmaps, 0, partitions * 4);
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    uint32_t h = (uint32_t) (stream[i] * 0x9e3779b1);
+    size_t p = h & (partitions - 1);
+    h >>= log_partitions;
+    bitmaps[p] |= h & -h;
+  }
+  timer_stop(t);
+  sink = bitmaps[0];
+}
+
+
+// join table build with compare-and-swap (the atomic build of q4112_run),
+// repeated on a cleared table until tuples keys are inserted
+
+static void build_linear(bucket_t* table, size_t buckets, int8_t log_buckets,
+                         const uint32_t* keys, size_t n) {
+  size_t i;
+  for (i = 0; i != n; ++i) {
+    size_t h = (uint32_t) (keys[i] * 0x9e3779b1) >> (32 - log_buckets);
+    while (table[h].key != 0 ||
+           !__sync_bool_compare_and_swap(&table[h].key, 0, keys[i])) {
+      h = (h + 1) & (buckets - 1);
+    }
+    table[h].val = keys[i];
+  }
+}
+
+static void bench_build_linear(bucket_t* table, size_t buckets,
+                               int8_t log_buckets, const uint32_t* keys,
+                               size_t n, size_t tuples, timing_t* t) {
+  size_t done;
+  for (done = 0; done < tuples; done += n) {
+    memset(table, 0, buckets * sizeof(bucket_t));
+    timer_start(t);
+    build_linear(table, buckets, log_buckets, keys, n);
+    timer_stop(t);
+  }
+}
+
+static void build_swiss(swiss_group_t* swiss, size_t groups,
+                        const uint32_t* keys, size_t n) {
+  size_t i;
+  for (i = 0; i != n; ++i) {
+    insert_swiss(swiss, groups, Q4112_HASH_MULTIPLY, keys[i], keys[i]);
+  }
+}
+
+static void bench_build_swiss(swiss_group_t* swiss, size_t groups,
+                              const uint32_t* keys, size_t n, size_t tuples,
+                              timing_t* t) {
+  size_t done;
+  for (done = 0; done < tuples; done += n) {
+    memset(swiss, 0, groups * sizeof(swiss_group_t));
+    timer_start(t);
+    build_swiss(swiss, groups, keys, n);
+    timer_stop(t);
+  }
+}
+
+
+// probe of a built join table with a stream of outer keys
+
+static void bench_probe_linear(const bucket_t* table, size_t buckets,
+                               int8_t log_buckets, const uint32_t* stream,
+                               size_t tuples, timing_t* t) {
+  size_t i;
+  uint64_t sum = 0;
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    uint32_t val;
+    size_t h = (uint32_t) (stream[i] * 0x9e3779b1) >> (32 - log_buckets);
+    if (probe(table, buckets, h, stream[i], &val)) sum += val;
+  }
+  timer_stop(t);
+  sink = sum;
+}
+
+static void bench_probe_swiss(const swiss_group_t* swiss, size_t groups,
+                              const uint32_t* stream, size_t tuples,
+                              timing_t* t) {
+  size_t i;
+  uint64_t sum = 0;
+  timer_start(t);
+  for (i = 0; i != tuples; ++i) {
+    uint32_t val;
+    uint8_t tag;
+    size_t g = swiss_hash(Q4112_HASH_MULTIPLY, stream[i], groups, &tag);
+    if (probe_swiss(swiss, groups, g, tag, stream[i], &val)) sum += val;
+  }
+  timer_stop(t);
+  sink = sum;
+}
+
+
+// aggregation of a stream of group keys into a hash table or a dense array
+// shared by all threads (atomics) or private to every thread (plain adds)
+
+enum { AGGR_HASH_ATOMIC, AGGR_HASH_PRIVATE, AGGR_DENSE_ATOMIC,
+       AGGR_DENSE_PRIVATE };
+
+typedef struct {
+  pthread_t id;
+  int mode;
+  const uint32_t* stream;  // keys of this thread
+  size_t tuples;
+  bucket_aggr_t* aggr_table;
+  size_t aggr_buckets;
+  int8_t log_aggr_buckets;
+  bucket_dense_t* dense_table;  // indexed by key - 1
+  q4112_barrier_t* barrier;
+  timing_t timing;
+} aggr_bench_info_t;
+
+static void* aggr_bench_thread(void* arg) {
+  aggr_bench_info_t* info = (aggr_bench_info_t*) arg;
+  const uint32_t* stream = info->stream;
+  bucket_aggr_t* aggr_table = info->aggr_table;
+  bucket_dense_t* dense_table = info->dense_table;
+  size_t i, tuples = info->tuples;
+
+  q4112_barrier_wait(info->barrier);
+  timer_start(&info->timing);
+  switch (info->mode) {
+    case AGGR_HASH_ATOMIC:
+      for (i = 0; i != tuples; ++i) {
+        aggregate(aggr_table, info->aggr_buckets, info->log_aggr_buckets,
+                  NULL, Q4112_HASH_MULTIPLY, stream[i], stream[i], 1);
+      }
+      break;
+    case AGGR_HASH_PRIVATE:
+      for (i = 0; i != tuples; ++i) {
+        aggregate_private(aggr_table, info->aggr_buckets,
+                          info->log_aggr_buckets, NULL, Q4112_HASH_MULTIPLY,
+                          stream[i], stream[i]);
+      }
+      break;
+    case AGGR_DENSE_ATOMIC:
+      for (i = 0; i != tuples; ++i) {
+        __sync_fetch_and_add(&dense_table[stream[i] - 1].sum, stream[i]);
+        __sync_fetch_and_add(&dense_table[stream[i] - 1].count, 1);
+      }
+      break;
+    case AGGR_DENSE_PRIVATE:
+      for (i = 0; i != tuples; ++i) {
+        dense_table[stream[i] - 1].sum += stream[i];
+        dense_table[stream[i] - 1].count += 1;
+      }
+      break;
+  }
+  timer_stop(&info->timing);
+  pthread_exit(NULL);
+}
+
+// run one aggregation mode with groups keys 1..groups in the stream (the
+// timing of the slowest thread is the timing of the run)
+static void bench_aggregate(int mode, const uint32_t* stream, size_t tuples,
+                            size_t aggr_buckets, size_t groups, int threads,
+                            timing_t* t) {
+  int private = mode == AGGR_HASH_PRIVATE || mode == AGGR_DENSE_PRIVATE;
+  int hash = mode == AGGR_HASH_ATOMIC || mode == AGGR_HASH_PRIVATE;
+  int tables = private ? threads : 1;
+  int8_t log_aggr_buckets = 0;
+  while (((size_t) 1 << log_aggr_buckets) < aggr_buckets) ++log_aggr_buckets;
+
+  bucket_aggr_t* aggr_table = NULL;
+  bucket_dense_t* dense_table = NULL;
+  if (hash) {
+    aggr_table = (bucket_aggr_t*)
+        calloc(tables * aggr_buckets, sizeof(bucket_aggr_t));
+    assert(aggr_table != NULL);
+  } else {
+    dense_table = (bucket_dense_t*)
+        calloc(tables * groups, sizeof(bucket_dense_t));
+    assert(dense_table != NULL);
+  }
+
+  q4112_barrier_t barrier;
+  q4112_barrier_init(&barrier, threads);
+  aggr_bench_info_t* info = (aggr_bench_info_t*)
+      calloc(threads, sizeof(aggr_bench_info_t));
+  assert(info != NULL);
+  int i;
+  for (i = 0; i != threads; ++i) {
+    size_t beg = (tuples / threads) * (i + 0);
+    size_t end = (tuples / threads) * (i + 1);
+    if (i + 1 == threads) end = tuples;
+    info[i].mode = mode;
+    info[i].stream = &stream[beg];
+    info[i].tuples = end - beg;
+    info[i].aggr_buckets = aggr_buckets;
+    info[i].log_aggr_buckets = log_aggr_buckets;
+    if (hash) {
+      info[i].aggr_table = &aggr_table[private ? i * aggr_buckets : 0];
+    } else {
+      info[i].dense_table = &dense_table[private ? i * groups : 0];
+    }
+    info[i].barrier = &barrier;
+    pthread_create(&info[i].id, NULL, aggr_bench_thread, &info[i]);
+  }
+  timing_t slowest = {0, 0};
+  for (i = 0; i != threads; ++i) {
+    pthread_join(info[i].id, NULL);
+    if (info[i].timing.cycles > slowest.cycles) slowest = info[i].timing;
+  }
+  // cycles per tuple of every thread
+  t->cycles += slowest.cycles * threads;
+  t->ns += slowest.ns * threads;
+  free(info);
+  free(aggr_table);
+  free(dense_table);
+}
+
+
+int main(int argc, char* argv[]) {
+  q4112_hash_init();
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t tuples = argc > 1 ? atoll(argv[1]) : 16 * 1024 * 1024;
+  int threads   = argc > 2 ? atoi(argv[2]) : 1;
+  assert(tuples > 0);
+  assert(threads > 0 && threads <= max_threads);
+
+  // default working sets of the size of L1, L2, the last level cache and
+  // DRAM of most servers (rounded down to powers of 2)
+  size_t default_working_sets[] = {16 << 10, 256 << 10, 8 << 20, 256 << 20};
+  size_t* working_sets = default_working_sets;
+  int w, sizes = 4;
+  if (argc > 3) {
+    sizes = argc - 3;
+    working_sets = (size_t*) malloc(sizes * sizeof(size_t));
+    assert(working_sets != NULL);
+    for (w = 0; w != sizes; ++w) {
+      working_sets[w] = atoll(argv[w + 3]);
+      assert(working_sets[w] >= 1024);
+    }
+  }
+
+  uint32_t* stream = (uint32_t*) malloc(tuples * 4);
+  assert(stream != NULL);
+  uint64_t random = 0x9e3779b97f4a7c15ull;
+  size_t i, r;
+  int h;
+  char param[32];
+
+  printf("%s,%s,%s,%s,%s,%s,%s\n", "kernel", "param", "working_set_bytes",
+         "tuples", "threads", "cycles_per_tuple", "ns_per_tuple");
+  for (w = 0; w != sizes; ++w) {
+    size_t bytes = largest_power_of_2_less_equal_n(working_sets[w]);
+    timing_t best;
+
+    // hashes and trailing_zero_count
+    size_t keys_n = bytes / 4;
+    uint32_t* keys = (uint32_t*) malloc(bytes);
+    assert(keys != NULL);
+    for (i = 0; i != keys_n; ++i) {
+      keys[i] = mix32(i + 1);
+    }
+    const char* hash_names[] = {"multiply", "crc32c", "murmur", "tabulation"};
+    int f;
+    for (f = 0; f != 4; ++f) {
+      memset(&best, 0, sizeof(best));
+      for (r = 0; r != REPEATS; ++r) {
+        timing_t t = {0, 0};
+        bench_hash32(keys, keys_n - 1, tuples, (q4112_hash_t) f, &t);
+        best_of(&best, &t);
+      }
+      report("hash32", hash_names[f], bytes, tuples, 1, &best);
+    }
+    memset(&best, 0, sizeof(best));
+    for (r = 0; r != REPEATS; ++r) {
+      timing_t t = {0, 0};
+      bench_hash64(keys, keys_n - 1, tuples, &t);
+      best_of(&best, &t);
+    }
+    report("hash64", "", bytes, tuples, 1, &best);
+    // bitmaps of an FM sketch: the lowest 4 to 19 bits are set
+    for (i = 0; i != keys_n; ++i) {
+      keys[i] = (1u << (4 + keys[i] % 16)) - 1;
+    }
+    memset(&best, 0, sizeof(best));
+    for (r = 0; r != REPEATS; ++r) {
+      timing_t t = {0, 0};
+      bench_trailing_zero_count(keys, keys_n - 1, tuples, &t);
+      best_of(&best, &t);
+    }
+    report("trailing_zero_count", "", bytes, tuples, 1, &best);
+    memset(&best, 0, sizeof(best));
+    for (r = 0; r != REPEATS; ++r) {
+      timing_t t = {0, 0};
+      bench_ctz(keys, keys_n - 1, tuples, &t);
+      best_of(&best, &t);
+    }
+    report("ctz", "", bytes, tuples, 1, &best);
+
+    // FM sketch update with a stream of random keys
+    for (i = 0; i != tuples; ++i) {
+      stream[i] = next_random(&random);
+    }
+    memset(&best, 0, sizeof(best));
+    for (r = 0; r != REPEATS; ++r) {
+      timing_t t = {0, 0};
+      bench_fm(stream, tuples, keys, keys_n, &t);
+      best_of(&best, &t);
+    }
+    sprintf(param, "partitions=%zu", keys_n);
+    report("fm_update", param, bytes, tuples, 1, &best);
+    free(keys);
+
+    // join tables of the working set size: the linear table at its highest
+    // fill rate (2/3), the SIMD-tagged one with the same inner tuples
+    size_t buckets = bytes / sizeof(bucket_t);
+    int8_t log_buckets = 0;
+    while (((size_t) 1 << log_buckets) < buckets) ++log_buckets;
+    size_t inner_n = buckets * 0.67;
+    size_t swiss_groups = inner_n / (SWISS_SLOTS * SWISS_FILL) + 1;
+    uint32_t* inner_keys = (uint32_t*) malloc(inner_n * 4);
+    assert(inner_keys != NULL);
+    for (i = 0; i != inner_n; ++i) {
+      inner_keys[i] = mix32(i + 1);
+    }
+    bucket_t* table = (bucket_t*) calloc(buckets, sizeof(bucket_t));
+    assert(table != NULL);
+    swiss_group_t* swiss;
+    if (posix_memalign((void**) &swiss, sizeof(swiss_group_t),
+                       swiss_groups * sizeof(swiss_group_t)) != 0) {
+      swiss = NULL;
+    }
+    assert(swiss != NULL);
+
+    sprintf(param, "inner=%zu", inner_n);
+    memset(&best, 0, sizeof(best));
+    for (r = 0; r != REPEATS; ++r) {
+      timing_t t = {0, 0};
+      bench_build_linear(table, buckets, log_buckets, inner_keys, inner_n,
+                         tuples, &t);
+      best_of(&best, &t);
+    }
+    report("build_linear", param, buckets * sizeof(bucket_t),
+           (tuples + inner_n - 1) / inner_n * inner_n, 1, &best);
+    memset(&best, 0, sizeof(best));
+    for (r = 0; r != REPEATS; ++r) {
+      timing_t t = {0, 0};
+      bench_build_swiss(swiss, swiss_groups, inner_keys, inner_n, tuples, &t);
+      best_of(&best, &t);
+    }
+    report("build_swiss", param, swiss_groups * sizeof(swiss_group_t),
+           (tuples + inner_n - 1) / inner_n * inner_n, 1, &best);
+
+    // probe with a stream where hit_rate percent of keys are inner keys
+    // (the last builds left both tables full)
+    int hit_rates[] = {0, 50, 90, 100};
+    for (h = 0; h != 4; ++h) {
+      for (i = 0; i != tuples; ++i) {
+        uint64_t x = next_random(&random);
+        if ((int) (x % 100) < hit_rates[h]) {
+          stream[i] = inner_keys[(x >> 32) % inner_n];
+        } else {
+          stream[i] = mix32(inner_n + 1 + (x >> 32) % inner_n);
+        }
+      }
+      sprintf(param, "hit=%d%%", hit_rates[h]);
+      memset(&best, 0, sizeof(best));
+      for (r = 0; r != REPEATS; ++r) {
+        timing_t t = {0, 0};
+        bench_probe_linear(table, buckets, log_buckets, stream, tuples, &t);
+        best_of(&best, &t);
+      }
+      report("probe_linear", param, buckets * sizeof(bucket_t), tuples, 1,
+             &best);
+      memset(&best, 0, sizeof(best));
+      for (r = 0; r != REPEATS; ++r) {
+        timing_t t = {0, 0};
+        bench_probe_swiss(swiss, swiss_groups, stream, tuples, &t);
+        best_of(&best, &t);
+      }
+      report("probe_swiss", param, swiss_groups * sizeof(swiss_group_t),
+             tuples, 1, &best);
+    }
+    free(inner_keys);
+    free(table);
+    free(swiss);
+
+    // aggregation into tables of the working set size of every thread:
+    // the hash table at fill rate 1/2 and a dense array of the same groups
+    size_t aggr_buckets = largest_power_of_2_less_equal_n(
+        bytes / sizeof(bucket_aggr_t));
+    size_t groups = aggr_buckets / 2;
+    for (i = 0; i != tuples; ++i) {
+      stream[i] = 1 + next_random(&random) % groups;
+    }
+    const char* aggr_names[] = {"aggregate_atomic", "aggregate_private",
+                                "dense_atomic", "dense_private"};
+    int mode;
+    sprintf(param, "groups=%zu", groups);
+    for (mode = 0; mode != 4; ++mode) {
+      int hash = mode == AGGR_HASH_ATOMIC || mode == AGGR_HASH_PRIVATE;
+      memset(&best, 0, sizeof(best));
+      for (r = 0; r != REPEATS; ++r) {
+        timing_t t = {0, 0};
+        bench_aggregate(mode, stream, tuples, aggr_buckets, groups, threads,
+                        &t);
+        best_of(&best, &t);
+      }
+      report(aggr_names[mode], param, hash ?
+             aggr_buckets * sizeof(bucket_aggr_t) :
+             groups * sizeof(bucket_dense_t), tuples, threads, &best);
+    }
+  }
+
+  free(stream);
+  if (working_sets != default_working_sets) {
+    free(working_sets);
+  }
+  return EXIT_SUCCESS;
+}
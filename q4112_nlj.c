@@ -15,7 +15,7 @@ typedef struct {
   const uint32_t* outer_keys;
   const uint32_t* outer_vals;
   uint64_t sum;
-  uint32_t count;
+  uint64_t count;
 } q4112_run_info_t;
 
 void* q4112_run_thread(void* arg) {
@@ -40,7 +40,7 @@ void* q4112_run_thread(void* arg) {
 
   // initialize aggregate
   uint64_t sum = 0;
-  uint32_t count = 0;
+  uint64_t count = 0;
 
   // scan whole inner table but split outer table
   size_t i, o;
@@ -91,7 +91,7 @@ uint64_t q4112_run(
 
   // gather result
   uint64_t sum = 0;
-  uint32_t count = 0;
+  uint64_t count = 0;
   for (t = 0; t < threads; ++t) {
     pthread_join(info[t].id, NULL);
     sum += info[t].sum;
@@ -15,7 +15,7 @@ uint64_t q4112_run(
   assert(threads == 1);
 
   uint64_t sum = 0;
-  uint32_t count = 0;
+  uint64_t count = 0;
 
   size_t i, o;
   for (o = 0; o < outer_tuples; ++o) {
@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "q4112.h"
+
+// Frame-of-reference bit packing for input columns.
+//
+// Values are stored as (value - base) using the smallest bit width that fits
+// the column. Every block of Q4112_PACK_BLOCK values is laid out vertically
+// in Q4112_PACK_LANES lanes of 32-bit words: value j of a block goes to lane
+// j % 8 (row j / 8) and the rows of a lane are packed one after the other.
+// Lane l of word w is stored at words[w * 8 + l], so each row is decoded with
+// the same shift for all lanes, which the compiler turns into SIMD shifts
+// and masks over 8 words at a time. A block takes exactly bits * 32 bytes.
+//
+// Dictionary encoded columns pack codes (indexes into the dictionary of
+// distinct values) instead, e.g. orders.store_id only needs log2(groups)
+// bits although its values are random 32-bit keys.
+
+
+// smallest bits that fit every value of [0, max]
+static int8_t bits_for(uint32_t max) {
+  int8_t bits = 0;
+  while (bits != 32 && max >> bits) {
+    bits += 1;
+  }
+  return bits;
+}
+
+// pack values of [0, 2^bits) minus base
+static uint32_t* pack_words(const uint32_t* vals, size_t tuples,
+                            uint32_t base, int8_t bits) {
+  size_t i, b, r, l;
+
+  size_t blocks = (tuples + Q4112_PACK_BLOCK - 1) / Q4112_PACK_BLOCK;
+  // one spare word per lane so that constant columns (0 bits) allocate too
+  uint32_t* words = (uint32_t*)
+      calloc(blocks * bits * Q4112_PACK_LANES + Q4112_PACK_LANES, 4);
+  assert(words != NULL);
+
+  for (b = 0; b != blocks; ++b) {
+    uint32_t* out = &words[b * bits * Q4112_PACK_LANES];
+    for (r = 0; r != 32; ++r) {
+      size_t offset = r * bits;
+      size_t w = offset / 32, shift = offset % 32;
+      for (l = 0; l != Q4112_PACK_LANES; ++l) {
+        i = b * Q4112_PACK_BLOCK + r * Q4112_PACK_LANES + l;
+        // pad the last block with the base value
+        uint32_t v = i < tuples ? vals[i] - base : 0;
+        if (bits == 0) continue;
+        out[w * Q4112_PACK_LANES + l] |= v << shift;
+        if (shift + bits > 32) {
+          out[(w + 1) * Q4112_PACK_LANES + l] |= v >> (32 - shift);
+        }
+      }
+    }
+  }
+
+  return words;
+}
+
+void q4112_pack(q4112_packed_t* col, const uint32_t* vals, size_t tuples) {
+  size_t i;
+
+  // frame of reference and bit width
+  uint32_t min = tuples ? vals[0] : 0, max = min;
+  for (i = 0; i != tuples; ++i) {
+    if (vals[i] < min) min = vals[i];
+    if (vals[i] > max) max = vals[i];
+  }
+  int8_t bits = bits_for(max - min);
+
+  col->words = pack_words(vals, tuples, min, bits);
+  col->tuples = tuples;
+  col->base = min;
+  col->bits = bits;
+  col->dict = NULL;
+  col->dict_size = 0;
+}
+
+int q4112_pack_dict(q4112_packed_t* col, const uint32_t* vals, size_t tuples,
+                    size_t max_dict_size) {
+  size_t i, buckets = 2;
+  while (buckets < max_dict_size * 2) {
+    buckets += buckets;
+  }
+  int8_t log_buckets = bits_for(buckets - 1);
+
+  // hash table from value to code (~0 means empty bucket)
+  uint32_t* table = (uint32_t*) malloc(buckets * 4);
+  assert(table != NULL);
+  for (i = 0; i != buckets; ++i) {
+    table[i] = ~0u;
+  }
+  uint32_t* dict = (uint32_t*) malloc((max_dict_size + 1) * 4);
+  assert(dict != NULL);
+  uint32_t* codes = (uint32_t*) malloc((tuples + 1) * 4);
+  assert(codes != NULL);
+
+  // assign codes in order of first appearance
+  size_t dict_size = 0;
+  for (i = 0; i != tuples; ++i) {
+    uint32_t v = vals[i];
+    size_t h = (uint32_t) (v * 0x9e3779b1);
+    h >>= 32 - log_buckets;
+    while (table[h] != ~0u && dict[table[h]] != v) {
+      h = (h + 1) & (buckets - 1);
+    }
+    if (table[h] == ~0u) {
+      // too many distinct values for a dictionary
+      if (dict_size == max_dict_size) {
+        free(table);
+        free(dict);
+        free(codes);
+        return 0;
+      }
+      dict[dict_size] = v;
+      table[h] = dict_size++;
+    }
+    codes[i] = table[h];
+  }
+
+  int8_t bits = bits_for(dict_size ? dict_size - 1 : 0);
+  col->words = pack_words(codes, tuples, 0, bits);
+  col->tuples = tuples;
+  col->base = 0;
+  col->bits = bits;
+  col->dict = dict;
+  col->dict_size = dict_size;
+  free(table);
+  free(codes);
+  return 1;
+}
+
+void q4112_unpack_codes(const q4112_packed_t* col, size_t block, uint32_t* out) {
+  const int8_t bits = col->bits;
+  const uint32_t base = col->base;
+  const uint32_t mask = bits == 32 ? ~0u : (1u << bits) - 1;
+  const uint32_t* in = &col->words[block * bits * Q4112_PACK_LANES];
+  size_t r, l;
+
+  if (bits == 0) {
+    for (l = 0; l != Q4112_PACK_BLOCK; ++l) {
+      out[l] = base;
+    }
+    return;
+  }
+  for (r = 0; r != 32; ++r) {
+    size_t offset = r * bits;
+    size_t shift = offset % 32;
+    const uint32_t* lo = &in[(offset / 32) * Q4112_PACK_LANES];
+    const uint32_t* hi = lo + Q4112_PACK_LANES;
+    uint32_t* row = &out[r * Q4112_PACK_LANES];
+    if (shift + bits <= 32) {
+      for (l = 0; l != Q4112_PACK_LANES; ++l) {
+        row[l] = ((lo[l] >> shift) & mask) + base;
+      }
+    } else {
+      // value spans two words of the lane
+      for (l = 0; l != Q4112_PACK_LANES; ++l) {
+        row[l] = (((lo[l] >> shift) | (hi[l] << (32 - shift))) & mask) + base;
+      }
+    }
+  }
+}
+
+void q4112_unpack_block(const q4112_packed_t* col, size_t block, uint32_t* out) {
+  q4112_unpack_codes(col, block, out);
+  if (col->dict != NULL) {
+    const uint32_t* dict = col->dict;
+    size_t i;
+    for (i = 0; i != Q4112_PACK_BLOCK; ++i) {
+      out[i] = dict[out[i]];
+    }
+  }
+}
+
+size_t q4112_packed_bytes(const q4112_packed_t* col) {
+  size_t blocks = (col->tuples + Q4112_PACK_BLOCK - 1) / Q4112_PACK_BLOCK;
+  return blocks * col->bits * Q4112_PACK_LANES * 4 + col->dict_size * 4;
+}
+
+void q4112_packed_free(q4112_packed_t* col) {
+  free(col->words);
+  free(col->dict);
+  col->words = NULL;
+  col->dict = NULL;
+  col->tuples = 0;
+  col->dict_size = 0;
+}
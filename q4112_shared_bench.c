@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "q4112.h"
+
+// compare N separate runs with one shared scan of orders for N queries that
+// differ in their snapshot of items.price
+// usage: q4112_shared_bench [queries] [inner_tuples] [outer_tuples] [groups]
+//                           [threads]
+// (prints one CSV line per mode)
+
+uint64_t real_time(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t queries      = argc > 1 ? atoll(argv[1]) : 8;
+  size_t inner_tuples = argc > 2 ? atoll(argv[2]) : 100000;
+  size_t outer_tuples = argc > 3 ? atoll(argv[3]) : 100000000;
+  size_t groups       = argc > 4 ? atoll(argv[4]) : 100;
+  int threads         = argc > 5 ? atoi(argv[5]) : max_threads;
+  assert(queries > 0);
+  assert(inner_tuples > 0 && inner_tuples <= outer_tuples);
+  assert(groups > 0 && groups <= outer_tuples);
+  assert(threads > 0 && threads <= max_threads);
+  size_t q, i;
+
+  uint32_t* inner_keys = (uint32_t*) malloc(inner_tuples * 4);
+  assert(inner_keys != NULL);
+  uint32_t* outer_join_keys = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_join_keys != NULL);
+  uint32_t* outer_aggr_keys = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_aggr_keys != NULL);
+  uint32_t* outer_vals = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_vals != NULL);
+
+  // the first query uses the generated prices, the others derived ones
+  q4112_shared_query_t* shared = (q4112_shared_query_t*)
+      malloc(queries * sizeof(q4112_shared_query_t));
+  assert(shared != NULL);
+  uint32_t** inner_vals = (uint32_t**) malloc(queries * sizeof(uint32_t*));
+  assert(inner_vals != NULL);
+  for (q = 0; q != queries; ++q) {
+    inner_vals[q] = (uint32_t*) malloc(inner_tuples * 4);
+    assert(inner_vals[q] != NULL);
+  }
+  uint64_t gen_res = q4112_gen(inner_keys, inner_vals[0], inner_tuples,
+      1.0, 99999,
+      outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples,
+      1.0, 99999, groups, 0, 0.0);
+  for (q = 1; q != queries; ++q) {
+    for (i = 0; i != inner_tuples; ++i) {
+      inner_vals[q][i] = (inner_vals[0][i] * (q + 1)) % 99999 + 1;
+    }
+  }
+  for (q = 0; q != queries; ++q) {
+    shared[q].inner_keys = inner_keys;
+    shared[q].inner_vals = inner_vals[q];
+    shared[q].inner_tuples = inner_tuples;
+  }
+
+  // one run per query
+  uint64_t* separate = (uint64_t*) malloc(queries * sizeof(uint64_t));
+  assert(separate != NULL);
+  uint64_t separate_ns = real_time();
+  for (q = 0; q != queries; ++q) {
+    separate[q] = q4112_run(inner_keys, inner_vals[q], inner_tuples,
+        outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples, threads);
+  }
+  separate_ns = real_time() - separate_ns;
+
+  // one scan for all queries
+  uint64_t shared_ns = real_time();
+  q4112_run_shared(shared, queries, outer_join_keys, outer_aggr_keys,
+                   outer_vals, outer_tuples, threads, NULL);
+  shared_ns = real_time() - shared_ns;
+
+  // validate results
+  assert(separate[0] == gen_res);
+  for (q = 0; q != queries; ++q) {
+    assert(shared[q].result == separate[q]);
+  }
+
+  printf("%s,%s,%s,%s,%s,%s,%s\n", "queries", "inner_tuples", "outer_tuples",
+         "groups", "threads", "mode", "nanoseconds");
+  printf("%zu,%zu,%zu,%zu,%d,%s,%llu\n", queries, inner_tuples, outer_tuples,
+         groups, threads, "separate", (unsigned long long) separate_ns);
+  printf("%zu,%zu,%zu,%zu,%d,%s,%llu\n", queries, inner_tuples, outer_tuples,
+         groups, threads, "shared", (unsigned long long) shared_ns);
+
+  for (q = 0; q != queries; ++q) {
+    free(inner_vals[q]);
+  }
+  free(inner_vals);
+  free(shared);
+  free(separate);
+  free(inner_keys);
+  free(outer_join_keys);
+  free(outer_aggr_keys);
+  free(outer_vals);
+  return EXIT_SUCCESS;
+}
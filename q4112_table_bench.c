@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "q4112.h"
+
+// compare the join table layouts and build modes of q4112_run_options
+// usage: q4112_table_bench [outer_tuples] [groups] [threads] [inner_tuples...]
+// (prints one CSV line per run, default inner tuples: 100, 100K and 100M)
+
+uint64_t real_time(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t outer_tuples = argc > 1 ? atoll(argv[1]) : 100000000;
+  size_t groups       = argc > 2 ? atoll(argv[2]) : 100;
+  int threads         = argc > 3 ? atoi(argv[3]) : max_threads;
+  assert(threads > 0 && threads <= max_threads);
+
+  size_t default_inner_tuples[] = {100, 100000, 100000000};
+  size_t* inner_tuples = default_inner_tuples;
+  int s, sizes = 3;
+  if (argc > 4) {
+    sizes = argc - 4;
+    inner_tuples = (size_t*) malloc(sizes * sizeof(size_t));
+    assert(inner_tuples != NULL);
+    for (s = 0; s != sizes; ++s) {
+      inner_tuples[s] = atoll(argv[s + 4]);
+    }
+  }
+
+  q4112_table_t layouts[] = {Q4112_TABLE_LINEAR, Q4112_TABLE_SWISS};
+  const char* layout_names[] = {"linear", "swiss"};
+  q4112_build_t builds[] = {Q4112_BUILD_PARTITIONED, Q4112_BUILD_ATOMIC};
+  const char* build_names[] = {"partitioned", "atomic"};
+  int l, b, repeat;
+
+  printf("%s,%s,%s,%s,%s,%s,%s\n", "inner_tuples", "outer_tuples", "groups",
+         "threads", "table", "build", "nanoseconds");
+  for (s = 0; s != sizes; ++s) {
+    assert(inner_tuples[s] <= outer_tuples);
+    uint32_t* inner_keys = (uint32_t*) malloc(inner_tuples[s] * 4);
+    assert(inner_keys != NULL);
+    uint32_t* inner_vals = (uint32_t*) malloc(inner_tuples[s] * 4);
+    assert(inner_vals != NULL);
+    uint32_t* outer_join_keys = (uint32_t*) malloc(outer_tuples * 4);
+    assert(outer_join_keys != NULL);
+    uint32_t* outer_aggr_keys = (uint32_t*) malloc(outer_tuples * 4);
+    assert(outer_aggr_keys != NULL);
+    uint32_t* outer_vals = (uint32_t*) malloc(outer_tuples * 4);
+    assert(outer_vals != NULL);
+
+    uint64_t gen_res = q4112_gen(inner_keys, inner_vals, inner_tuples[s],
+        1.0, 99999,
+        outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples,
+        1.0, 99999, groups, 0, 0.0);
+
+    for (repeat = 1; repeat <= 3; ++repeat) {
+      for (l = 0; l != 2; ++l) {
+      for (b = 0; b != 2; ++b) {
+        q4112_options_t options;
+        q4112_options_init(&options);
+        options.table = layouts[l];
+        options.build = builds[b];
+
+        uint64_t run_ns = real_time();
+        uint64_t run_res = q4112_run_options(inner_keys, inner_vals,
+            inner_tuples[s], outer_join_keys, outer_aggr_keys, outer_vals,
+            outer_tuples, threads, &options);
+        run_ns = real_time() - run_ns;
+        assert(gen_res == run_res);
+
+        printf("%zu,%zu,%zu,%d,%s,%s,%llu\n", inner_tuples[s], outer_tuples,
+               groups, threads, layout_names[l], build_names[b],
+               (unsigned long long) run_ns);
+        fflush(stdout);
+      }
+      }
+    }
+
+    free(inner_keys);
+    free(inner_vals);
+    free(outer_join_keys);
+    free(outer_aggr_keys);
+    free(outer_vals);
+  }
+  if (inner_tuples != default_inner_tuples) {
+    free(inner_tuples);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,413 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "q4112.h"
+#include "q4112_barrier.h"
+
+// Query on columns with 32-bit or 64-bit keys and values.
+//
+// If all columns are 32-bit the query runs on the 32-bit engine, so the
+// common workload keeps its fast path. Otherwise the threads build a shared
+// linear probing table of 64-bit keys with compare-and-swap and probe it,
+// aggregating into a private hash table each: 128-bit sums cannot be added
+// atomically, so groups are merged afterwards, in parallel, with thread t
+// merging the groups of hash partition t of all threads.
+//
+// The kernels load every column with its width as a compile-time constant,
+// and the dispatchers pick the instantiation once per thread.
+
+
+#define KERNEL static inline __attribute__((always_inline))
+
+// bucket of the join table
+typedef struct {
+  uint64_t key;
+  uint64_t val;
+} bucket_wide_t;
+
+// bucket of an aggregation table
+typedef struct {
+  uint64_t key;
+  uint64_t count;
+  q4112_u128_t sum;
+} group_wide_t;
+
+// hash aggregation table of one thread (grows when half full)
+typedef struct {
+  group_wide_t* groups;
+  size_t buckets;
+  int8_t log_buckets;
+  size_t size;
+} aggr_wide_t;
+
+// smallest aggregation table
+#define AGGR_WIDE_MIN_BUCKETS 1024
+
+typedef struct q4112_wide_info q4112_wide_info_t;
+
+struct q4112_wide_info {
+  pthread_t id;
+  q4112_barrier_t* barrier;  // shared by the threads of the query
+  int thread;
+  int threads;
+  const q4112_column_t* inner_keys;
+  const q4112_column_t* inner_vals;
+  size_t inner_tuples;
+  const q4112_column_t* outer_join_keys;
+  const q4112_column_t* outer_aggr_keys;  // NULL for the ungrouped query
+  const q4112_column_t* outer_vals;
+  size_t outer_tuples;
+  bucket_wide_t* table;
+  int8_t log_buckets;
+  size_t buckets;
+  aggr_wide_t local;
+  // ungrouped query: sum and count, grouped query: sum of the averages and
+  // number of groups of the partition of this thread
+  q4112_u128_t sum;
+  uint64_t count;
+  const q4112_wide_info_t* all;  // info of all threads
+};
+
+
+KERNEL uint64_t load(const void* data, size_t i, const int wide) {
+  return wide ? ((const uint64_t*) data)[i] : ((const uint32_t*) data)[i];
+}
+
+// multiplicative hashing (the high bits are the bucket)
+static inline uint64_t hash_wide(uint64_t key) {
+  return key * 0x9e3779b97f4a7c15ull;
+}
+
+// partition of a group for the merge (independent of the table hash, so
+// that each partition spreads over all buckets of its table)
+static inline size_t partition_of(uint64_t key, size_t threads) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return ((key >> 32) * threads) >> 32;
+}
+
+static void aggr_wide_init(aggr_wide_t* table, size_t buckets) {
+  table->log_buckets = 0;
+  while (((size_t) 1 << table->log_buckets) < buckets) {
+    table->log_buckets += 1;
+  }
+  table->buckets = (size_t) 1 << table->log_buckets;
+  table->size = 0;
+  // there are no 0 keys so we use 0 for "no key"
+  table->groups = (group_wide_t*) calloc(table->buckets, sizeof(group_wide_t));
+  assert(table->groups != NULL);
+}
+
+// add to a group, creating it if needed
+static inline void aggr_wide_add(aggr_wide_t* table, uint64_t key,
+                                 q4112_u128_t sum, uint64_t count);
+
+// double the buckets of an aggregation table
+static void aggr_wide_grow(aggr_wide_t* table) {
+  aggr_wide_t grown;
+  size_t i;
+  aggr_wide_init(&grown, table->buckets * 2);
+  for (i = 0; i != table->buckets; ++i) {
+    if (table->groups[i].key != 0) {
+      aggr_wide_add(&grown, table->groups[i].key, table->groups[i].sum,
+                    table->groups[i].count);
+    }
+  }
+  free(table->groups);
+  *table = grown;
+}
+
+static inline void aggr_wide_add(aggr_wide_t* table, uint64_t key,
+                                 q4112_u128_t sum, uint64_t count) {
+  size_t h = hash_wide(key) >> (64 - table->log_buckets);
+  group_wide_t* groups = table->groups;
+  while (groups[h].key != key) {
+    if (groups[h].key == 0) {
+      // new group: keep the table at most half full
+      if (2 * (table->size + 1) > table->buckets) {
+        aggr_wide_grow(table);
+        aggr_wide_add(table, key, sum, count);
+        return;
+      }
+      groups[h].key = key;
+      table->size += 1;
+      break;
+    }
+    h = (h + 1) & (table->buckets - 1);
+  }
+  groups[h].sum += sum;
+  groups[h].count += count;
+}
+
+// insert the inner tuples of this thread into the join table
+KERNEL void build_kernel(q4112_wide_info_t* info, const int keys_wide,
+                         const int vals_wide) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  size_t inner_tuples = info->inner_tuples;
+  const void* inner_keys = info->inner_keys->data;
+  const void* inner_vals = info->inner_vals->data;
+  bucket_wide_t* table = info->table;
+  int8_t log_buckets = info->log_buckets;
+  size_t buckets = info->buckets;
+
+  // set thread boundaries for inner table
+  size_t inner_beg = (inner_tuples / threads) * (thread + 0);
+  size_t inner_end = (inner_tuples / threads) * (thread + 1);
+  // fix boundary for last thread
+  if (thread + 1 == threads) inner_end = inner_tuples;
+
+  size_t i;
+  for (i = inner_beg; i != inner_end; ++i) {
+    uint64_t key = load(inner_keys, i, keys_wide);
+    size_t h = hash_wide(key) >> (64 - log_buckets);
+    // claim an empty bucket with compare-and-swap
+    while (table[h].key != 0 ||
+           !__sync_bool_compare_and_swap(&table[h].key, 0, key)) {
+      h = (h + 1) & (buckets - 1);
+    }
+    table[h].val = load(inner_vals, i, vals_wide);
+  }
+}
+
+// join the outer tuples of this thread and aggregate them, either into the
+// private aggregation table or into a single sum and count
+KERNEL void probe_kernel(q4112_wide_info_t* info, const int keys_wide,
+                         const int aggr_keys_wide, const int vals_wide,
+                         const int grouped) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  size_t outer_tuples = info->outer_tuples;
+  const void* outer_keys = info->outer_join_keys->data;
+  const void* outer_aggr_keys = grouped ? info->outer_aggr_keys->data : NULL;
+  const void* outer_vals = info->outer_vals->data;
+  const bucket_wide_t* table = info->table;
+  int8_t log_buckets = info->log_buckets;
+  size_t buckets = info->buckets;
+
+  // set thread boundaries for outer table
+  size_t outer_beg = (outer_tuples / threads) * (thread + 0);
+  size_t outer_end = (outer_tuples / threads) * (thread + 1);
+  // fix boundary for last thread
+  if (thread + 1 == threads) outer_end = outer_tuples;
+
+  q4112_u128_t sum = 0;
+  uint64_t count = 0;
+  size_t o;
+  for (o = outer_beg; o != outer_end; ++o) {
+    uint64_t key = load(outer_keys, o, keys_wide);
+    size_t h = hash_wide(key) >> (64 - log_buckets);
+    while (table[h].key != 0 && table[h].key != key) {
+      h = (h + 1) & (buckets - 1);
+    }
+    if (table[h].key == 0) continue;
+    q4112_u128_t product = (q4112_u128_t) table[h].val *
+                           load(outer_vals, o, vals_wide);
+    if (grouped) {
+      aggr_wide_add(&info->local, load(outer_aggr_keys, o, aggr_keys_wide),
+                    product, 1);
+    } else {
+      sum += product;
+      count += 1;
+    }
+  }
+  info->sum = sum;
+  info->count = count;
+}
+
+// instantiate the probe kernel for the widths of the columns
+#define PROBE_KERNEL(keys_wide, aggr_keys_wide, vals_wide, grouped) \
+  case (keys_wide) * 8 + (aggr_keys_wide) * 4 + (vals_wide) * 2 + (grouped): \
+    probe_kernel(info, keys_wide, aggr_keys_wide, vals_wide, grouped); \
+    break
+
+static void probe_wide(q4112_wide_info_t* info) {
+  int grouped = info->outer_aggr_keys != NULL;
+  int keys_wide = info->outer_join_keys->bits == 64;
+  int aggr_keys_wide = grouped && info->outer_aggr_keys->bits == 64;
+  int vals_wide = info->outer_vals->bits == 64;
+  switch (keys_wide * 8 + aggr_keys_wide * 4 + vals_wide * 2 + grouped) {
+    PROBE_KERNEL(0, 0, 0, 0);
+    PROBE_KERNEL(0, 0, 0, 1);
+    PROBE_KERNEL(0, 0, 1, 0);
+    PROBE_KERNEL(0, 0, 1, 1);
+    PROBE_KERNEL(0, 1, 0, 1);
+    PROBE_KERNEL(0, 1, 1, 1);
+    PROBE_KERNEL(1, 0, 0, 0);
+    PROBE_KERNEL(1, 0, 0, 1);
+    PROBE_KERNEL(1, 0, 1, 0);
+    PROBE_KERNEL(1, 0, 1, 1);
+    PROBE_KERNEL(1, 1, 0, 1);
+    PROBE_KERNEL(1, 1, 1, 1);
+    default:
+      assert(0);
+  }
+}
+
+static void build_wide(q4112_wide_info_t* info) {
+  int keys_wide = info->inner_keys->bits == 64;
+  int vals_wide = info->inner_vals->bits == 64;
+  if (keys_wide) {
+    if (vals_wide) build_kernel(info, 1, 1);
+    else build_kernel(info, 1, 0);
+  } else {
+    if (vals_wide) build_kernel(info, 0, 1);
+    else build_kernel(info, 0, 0);
+  }
+}
+
+// merge the groups of the partition of this thread from all threads and
+// sum up their averages
+static void merge_partition(q4112_wide_info_t* info) {
+  size_t thread  = info->thread;
+  size_t threads = info->threads;
+  size_t t, i;
+
+  aggr_wide_t merged;
+  aggr_wide_init(&merged, AGGR_WIDE_MIN_BUCKETS);
+  for (t = 0; t != threads; ++t) {
+    const aggr_wide_t* local = &info->all[t].local;
+    for (i = 0; i != local->buckets; ++i) {
+      const group_wide_t* group = &local->groups[i];
+      if (group->key != 0 && partition_of(group->key, threads) == thread) {
+        aggr_wide_add(&merged, group->key, group->sum, group->count);
+      }
+    }
+  }
+
+  q4112_u128_t sum_avgs = 0;
+  for (i = 0; i != merged.buckets; ++i) {
+    if (merged.groups[i].key != 0) {
+      sum_avgs += merged.groups[i].sum / merged.groups[i].count;
+    }
+  }
+  info->sum = sum_avgs;
+  info->count = merged.size;
+  free(merged.groups);
+}
+
+void* q4112_wide_thread(void* arg) {
+  q4112_wide_info_t* info = (q4112_wide_info_t*) arg;
+  assert(pthread_equal(pthread_self(), info->id));
+
+  build_wide(info);
+
+  // barrier wait for next stage: matching
+  q4112_barrier_wait(info->barrier);
+
+  probe_wide(info);
+  if (info->outer_aggr_keys == NULL) {
+    pthread_exit(NULL);
+  }
+
+  // barrier wait for next stage: merging
+  q4112_barrier_wait(info->barrier);
+
+  merge_partition(info);
+  pthread_exit(NULL);
+}
+
+q4112_u128_t q4112_run_wide(
+    const q4112_column_t* inner_keys,
+    const q4112_column_t* inner_vals,
+    size_t inner_tuples,
+    const q4112_column_t* outer_join_keys,
+    const q4112_column_t* outer_aggr_keys,
+    const q4112_column_t* outer_vals,
+    size_t outer_tuples,
+    int threads,
+    const q4112_options_t* options) {
+  assert(inner_keys->bits == 32 || inner_keys->bits == 64);
+  assert(inner_vals->bits == 32 || inner_vals->bits == 64);
+  assert(outer_join_keys->bits == 32 || outer_join_keys->bits == 64);
+  assert(outer_aggr_keys == NULL ||
+         outer_aggr_keys->bits == 32 || outer_aggr_keys->bits == 64);
+  assert(outer_vals->bits == 32 || outer_vals->bits == 64);
+
+  // 32-bit columns: fast path
+  if (inner_keys->bits == 32 && inner_vals->bits == 32 &&
+      outer_join_keys->bits == 32 && outer_vals->bits == 32 &&
+      (outer_aggr_keys == NULL || outer_aggr_keys->bits == 32)) {
+    return q4112_run_options(
+        (const uint32_t*) inner_keys->data,
+        (const uint32_t*) inner_vals->data, inner_tuples,
+        (const uint32_t*) outer_join_keys->data,
+        outer_aggr_keys ? (const uint32_t*) outer_aggr_keys->data : NULL,
+        (const uint32_t*) outer_vals->data, outer_tuples,
+        threads, options);
+  }
+
+  // predicates are evaluated by the 32-bit engine only
+  assert(options == NULL || options->num_predicates == 0);
+
+  // check number of threads
+  int t, max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  assert(max_threads > 0 && threads > 0 && threads <= max_threads);
+
+  // set the number of hash table buckets to be 2^k
+  // the hash table fill rate will be between 1/3 and 2/3
+  int8_t log_buckets = 1;
+  size_t buckets = 2;
+  while (buckets * 0.67 < inner_tuples) {
+    log_buckets += 1;
+    buckets += buckets;
+  }
+  // there are no 0 keys (see header) so we use 0 for "no key"
+  bucket_wide_t* table = (bucket_wide_t*)
+      calloc(buckets, sizeof(bucket_wide_t));
+  assert(table != NULL);
+
+  q4112_barrier_t barrier;
+  q4112_barrier_init(&barrier, threads);
+
+  q4112_wide_info_t* info = (q4112_wide_info_t*)
+      malloc(threads * sizeof(q4112_wide_info_t));
+  assert(info != NULL);
+  for (t = 0; t != threads; ++t) {
+    memset(&info[t], 0, sizeof(q4112_wide_info_t));
+    info[t].barrier = &barrier;
+    info[t].thread = t;
+    info[t].threads = threads;
+    info[t].inner_keys = inner_keys;
+    info[t].inner_vals = inner_vals;
+    info[t].inner_tuples = inner_tuples;
+    info[t].outer_join_keys = outer_join_keys;
+    info[t].outer_aggr_keys = outer_aggr_keys;
+    info[t].outer_vals = outer_vals;
+    info[t].outer_tuples = outer_tuples;
+    info[t].table = table;
+    info[t].log_buckets = log_buckets;
+    info[t].buckets = buckets;
+    info[t].all = info;
+    if (outer_aggr_keys != NULL) {
+      aggr_wide_init(&info[t].local, AGGR_WIDE_MIN_BUCKETS);
+    }
+    pthread_create(&info[t].id, NULL, q4112_wide_thread, &info[t]);
+  }
+
+  // gather result
+  q4112_u128_t sum = 0;
+  uint64_t count = 0;
+  for (t = 0; t != threads; ++t) {
+    pthread_join(info[t].id, NULL);
+    sum += info[t].sum;
+    count += info[t].count;
+  }
+
+  // clean up
+  for (t = 0; t != threads; ++t) {
+    free(info[t].local.groups);
+  }
+  free(info);
+  free(table);
+
+  // average of the averages of the groups (or of the tuples if ungrouped)
+  return count == 0 ? 0 : sum / count;
+}
@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "q4112.h"
+
+// compare q4112_run_wide on 32-bit columns (fast path), on 64-bit keys and
+// on 64-bit keys and values with q4112_run (the 64-bit keys are the
+// generated keys shifted above 2^32, so all results are the same)
+// usage: q4112_wide_bench [inner_tuples] [outer_tuples] [groups] [threads]
+// (prints one CSV line per run, groups 0 runs the query without GROUP BY)
+
+uint64_t real_time(void) {
+  struct timespec t;
+  assert(clock_gettime(CLOCK_REALTIME, &t) == 0);
+  return t.tv_sec * 1000 * 1000 * 1000 + t.tv_nsec;
+}
+
+// copy of a 32-bit column with 64-bit values (keys above 2^32 if shifted)
+static uint64_t* widen(const uint32_t* col, size_t tuples, int shift) {
+  uint64_t* wide = (uint64_t*) malloc(tuples * 8 + 8);
+  assert(wide != NULL);
+  size_t i;
+  for (i = 0; i != tuples; ++i) {
+    wide[i] = shift ? ((uint64_t) col[i] << 32) | col[i] : col[i];
+  }
+  return wide;
+}
+
+int main(int argc, char* argv[]) {
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t inner_tuples = argc > 1 ? atoll(argv[1]) : 100000;
+  size_t outer_tuples = argc > 2 ? atoll(argv[2]) : 100000000;
+  size_t groups       = argc > 3 ? atoll(argv[3]) : 100;
+  int threads         = argc > 4 ? atoi(argv[4]) : max_threads;
+  assert(inner_tuples > 0 && inner_tuples <= outer_tuples);
+  assert(groups <= outer_tuples);
+  assert(threads > 0 && threads <= max_threads);
+
+  uint32_t* inner_keys = (uint32_t*) malloc(inner_tuples * 4);
+  assert(inner_keys != NULL);
+  uint32_t* inner_vals = (uint32_t*) malloc(inner_tuples * 4);
+  assert(inner_vals != NULL);
+  uint32_t* outer_join_keys = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_join_keys != NULL);
+  uint32_t* outer_aggr_keys = NULL;
+  if (groups > 0) {
+    outer_aggr_keys = (uint32_t*) malloc(outer_tuples * 4);
+    assert(outer_aggr_keys != NULL);
+  }
+  uint32_t* outer_vals = (uint32_t*) malloc(outer_tuples * 4);
+  assert(outer_vals != NULL);
+
+  uint64_t gen_res = q4112_gen(inner_keys, inner_vals, inner_tuples,
+      1.0, 99999,
+      outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples,
+      1.0, 99999, groups, 0, 0.0);
+
+  uint64_t* inner_keys64 = widen(inner_keys, inner_tuples, 1);
+  uint64_t* inner_vals64 = widen(inner_vals, inner_tuples, 0);
+  uint64_t* outer_join_keys64 = widen(outer_join_keys, outer_tuples, 1);
+  uint64_t* outer_aggr_keys64 = groups > 0 ?
+      widen(outer_aggr_keys, outer_tuples, 1) : NULL;
+  uint64_t* outer_vals64 = widen(outer_vals, outer_tuples, 0);
+
+  // 32-bit columns, 64-bit keys and 64-bit keys and values
+  q4112_column_t cols[3][5] = {
+    {{inner_keys, 32}, {inner_vals, 32}, {outer_join_keys, 32},
+     {outer_aggr_keys, 32}, {outer_vals, 32}},
+    {{inner_keys64, 64}, {inner_vals, 32}, {outer_join_keys64, 64},
+     {outer_aggr_keys64, 64}, {outer_vals, 32}},
+    {{inner_keys64, 64}, {inner_vals64, 64}, {outer_join_keys64, 64},
+     {outer_aggr_keys64, 64}, {outer_vals64, 64}}};
+  const char* names[] = {"wide_32", "wide_keys_64", "wide_all_64"};
+  int m;
+
+  printf("%s,%s,%s,%s,%s,%s\n", "inner_tuples", "outer_tuples", "groups",
+         "threads", "mode", "nanoseconds");
+
+  uint64_t run_ns = real_time();
+  uint64_t run_res = q4112_run(inner_keys, inner_vals, inner_tuples,
+      outer_join_keys, outer_aggr_keys, outer_vals, outer_tuples, threads);
+  run_ns = real_time() - run_ns;
+  assert(run_res == gen_res);
+  printf("%zu,%zu,%zu,%d,%s,%llu\n", inner_tuples, outer_tuples, groups,
+         threads, "run_32", (unsigned long long) run_ns);
+
+  for (m = 0; m != 3; ++m) {
+    uint64_t wide_ns = real_time();
+    q4112_u128_t wide_res = q4112_run_wide(&cols[m][0], &cols[m][1],
+        inner_tuples, &cols[m][2], groups > 0 ? &cols[m][3] : NULL,
+        &cols[m][4], outer_tuples, threads, NULL);
+    wide_ns = real_time() - wide_ns;
+    assert(wide_res == gen_res);
+    printf("%zu,%zu,%zu,%d,%s,%llu\n", inner_tuples, outer_tuples, groups,
+           threads, names[m], (unsigned long long) wide_ns);
+  }
+
+  free(inner_keys);
+  free(inner_vals);
+  free(outer_join_keys);
+  free(outer_aggr_keys);
+  free(outer_vals);
+  free(inner_keys64);
+  free(inner_vals64);
+  free(outer_join_keys64);
+  free(outer_aggr_keys64);
+  free(outer_vals64);
+  return EXIT_SUCCESS;
+}